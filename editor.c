@@ -16,12 +16,39 @@
 #include <time.h>
 #include <termios.h>
 #include <stdlib.h>
+#include <signal.h>
+#include <limits.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <zlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <dirent.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 /* *** Defines *** */
 
 #define EDITOR_VERSION "0.1.0"
 #define EDITOR_TAB_SIZE 4
 #define EDIOTR_QUIT_TIMES 3
+#define EDITOR_MEM_BUDGET_MB 256
+#define EDITOR_JOURNAL_BUF (64 << 10)
+#define EDITOR_JOURNAL_SYNC_MS 1000
+#define EDITOR_BLOCK_SIZE (4 << 20)
+#define EDITOR_FIRST_BLOCK_SIZE (64 << 10)
+#define EDITOR_FRAME_MS 16
+#define EDITOR_STATUS_MSG_MS 5000
+#define EDITOR_UNDO_MAX_ENTRIES (1 << 18)
+#define EDITOR_UNDO_MAX_MB 64
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 
@@ -49,6 +76,21 @@ enum editorHighlight {
 	HL_MATCH
 };
 
+enum editorUndoType {
+	UNDO_INSERT_ROW = 0,
+	UNDO_DELETE_ROW,
+	UNDO_INSERT_CHARS,
+	UNDO_DELETE_CHARS,
+	UNDO_SET_ROW,
+	UNDO_INSERT_ROWS,
+	UNDO_DELETE_ROWS,
+	UNDO_PERMUTE_ROWS,
+	UNDO_FILTER_ROWS
+};
+
+#define BRACKET_NONE (INT_MAX / 4)	/* в строке нет скобок */
+#define BRACKET_UNKNOWN INT_MIN		/* строка ещё не подсвечивалась */
+
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
@@ -64,36 +106,241 @@ struct editorSyntax {
 	int flags;
 };
 
+/*
+ * Неизменяемый кусок текста файла с подсчётом ссылок. Строки, прочитанные
+ * из файла, указывают прямо в него и копируют текст только при первой правке.
+ */
+typedef struct editor_block_s {
+	int refs;
+	size_t size;
+	char data[];
+} editor_block_t;
+
+/*
+ * Текст строки: ссылка на блок или, если block == NULL, собственный буфер.
+ */
+typedef struct editor_span_s {
+	char *s;				/* завершён '\0' */
+	int len;
+	editor_block_t *block;
+} editor_span_t;
+
+/*
+ * Строки буфера обмена, лежащие в блоке подряд, каждая завершена '\0'.
+ */
+typedef struct editor_clip_run_s {
+	editor_block_t *block;
+	char *s;
+	size_t size;
+	int lines;
+} editor_clip_run_t;
+
+typedef struct diff_hunk_s {
+	int a_start, a_len;
+	int b_start, b_len;
+} diff_hunk_t;
+
+/*
+ * Скобки строки: изменение глубины вложенности и наименьшая глубина
+ * после и перед каждой скобкой относительно начала строки.
+ */
+typedef struct bracket_sum_s {
+	int depth;
+	int low_after;
+	int low_before;
+} bracket_sum_t;
+
+typedef struct bracket_node_s {
+	bracket_sum_t sum;			/* сводка строк узла, если в нём нет неизвестных групп */
+	int rows;					/* строк в узле */
+	int unknown;				/* групп со строками, которые ещё не подсвечивались */
+} bracket_node_t;
+
+typedef struct bracket_index_s {
+	bracket_node_t *node;		/* дерево отрезков над группами, node[1] -- корень */
+	int size;					/* листьев, степень двойки */
+	int groups;					/* групп строк: они занимают первые листья подряд */
+	int n;						/* строк в индексе */
+} bracket_index_t;
+
 typedef struct editor_row_s {
 	int idx;
 	int size;
 	int render_size;
 	char *chars;
+	editor_block_t *block;	/* NULL, если chars принадлежит строке */
 	char *render;
 	unsigned char *hl;
 	int hl_open_comment;
+	int ascii;
+	int tabs;
+	int render_cols;
+	bracket_sum_t brackets;
 } editor_row_t;
 
-struct editorConfig {
+typedef struct fenwick_s {
+	long long *tree;
+	int n;
+	int cap;
+} fenwick_t;
+
+typedef struct editor_undo_s {
+	int type;
+	int group;
+	int row;
+	int col;
+	int len;
+	char *text;
+	editor_span_t *spans;	/* удалённые строки для UNDO_DELETE_ROWS и UNDO_FILTER_ROWS */
+	size_t bytes;			/* память под text и spans */
+	int cx, cy;
+} editor_undo_t;
+
+typedef void (*editor_line_fn)(void *ctx, char *s, int len, editor_block_t *block);
+
+typedef struct editor_reader_s {
+	int fd;						/* откуда читаются данные: файл или канал распаковщика */
+	int src_fd;					/* сам файл */
+	editor_block_t *next;		/* следующий блок с уже перенесённым хвостом */
+	size_t carry;
+	size_t offset;				/* сколько байт прочитано (после распаковки) */
+	size_t block_size;
+	int compression;
+	void *stream;				/* состояние распаковки */
+	pid_t child;				/* внешний распаковщик, 0 если нет */
+	int eof;					/* поток дочитан до конца */
+} editor_reader_t;
+
+typedef struct editor_loader_s editor_loader_t;
+typedef struct cache_job_s cache_job_t;
+typedef struct editor_grep_s editor_grep_t;
+
+typedef struct editor_buffer_s {
 	int cx, cy;
 	int render_cx;
+	int render_cy;
 	int row_offset;
 	int col_offset;
-	int screen_rows;
-	int screen_cols;
 	int dirty;
 	int num_rows;
-	char status_msg[80];
-	time_t status_msg_time;
+	int row_cap;
 	editor_row_t *row;
 	char *file_name;
-	struct termios orig_termios;
 	struct editorSyntax *syntax;
+	editor_undo_t *undo;
+	int num_undo;
+	int undo_cap;
+	int undo_group;
+	int undo_suspend;
+	int undo_saved;			/* глубина журнала отмены на момент сохранения, -1 если недостижима */
+	size_t undo_bytes;
+	int wrap;
+	int wrap_offset;
+	int wrap_width;
+	int wrap_valid;
+	fenwick_t wrap_index;
+	int offset_valid;
+	fenwick_t offset_index;		/* длины строк в байтах вместе с '\n' */
+	long long text_bytes;		/* сумма длин строк вместе с '\n' */
+	int pos_row;				/* строка с известным смещением начала, обычно под курсором */
+	long long pos_offset;
+	unsigned long last_view;	/* когда буфер последний раз был на экране */
+	int watch;					/* inotify-наблюдение за каталогом файла, -1 если нет */
+	int disk_changed;			/* файл изменился на диске, ждём окончания записи */
+	long long disk_event_ms;
+	ino_t disk_ino;				/* состояние файла на момент чтения/записи */
+	off_t disk_size;
+	struct timespec disk_mtime;
+	int journal_fd;				/* журнал восстановления, -1 если не открыт */
+	int journal_pending;		/* найден журнал прошлого сеанса, восстановление не предложено */
+	int journal_suspend;
+	char *journal_buf;			/* ещё не записанный хвост журнала */
+	int journal_len;
+	int journal_unsynced;
+	long long journal_sync_ms;
+	editor_loader_t *loader;	/* фоновая загрузка файла, NULL если файл загружен */
+	int goto_row, goto_col;		/* куда поставить курсор, когда строка загрузится, -1 если некуда */
+	int follow;					/* режим слежения за дописыванием в файл */
+	int follow_fd;
+	char *follow_carry;			/* начало ещё не завершённой строки */
+	size_t follow_carry_len;
+	size_t follow_carry_cap;
+	int follow_open_row;		/* последняя строка буфера в файле ещё без '\n' */
+	long long follow_check_ms;
+	int hl_from, hl_to;			/* строки с отложенной подсветкой, -1 если нет */
+	int hl_stale;				/* первая строка с неверным состоянием комментария, -1 если нет */
+	size_t derived_bytes;		/* память под render и hl всех строк */
+	int render_rows;			/* строк, у которых построены render и hl */
+	int *render_log;			/* номера строк, получивших render, при ограниченном кэше */
+	int render_log_len;
+	int render_log_cap;
+	int diff;					/* режим сравнения с файлом на диске */
+	uint64_t *diff_base;		/* хеши строк файла на диске */
+	int diff_base_len;
+	int diff_base_cap;
+	diff_hunk_t *diff_hunks;	/* отличия буфера (b) от файла (a) */
+	int diff_num_hunks;
+	int diff_rows;				/* строк в буфере при последнем сравнении */
+	int diff_from, diff_to;		/* строки, изменённые после него, -1 если нет */
+	int hex;					/* просмотр файла на диске в hex */
+	int hex_binary;				/* двоичный файл, строки не загружены */
+	int hex_fd;					/* файл, открытый для чтения, или -1 */
+	size_t hex_size;
+	size_t hex_cursor;			/* смещение байта под курсором */
+	size_t hex_top;				/* первая строка по 16 байт на экране */
+	int bracket_valid;
+	bracket_index_t bracket_index;
+	int bracket_row, bracket_at;	/* пара скобки под курсором, -1 если нет */
+	int mark;					/* выделение от метки до курсора */
+	int mark_cx, mark_cy;
+	editor_grep_t *grep;		/* буфер -- результаты поиска по файлам */
+} editor_buffer_t;
+
+struct editorConfig {
+	editor_buffer_t *buf;
+	editor_buffer_t **buffers;
+	int num_buffers;
+	int screen_rows;
+	int screen_cols;
+	char status_msg[80];
+	long long status_msg_ms;
+	int status_msg_expiring;	/* нужна перерисовка, когда сообщение истечёт */
+	int redraw;					/* экран устарел, нужен кадр */
+	long long last_frame_ms;
+	struct termios orig_termios;
+	volatile sig_atomic_t resized;
+	volatile sig_atomic_t hangup;	/* номер пришедшего SIGHUP или SIGTERM, 0 если нет */
+	int render_suspend;		/* экран не перерисовывается, пока идёт макрос */
+	int hl_defer;			/* подсветка изменённых строк откладывается */
+	int inotify_fd;
+	size_t mem_budget;
+	int server;				/* режим сервера: терминал -- подключённый клиент */
+	int listen_fd;
+	int client_fd;			/* подключённый клиент, -1 если нет */
+	char *input;			/* принятый от клиента и ещё не разобранный ввод */
+	int input_len;
+	int input_pos;
+	uint64_t *frame_hash;	/* хеши строк выведенного кадра, 0 -- строка не выведена */
+	int frame_lines;
+	int render_cache_rows;	/* сколько строк вокруг курсора держат render, 0 -- все */
+	unsigned long view_clock;
+	int clip_lines;			/* строк в буфере обмена, 0 -- пуст */
+	editor_span_t clip_first;	/* крайние строки, возможно неполные */
+	editor_span_t clip_last;
+	editor_clip_run_t *clip_runs;	/* строки между ними */
+	int clip_num_runs;
+	int *clip_lens;
 };
 
 struct editorConfig E;
 int index_len = 0;
 
+int *macro_keys = NULL;
+int macro_len = 0;
+int macro_cap = 0;
+int macro_recording = 0;
+int macro_pos = -1;			/* позиция проигрывания макроса, -1 если макрос не играет */
+
 /* *** filetype *** */
 
 char *C_HL_extensions[] = { ".c", ".h", ".cpp", NULL };
@@ -120,15 +367,108 @@ struct editorSyntax HLDB [] = {
 /* *** Prototypes *** */
 
 void editorSetStatusMessage(const char *fmt, ...);
+void editorProccessKeypress();
+int editorReadTerminalKey();
+int editorMacroNextKey();
+void editorMacroRecordKey(int c);
+void editorSyntaxDefer(int at);
+void editorSyntaxDeferShift(int at, int delta);
+int editorUpdateSyntaxRow(editor_row_t *row);
+void editorUpdateRender(editor_row_t *row);
+int editorUndoPush(int type, int row, int col, char *text, int len);
+void editorUndoPushSpans(int type, int row, editor_span_t *spans, int n);
+void editorWrapUpdateRow(editor_row_t *row);
+void editorOffsetResize(editor_row_t *row, long long delta);
+void editorClampCursor();
 void editorRefreshScreen();
+void editorScheduleRedraw();
+int editorRenderTick();
+void editorHandleResize();
+void editorDiskStamp(editor_buffer_t *b, int fd);
+void editorWatchBuffer(editor_buffer_t *b);
+void editorUnwatchBuffer(editor_buffer_t *b);
+void editorPollFileChanges();
+long long editorNowMs();
+void editorJournalOp(int type, int row, int col, const char *text, int len);
+void editorJournalRows(int at, const editor_span_t *spans, int n);
+void editorJournalTick();
+void editorJournalDiscard(editor_buffer_t *b);
+void editorJournalHangup(int sig);
+void editorJournalCheck(editor_buffer_t *b);
+void editorLoaderStart(editor_buffer_t *b, editor_reader_t *r);
+void editorLoaderStop(editor_buffer_t *b);
+int editorLoading();
+int editorLoadPoll();
+int editorLoadPercent(editor_buffer_t *b);
+int editorCheckWritable();
+void editorRowDropRender(editor_buffer_t *b, editor_row_t *row);
+int editorRowInRenderCache(int at);
+void editorRenderLogShift(int at, int delta);
+void editorRenderLogRebuild();
+int editorFollowing();
+int editorFollowPoll();
+void editorFollowStop(editor_buffer_t *b);
+void editorDiffTouch(int at, int delta);
+void editorDiffRebase();
+void editorDiffStop(editor_buffer_t *b);
+int editorReadLines(int fd, editor_line_fn emit, void *ctx);
 char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorServerReceive();
+int editorReadAll(int fd, void *buf, size_t len);
+int editorWriteAll(int fd, const char *data, size_t len);
+int editorCacheLoad(int fd);
+void editorCacheApplyRow(editor_row_t *row, uint32_t flags);
+void editorCacheStore(editor_buffer_t *b);
+int editorCacheWanted(editor_buffer_t *b);
+void editorCacheCollect(editor_buffer_t *b, cache_job_t **job);
+void editorCacheWrite(editor_buffer_t *b, cache_job_t *job);
+void editorCacheJobFree(cache_job_t *job);
+void editorSigwinch(int sig);
+void editorServerOpen(const char *cwd, const char *name);
+void editorServerDetach();
+void editorFrameInvalidate();
+char *editorPromptEx(char *prompt, void (*callback)(char *, int), int allow_empty);
+struct abuf_s;
+int editorIsBinary(int fd);
+int editorHexOpen(editor_buffer_t *b);
+void editorHexClose(editor_buffer_t *b);
+void editorHexScroll();
+void editorHexDrawRows(struct abuf_s *ab);
+void editorHexCursor(int *y, int *x);
+void editorBracketSummarize(editor_row_t *row);
+void editorBracketShift(int at, int n);
+void editorRowEnsureRender(editor_row_t *row);
+void editorSpansFree(editor_span_t *spans, int n);
+void editorInsertRowsRef(int at, editor_span_t *spans, int n);
+void editorDelRows(int at, int n);
+int editorSelectionRange(editor_row_t *row, int *from, int *to);
+void editorRowsPermute(int *perm);
+void editorRowsUnpermute(const int *perm, int n);
+int editorRowsFilter(const unsigned char *keep);
+void editorRowsUnfilter(const int *where, editor_span_t *spans, int count);
+int editorGrepping();
+int editorGrepPoll();
+void editorGrepFree(editor_buffer_t *b);
 
 /* *** Terminal *** */
 
+/*
+ * @brief		Выводит байты на терминал: свой или клиента, подключённого к серверу
+ */
+void editorWriteOut(const char *s, int len)
+{
+	if (!E.server) {
+		write(STDOUT_FILENO, s, len);
+		return;
+	}
+	if (E.client_fd >= 0 && editorWriteAll(E.client_fd, s, len) == -1)
+		editorServerDetach();
+}
+
 void die(const char *s)
 {
-	write(STDOUT_FILENO, "\x1b[2J", 4);
-	write(STDOUT_FILENO, "\x1b[H", 3);
+	editorWriteOut("\x1b[2J", 4);
+	editorWriteOut("\x1b[H", 3);
 
 	perror(s);
 	exit(1);
@@ -156,22 +496,91 @@ void enableRawMode()
 }
 
 int editorReadKey()
+{
+	if (macro_pos >= 0) return editorMacroNextKey();
+
+	int key = editorReadTerminalKey();
+	if (macro_recording) editorMacroRecordKey(key);
+	return key;
+}
+
+int editorInputFd()
+{
+	if (!E.server) return STDIN_FILENO;
+	return (E.client_fd >= 0) ? E.client_fd : E.listen_fd;
+}
+
+/*
+ * @brief		Берёт байт ввода; у сервера сначала из очереди принятого от клиента
+ * @return		1, если байт прочитан, 0 если ввода нет, -1 при ошибке
+ */
+int editorReadInput(char *c)
+{
+	if (!E.server) return read(STDIN_FILENO, c, 1);
+
+	if (E.input_pos == E.input_len) editorServerReceive();
+	if (E.input_pos == E.input_len) return 0;
+	*c = E.input[E.input_pos++];
+	return 1;
+}
+
+/*
+ * @brief		Читает продолжение escape-последовательности, ожидая его не дольше 100 мс
+ */
+int editorReadInputWait(char *c)
+{
+	if (E.server && E.input_pos == E.input_len) {
+		struct pollfd pfd = { E.client_fd, POLLIN, 0 };
+		if (E.client_fd < 0 || poll(&pfd, 1, 100) <= 0) return 0;
+	}
+	return editorReadInput(c);
+}
+
+int editorReadTerminalKey()
 {
 	int nread;
 	char c;
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-		if (nread == -1 && errno != EAGAIN) die("read");
+	int busy = 0;
+	while (1) {
+		if (E.hangup) editorJournalHangup(E.hangup);
+		if (E.resized) {
+			editorHandleResize();
+			editorScheduleRedraw();
+		}
+		editorPollFileChanges();
+		editorJournalTick();
+
+		/* накопившийся ввод разбирается раньше, чем рисуется кадр */
+		struct pollfd pfd = { editorInputFd(), POLLIN, 0 };
+		if (E.input_pos < E.input_len || poll(&pfd, 1, 0) > 0) {
+			nread = editorReadInput(&c);
+			if (nread == 1) break;
+			if (nread == -1 && errno != EAGAIN && errno != EINTR) die("read");
+		}
+
+		int timeout = editorRenderTick();
+
+		/* пока идёт загрузка, слежение или поиск, строки добавляются между проверками ввода */
+		if (editorLoading() || editorFollowing() || editorGrepping()) {
+			busy = editorLoadPoll() | editorFollowPoll() | editorGrepPoll();
+			if (busy) timeout = 0;
+			else if (timeout < 0 || timeout > 10) timeout = 10;
+		}
+
+		/* периодически просыпаемся для журнала и наблюдения за файлами */
+		if (timeout < 0 || timeout > 100) timeout = 100;
+		poll(&pfd, 1, timeout);
 	}
 
 	if (c == '\x1b') {
 		char seq[3];
 
-		if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-		if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
+		if (editorReadInputWait(&seq[0]) != 1) return '\x1b';
+		if (editorReadInputWait(&seq[1]) != 1) return '\x1b';
 
 		if (seq[0] == '[') {
 			if (seq[1] >= '0' && seq[1] <= '9') {
-				if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
+				if (editorReadInputWait(&seq[2]) != 1) return '\x1b';
 
 				if (seq[2] == '~') {
 					switch (seq[1]) {
@@ -203,10 +612,10 @@ int editorReadKey()
 
 		return '\x1b';
 	} else {
-		return c;
+		return (unsigned char) c;
 	}
 
-	return c;
+	return (unsigned char) c;
 }
 
 int getCursorPosition(int *rows, int *cols)
@@ -248,21 +657,63 @@ int getWindowSize(int *rows, int *cols)
 
 int is_separator(int c)
 {
+	c = (unsigned char) c;
 	return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
 }
 
-void editorUpdateSyntax (editor_row_t *row) 
+/*
+ * @brief		Подсвечивает строки от hl_stale до to (не включая), чтобы стало
+ *				верным состояние комментария на конце строки to - 1. render строк
+ *				далеко над to сразу выбрасывается.
+ */
+void editorSyntaxCatchUp(int to)
+{
+	editor_buffer_t *b = E.buf;
+	if (to > b->num_rows) to = b->num_rows;
+
+	while (b->hl_stale >= 0 && b->hl_stale < to) {
+		editor_row_t *row = &b->row[b->hl_stale++];
+		int had_render = (row->render != NULL);
+		editorUpdateSyntaxRow(row);
+		if (!had_render && row->idx < to - E.screen_rows) editorRowDropRender(b, row);
+	}
+	if (b->hl_stale >= b->num_rows) b->hl_stale = -1;
+}
+
+/*
+ * @brief		Сдвигает hl_stale при вставке (delta > 0) или удалении (delta < 0) строк с at
+ */
+void editorSyntaxStaleShift(int at, int delta)
+{
+	if (E.buf->hl_stale < 0 || at >= E.buf->hl_stale) return;
+	E.buf->hl_stale += delta;
+	if (E.buf->hl_stale < at) E.buf->hl_stale = at;
+}
+
+/*
+ * @brief		Подсвечивает одну строку, не трогая следующие
+ * @param row	Указатель на строку
+ * @return		1, если изменилось состояние многострочного комментария на конце строки
+ */
+int editorUpdateSyntaxRow(editor_row_t *row)
 {
-	row->hl = realloc(row->hl, row->render_size);
+	if (E.buf->hl_stale >= 0 && E.buf->hl_stale < row->idx) editorSyntaxCatchUp(row->idx);
+	if (E.buf->hl_stale == row->idx) E.buf->hl_stale = (row->idx + 1 < E.buf->num_rows) ? row->idx + 1 : -1;
+
+	if (row->render == NULL) editorUpdateRender(row);
+
 	memset(row->hl, HL_NORMAL, row->render_size);
 
-	if (E.syntax == NULL) return;
+	if (E.buf->syntax == NULL) {
+		editorBracketSummarize(row);
+		return 0;
+	}
 
-	char **keywords = E.syntax->keywords;
+	char **keywords = E.buf->syntax->keywords;
 
-	char *scs = E.syntax->singleline_comment_start;
-	char *mcs = E.syntax->multiline_comment_start;
-	char *mce = E.syntax->multiline_comment_end;
+	char *scs = E.buf->syntax->singleline_comment_start;
+	char *mcs = E.buf->syntax->multiline_comment_start;
+	char *mce = E.buf->syntax->multiline_comment_end;
 
 	int scs_len = scs ? strlen(scs) : 0;
 	int mcs_len = mcs ? strlen(mcs) : 0;
@@ -270,7 +721,7 @@ void editorUpdateSyntax (editor_row_t *row)
 
 	int prev_sep = 1;
 	int in_string = 0;
-	int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+	int in_comment = (row->idx > 0 && E.buf->row[row->idx - 1].hl_open_comment);
 
 	int i = 0; 
 	while(i < row->render_size) {
@@ -279,14 +730,14 @@ void editorUpdateSyntax (editor_row_t *row)
 
 		if (scs_len && !in_string && !in_comment) {
 			if (!strncmp(&row->render[i], scs, scs_len)) {
-				memset(&row->hl[i], HL_COMMENT, row->render_size - 1);
+				memset(&row->hl[i], HL_COMMENT, row->render_size - i);
 				break;
 			}
 		}
 		
 		if (mcs_len && mce_len && !in_string) {
 			if (in_comment) {
-				row->render[i] = HL_MLCOMMENT;
+				row->hl[i] = HL_MLCOMMENT;
 				if (!strncmp(&row->render[i], mce, mce_len)) {
 					memset(&row->hl[i], HL_MLCOMMENT, mce_len);
 					i += mce_len;
@@ -298,14 +749,14 @@ void editorUpdateSyntax (editor_row_t *row)
 					continue;
 				}
 			} else if (!strncmp(&row->render[i], mcs, mcs_len)) {
-				memset(&row->render[i], HL_MLCOMMENT, mcs_len);
+				memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
 				i += mcs_len;
 				in_comment = 1;
 				continue;
 			}
 		}
 
-		if (E.syntax->flags & HL_HIGHLIGHT_STRINGS) {
+		if (E.buf->syntax->flags & HL_HIGHLIGHT_STRINGS) {
 			if (in_string) {
 				row->hl[i] = HL_STRING;
 				if (c == '\\' && i + 1 < row->render_size) {
@@ -329,8 +780,8 @@ void editorUpdateSyntax (editor_row_t *row)
 			}
 		}
 
-		if (E.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-			if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
+		if (E.buf->syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+			if ((isdigit((unsigned char) c) && (prev_sep || prev_hl == HL_NUMBER)) || (c == '.' && prev_hl == HL_NUMBER)) {
 				row->hl[i] = HL_NUMBER;
 				i++;
 				prev_sep = 0;
@@ -346,7 +797,7 @@ void editorUpdateSyntax (editor_row_t *row)
 				if (kw2) 
 					klen--;
 
-				if (strncmp(&row->render[i], keywords[j], klen) && 
+				if (i + klen <= row->render_size && !strncmp(&row->render[i], keywords[j], klen) &&
 						is_separator(row->render[i + klen])) {
 					memset(&row->hl[i], kw2 ? HL_KEYWORDS1 : HL_KEYWORDS2, klen);
 					i += klen;
@@ -363,10 +814,36 @@ void editorUpdateSyntax (editor_row_t *row)
 		i++;	
 	}
 
+	editorBracketSummarize(row);
+
 	int changed = (row->hl_open_comment != in_comment);
 	row->hl_open_comment = in_comment;
-	if (changed && row->idx + 1 < E.num_rows)
-		editorUpdateSyntax(&E.row[row->idx + 1]);
+	return changed;
+}
+
+void editorUpdateSyntax (editor_row_t *row) 
+{
+	if (E.hl_defer) {
+		editorSyntaxDefer(row->idx);
+		return;
+	}
+	while (editorUpdateSyntaxRow(row) && row->idx + 1 < E.buf->num_rows)
+		row = &E.buf->row[row->idx + 1];
+}
+
+/*
+ * @brief			Подсвечивает строки [from, to] по одному разу и протягивает
+ *					изменение многострочного комментария дальше
+ * @param touched	Если не NULL, подсвечиваются только отмеченные строки диапазона
+ */
+void editorUpdateSyntaxRows(int from, int to, const unsigned char *touched)
+{
+	int carry = 0;
+	for (int j = from; j < E.buf->num_rows; j++) {
+		if (j > to && !carry) break;
+		if (j <= to && touched && !touched[j - from] && !carry) continue;
+		carry = editorUpdateSyntaxRow(&E.buf->row[j]);
+	}
 }
 
 int editorSyntaxToColor(int hl)
@@ -385,10 +862,10 @@ int editorSyntaxToColor(int hl)
 
 void editorSelectSyntaxHighlight () 
 {
-	E.syntax = NULL;
-	if (E.file_name == NULL) return;
+	E.buf->syntax = NULL;
+	if (E.buf->file_name == NULL) return;
 
-	char *ext = strchr(E.file_name, '.');
+	char *ext = strchr(E.buf->file_name, '.');
 
 	for (unsigned int j = 0; j < HLDB_ENTRIES; j++) {
 		struct editorSyntax *s = &HLDB[j];
@@ -396,12 +873,12 @@ void editorSelectSyntaxHighlight ()
 		while (s->filematch[i]) {
 			int is_ext = (s->filematch[i][0] == '.');
 			if ((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-					(!is_ext && strstr(E.file_name, s->filematch[i]))) {
-				E.syntax = s;
+					(!is_ext && strstr(E.buf->file_name, s->filematch[i]))) {
+				E.buf->syntax = s;
 
 				int file_row;
-				for (file_row = 0; file_row < E.num_rows; file_row++) {
-					editorUpdateSyntax(&E.row[file_row]);
+				for (file_row = 0; file_row < E.buf->num_rows; file_row++) {
+					editorUpdateSyntax(&E.buf->row[file_row]);
 				}
 
 				return;		
@@ -411,363 +888,7288 @@ void editorSelectSyntaxHighlight ()
 	}
 }
 
-/* *** Row operations *** */
+/* *** UTF-8 *** */
 
 /*
- * @brief		Переводит курсор из позиции в файле в позицию, изображаемую в терминале
- * @param row	Указатель на строку
- * @param cx	Расположение курсора в файле по оси х
- * @return		Расположение курсора в терминале
+ * Ширина символов на экране берётся из двухуровневой таблицы: первый уровень
+ * индексируется старшими битами кодовой точки (cp >> 8) и хранит номер блока,
+ * блок хранит ширины 256 кодовых точек по 2 бита. Одинаковые блоки
+ * разделяются, так что вся таблица занимает несколько килобайт.
+ * Таблица строится при первой встрече не-ASCII символа.
  */
-int editorRowCxToRx(editor_row_t *row, int cx) 
+
+#define UTF8_MAX_CP 0x110000
+
+struct utf8_range_s {
+	int lo, hi;
+};
+
+struct utf8_range_s utf8_zero_width[] = {
+	{ 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD }, { 0x05BF, 0x05BF },
+	{ 0x05C1, 0x05C2 }, { 0x05C4, 0x05C5 }, { 0x05C7, 0x05C7 }, { 0x0610, 0x061A },
+	{ 0x064B, 0x065F }, { 0x0670, 0x0670 }, { 0x06D6, 0x06DC }, { 0x06DF, 0x06E4 },
+	{ 0x06E7, 0x06E8 }, { 0x06EA, 0x06ED }, { 0x0711, 0x0711 }, { 0x0730, 0x074A },
+	{ 0x07A6, 0x07B0 }, { 0x0816, 0x082D }, { 0x0900, 0x0902 }, { 0x093A, 0x093A },
+	{ 0x093C, 0x093C }, { 0x0941, 0x0948 }, { 0x094D, 0x094D }, { 0x0951, 0x0957 },
+	{ 0x0962, 0x0963 }, { 0x0E31, 0x0E31 }, { 0x0E34, 0x0E3A }, { 0x0E47, 0x0E4E },
+	{ 0x1AB0, 0x1AFF }, { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F }, { 0x202A, 0x202E },
+	{ 0x2060, 0x2064 }, { 0x20D0, 0x20FF }, { 0x302A, 0x302D }, { 0x3099, 0x309A },
+	{ 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F }, { 0xFEFF, 0xFEFF }, { 0x1F3FB, 0x1F3FF },
+	{ 0xE0001, 0xE0001 }, { 0xE0020, 0xE007F }, { 0xE0100, 0xE01EF }
+};
+
+struct utf8_range_s utf8_wide[] = {
+	{ 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC },
+	{ 0x23F0, 0x23F0 }, { 0x23F3, 0x23F3 }, { 0x25FD, 0x25FE }, { 0x2614, 0x2615 },
+	{ 0x2648, 0x2653 }, { 0x267F, 0x267F }, { 0x2693, 0x2693 }, { 0x26A1, 0x26A1 },
+	{ 0x26AA, 0x26AB }, { 0x26BD, 0x26BE }, { 0x26C4, 0x26C5 }, { 0x26CE, 0x26CE },
+	{ 0x26D4, 0x26D4 }, { 0x26EA, 0x26EA }, { 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 },
+	{ 0x26FA, 0x26FA }, { 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B },
+	{ 0x2728, 0x2728 }, { 0x274C, 0x274C }, { 0x274E, 0x274E }, { 0x2753, 0x2755 },
+	{ 0x2757, 0x2757 }, { 0x2795, 0x2797 }, { 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF },
+	{ 0x2B1B, 0x2B1C }, { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 }, { 0x2E80, 0x3029 },
+	{ 0x302E, 0x303E }, { 0x3041, 0x3098 }, { 0x309B, 0x33FF }, { 0x3400, 0x4DBF },
+	{ 0x4E00, 0x9FFF }, { 0xA000, 0xA4CF }, { 0xA960, 0xA97F }, { 0xAC00, 0xD7A3 },
+	{ 0xF900, 0xFAFF }, { 0xFE10, 0xFE19 }, { 0xFE30, 0xFE6F }, { 0xFF00, 0xFF60 },
+	{ 0xFFE0, 0xFFE6 }, { 0x16FE0, 0x16FE4 }, { 0x17000, 0x18AFF }, { 0x1B000, 0x1B2FF },
+	{ 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF }, { 0x1F18E, 0x1F18E }, { 0x1F191, 0x1F19A },
+	{ 0x1F200, 0x1F251 }, { 0x1F300, 0x1F3FA }, { 0x1F400, 0x1F64F }, { 0x1F680, 0x1F6FF },
+	{ 0x1F900, 0x1F9FF }, { 0x1FA70, 0x1FAFF }, { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD }
+};
+
+#define UTF8_RANGES(r) (sizeof(r) / sizeof(r[0]))
+
+unsigned char utf8_width_stage1[UTF8_MAX_CP >> 8];
+unsigned char (*utf8_width_blocks)[64] = NULL;
+
+void utf8BuildWidthTable()
 {
-	int render_x = 0;
-	int j;
-	for (j = 0; j < cx; j++) {
-		if (row->chars[j] == '\t') {
-			render_x += (EDITOR_TAB_SIZE - 1) - (render_x % EDITOR_TAB_SIZE);
+	unsigned char *w = malloc(UTF8_MAX_CP);
+	unsigned int i;
+	int cp;
+
+	memset(w, 1, UTF8_MAX_CP);
+	for (i = 0; i < UTF8_RANGES(utf8_wide); i++)
+		memset(&w[utf8_wide[i].lo], 2, utf8_wide[i].hi - utf8_wide[i].lo + 1);
+	for (i = 0; i < UTF8_RANGES(utf8_zero_width); i++)
+		memset(&w[utf8_zero_width[i].lo], 0, utf8_zero_width[i].hi - utf8_zero_width[i].lo + 1);
+
+	int num_blocks = 0;
+	unsigned char packed[64];
+
+	for (int b = 0; b < (UTF8_MAX_CP >> 8); b++) {
+		memset(packed, 0, sizeof(packed));
+		for (cp = 0; cp < 256; cp++)
+			packed[cp >> 2] |= w[(b << 8) | cp] << ((cp & 3) * 2);
+
+		int k;
+		for (k = 0; k < num_blocks; k++) {
+			if (!memcmp(utf8_width_blocks[k], packed, sizeof(packed))) break;
 		}
-		render_x++;
+		if (k == num_blocks) {
+			utf8_width_blocks = realloc(utf8_width_blocks, sizeof(packed) * (num_blocks + 1));
+			memcpy(utf8_width_blocks[num_blocks++], packed, sizeof(packed));
+		}
+		utf8_width_stage1[b] = k;
 	}
-	return render_x;
+
+	free(w);
 }
 
-int editorRowRxToCx(editor_row_t *row, int rx) 
+/*
+ * @brief		Ширина кодовой точки в колонках терминала (0, 1 или 2)
+ */
+int utf8CharWidth(int cp)
 {
-	int curr_rx = 0;
-	int cx;
-
-	for (cx = 0; cx < row->size; cx++) {
-		if (row->chars[cx] == '\t') {
-			curr_rx += (EDITOR_TAB_SIZE - 1) - (curr_rx % EDITOR_TAB_SIZE);
-		}
-		curr_rx++;
-
-		if (curr_rx > rx) return cx;
-	}
+	if (cp < 0x80) return 1;
+	if (cp >= UTF8_MAX_CP) return 1;
+	if (utf8_width_blocks == NULL) utf8BuildWidthTable();
 
-	return cx;
+	unsigned char *blk = utf8_width_blocks[utf8_width_stage1[cp >> 8]];
+	return (blk[(cp & 0xff) >> 2] >> ((cp & 3) * 2)) & 3;
 }
 
-void editorUpdateRow(editor_row_t *row)
+/*
+ * @brief		Декодирует один символ UTF-8
+ * @param cp	Кодовая точка или -1 для некорректной последовательности
+ * @return		Количество байт символа (1 для некорректного байта)
+ */
+int utf8Decode(const char *str, int len, int *cp)
 {
-	int tabs = 0;
-	int j;
-	for (j = 0; j < row->size; j++) {
-		if (row->chars[j] == '\t') tabs++;
+	const unsigned char *s = (const unsigned char *) str;
+	int n, c, j;
+
+	if (s[0] < 0x80) {
+		*cp = s[0];
+		return 1;
+	} else if ((s[0] & 0xE0) == 0xC0) {
+		n = 2;
+		c = s[0] & 0x1F;
+	} else if ((s[0] & 0xF0) == 0xE0) {
+		n = 3;
+		c = s[0] & 0x0F;
+	} else if ((s[0] & 0xF8) == 0xF0) {
+		n = 4;
+		c = s[0] & 0x07;
+	} else {
+		*cp = -1;
+		return 1;
 	}
 
-	free (row->render);
-	row->render = malloc(row->size + tabs*(EDITOR_TAB_SIZE - 1) + 1);
-
-	int idx = 0;
-	for (j = 0; j < row->size; j++) {
-		if (row->chars[j] == '\t') {
-			row->render[idx++] = ' ';
-			while (idx % EDITOR_TAB_SIZE != 0) row->render[idx++] = ' ';
-		} else {
-			row->render[idx++] = row->chars[j];
+	if (n > len) {
+		*cp = -1;
+		return 1;
+	}
+	for (j = 1; j < n; j++) {
+		if ((s[j] & 0xC0) != 0x80) {
+			*cp = -1;
+			return 1;
 		}
+		c = (c << 6) | (s[j] & 0x3F);
 	}
 
-	row->render[idx] = '\0';
-	row->render_size = idx;
+	if ((n == 2 && c < 0x80) || (n == 3 && c < 0x800) || (n == 4 && c < 0x10000) ||
+			c >= UTF8_MAX_CP || (c >= 0xD800 && c <= 0xDFFF)) {
+		*cp = -1;
+		return 1;
+	}
 
-	editorUpdateSyntax(row);
+	*cp = c;
+	return n;
 }
 
-void editorInsertRow(int at, char *s, size_t len)
+/*
+ * @brief		Длина последовательности UTF-8 по первому байту (0 -- не первый байт)
+ */
+int utf8SeqLen(int c)
+{
+	if (c < 0x80) return 1;
+	if ((c & 0xE0) == 0xC0) return 2;
+	if ((c & 0xF0) == 0xE0) return 3;
+	if ((c & 0xF8) == 0xF0) return 4;
+	return 0;
+}
+
+int utf8IsCont(int c)
 {
-	if (at < 0 || at > E.num_rows) return;
+	return (c & 0xC0) == 0x80;
+}
 
-	E.row = realloc(E.row, sizeof(editor_row_t) * (E.num_rows + 1));
-	memmove(&E.row[at + 1], &E.row[at], sizeof(editor_row_t) * (E.num_rows - at));
-	for (int j = at + 1; j <= E.num_rows; j++)
-		E.row[j].idx++;
+/*
+ * @brief		Начало символа, предшествующего позиции i
+ */
+int utf8Prev(const char *s, int i)
+{
+	if (i <= 0) return 0;
+	int j = i - 1;
+	while (j > 0 && i - j < 4 && utf8IsCont((unsigned char) s[j])) j--;
 
-	E.row[at].idx = at;
+	int cp;
+	if (utf8Decode(&s[j], i - j, &cp) != i - j) return i - 1;
+	return j;
+}
 
-	E.row[at].size = len;
-	E.row[at].chars = malloc(len + 1);
+/*
+ * @brief		Начало символа, следующего за символом в позиции i
+ */
+int utf8Next(const char *s, int len, int i)
+{
+	if (i >= len) return len;
+	if ((unsigned char) s[i] < 0x80) return i + 1;
 
-	memcpy(E.row[at].chars, s, len);
-	E.row[at].chars[len] = '\0';
+	int cp;
+	return i + utf8Decode(&s[i], len - i, &cp);
+}
 
-	E.row[at].render_size = 0;
-	E.row[at].render = NULL;
-	E.row[at].hl = NULL;
-	E.row[at].hl_open_comment = 0;
+/* *** Fenwick tree *** */
 
-	editorUpdateRow(&E.row[at]);
+/*
+ * Дерево Фенвика над массивом неотрицательных значений по строкам:
+ * префиксные суммы и поиск строки по сумме за O(log n).
+ */
 
-	E.num_rows++;
-	E.dirty++;
+void fenwickBuild(fenwick_t *f, const long long *vals, int n)
+{
+	free(f->tree);
+	f->n = n;
+	f->cap = n;
+	f->tree = calloc(n + 1, sizeof(long long));
+
+	for (int i = 1; i <= n; i++) {
+		f->tree[i] += vals[i - 1];
+		int j = i + (i & -i);
+		if (j <= n) f->tree[j] += f->tree[i];
+	}
 }
 
-void editorFreeRow(editor_row_t *row)
+void fenwickFree(fenwick_t *f)
 {
-	free(row->render);
-	free(row->chars);
-	free(row->hl);
+	free(f->tree);
+	f->tree = NULL;
+	f->n = 0;
+	f->cap = 0;
 }
 
-void editorDelRow(int at)
+/*
+ * @brief		Добавляет элемент в конец за O(log n)
+ */
+void fenwickAppend(fenwick_t *f, long long val)
 {
-	if (at < 0 || at >= E.num_rows) return;
+	if (f->n == f->cap) {
+		f->cap = f->cap ? f->cap * 2 : 1024;
+		f->tree = realloc(f->tree, sizeof(long long) * (f->cap + 1));
+	}
 
-	editorFreeRow(&E.row[at]);
-	memmove(&E.row[at], &E.row[at + 1], sizeof(editor_row_t) * (E.num_rows - at - 1));
-	for (int j = at; j <= E.num_rows - 1; j++)
-		E.row[j].idx--;
-	E.num_rows--;
-	E.dirty++;
+	int i = ++f->n;
+	long long sum = val;
+	for (int j = i - 1; j > i - (i & -i); j -= j & -j)
+		sum += f->tree[j];
+	f->tree[i] = sum;
 }
 
-void editorRowInsertChar(editor_row_t *row, int index, int character)
+void fenwickAdd(fenwick_t *f, int i, long long delta)
 {
-	if (index < 0 || index > row->size) index = row->size;
-	row->chars = (char *) realloc(row->chars, row->size + 2);
-
-	memmove(&row->chars[index + 1], &row->chars[index], row->size - index + 1);
-
-	row->size++;
-	row->chars[index] = character;
-
-	editorUpdateRow(row);
+	for (i++; i <= f->n; i += i & -i)
+		f->tree[i] += delta;
+}
 
-	E.dirty++;
+/*
+ * @brief		Сумма элементов [0, i)
+ */
+long long fenwickSum(fenwick_t *f, int i)
+{
+	long long sum = 0;
+	if (i > f->n) i = f->n;
+	for (; i > 0; i -= i & -i)
+		sum += f->tree[i];
+	return sum;
 }
 
-void editorRowAppendString(editor_row_t *row, char *s, size_t len)
+long long fenwickGet(fenwick_t *f, int i)
 {
-	row->chars = realloc(row->chars, row->size + len + 1);
-	memcpy(&row->chars[row->size], s, len);
-	row->size += len;
-	row->chars[row->size] = '\0';
-	editorUpdateRow(row);
-	E.dirty++;
+	return fenwickSum(f, i + 1) - fenwickSum(f, i);
 }
 
-void editorRowDelChar(editor_row_t *row, int index_char)
+/*
+ * @brief		Находит элемент, в который попадает смещение target
+ * @param rem	Остаток смещения внутри найденного элемента
+ * @return		Индекс элемента (n, если target за пределами суммы)
+ */
+int fenwickFind(fenwick_t *f, long long target, long long *rem)
 {
-	if (index_char < 0 || index_char >= row->size) return;
+	int pos = 0;
+	int step = 1;
 
-	memmove(&row->chars[index_char], &row->chars[index_char + 1], row->size - index_char);
-	row->size--;
-	editorUpdateRow(row);
+	while (step * 2 <= f->n) step *= 2;
+
+	for (; step > 0; step /= 2) {
+		if (pos + step <= f->n && f->tree[pos + step] <= target) {
+			pos += step;
+			target -= f->tree[pos];
+		}
+	}
 
-	E.dirty++;
+	if (rem) *rem = target;
+	return pos;
 }
 
-/* *** Editor opertations *** */
+/* *** Soft wrap *** */
 
-void editorInsertChar(int c)
-{
-	if (E.cy == E.num_rows) {
-		editorInsertRow(E.num_rows, "", 0);
-	}
+/*
+ * В режиме переноса строки каждая строка файла занимает не меньше одной
+ * экранной строки; широкий символ, не влезающий в конец экранной строки,
+ * целиком переносится на следующую. Количество экранных строк хранится
+ * в дереве Фенвика, поэтому переход от смещения в экранных строках к строке
+ * файла стоит O(log n).
+ * Правка внутри строки обновляет дерево точечно, вставка и удаление строк
+ * (которые и так сдвигают массив строк за O(n)) помечают индекс для перестройки.
+ */
 
-	editorRowInsertChar(&E.row[E.cy], E.cx, c);
-	E.cx++;
+int editorGutterWidth()
+{
+	char buf[16];
+	return snprintf(buf, sizeof(buf), "%4d| ", E.buf->num_rows);
 }
 
-void editorInsertNewLine() 
+int editorWrapWidth()
 {
-	if (E.cx == 0) {
-		editorInsertRow(E.cy, "", 0);
-	} else {
-		editor_row_t *row = &E.row[E.cy];
+	int width = E.screen_cols - editorGutterWidth();
+	return (width < 1) ? 1 : width;
+}
 
-		editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-		row = &E.row[E.cy];
-		row->size = E.cx;
-		row->chars[row->size] = '\0';
-		editorUpdateRow(row);
+/*
+ * @brief		Переходит от начала экранной строки (байт j текста, колонка col)
+ *				к началу следующей. Табуляция может разорваться посередине, тогда
+ *				j остаётся на ней, а col указывает внутрь.
+ * @return		0, если строка файла на этой экранной строке кончилась
+ */
+int editorWrapNext(editor_row_t *row, int width, int *j, int *col)
+{
+	int k = *j, c = *col;
+	int limit = c + width;
+
+	while (k < row->size) {
+		unsigned char ch = row->chars[k];
+		int n = 1, w = 1;
+		if (ch == '\t') {
+			int end = c + EDITOR_TAB_SIZE - c % EDITOR_TAB_SIZE;
+			if (end > limit) {
+				c = limit;
+				break;
+			}
+			c = end;
+			k++;
+			continue;
+		}
+		if (ch >= 0x80) {
+			int cp;
+			n = utf8Decode(&row->chars[k], row->size - k, &cp);
+			w = (cp == -1) ? 1 : utf8CharWidth(cp);
+		}
+		/* символ шире самой экранной строки занимает её один */
+		if (c + w > limit && c > *col) break;
+		c += w;
+		k += n;
 	}
-	E.cy++;
-	E.cx = 0;
+
+	*j = k;
+	*col = c;
+	return k < row->size;
 }
 
-void editorDeleteChar()
+int editorWrapRowLines(editor_row_t *row, int width)
 {
-	if (E.cy == E.num_rows) return;
-	if (E.cx == 0 && E.cy == 0) return;
+	if (row->render_cols <= width) return 1;
+	if (row->ascii) return (row->render_cols + width - 1) / width;
 
-	editor_row_t *row = &E.row[E.cy];
-	if (E.cx > 0) {
-		editorRowDelChar(row, E.cx - 1);
-		E.cx--;
-	} else {
-		E.cx = E.row[E.cy - 1].size;
-		editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-		editorDelRow(E.cy);
-		E.cy--;
-	}
+	int j = 0, col = 0, lines = 1;
+	while (editorWrapNext(row, width, &j, &col)) lines++;
+	return lines;
 }
 
-/* *** File I/O *** */
-
-char *editorRowsToString(int *buf_len)
+/*
+ * @brief		Находит экранную строку, на которой стоит колонка rx строки файла
+ * @param start	Колонка начала этой экранной строки
+ * @return		Номер экранной строки внутри строки файла
+ */
+int editorWrapLineOf(editor_row_t *row, int width, int rx, int *start)
 {
-	int total_len = 0;
-	int j;
-	for (j = 0; j < E.num_rows; j++) {
-		total_len += E.row[j].size + 1;
+	if (row->ascii) {
+		int sub = rx / width;
+		int last = editorWrapRowLines(row, width) - 1;
+		if (sub > last) sub = last;
+		*start = sub * width;
+		return sub;
 	}
-	*buf_len = total_len;
 
-	char *buf = (char *) malloc(sizeof(char)*total_len);
-	char *ptr = buf;
-	for (j = 0; j < E.num_rows; j++) {
-		memcpy(ptr, E.row[j].chars, E.row[j].size);
-		ptr += E.row[j].size;
-		*ptr = '\n';
-		ptr++;
+	int j = 0, col = 0, sub = 0;
+	for (;;) {
+		int nj = j, ncol = col;
+		if (!editorWrapNext(row, width, &nj, &ncol) || ncol > rx) break;
+		j = nj;
+		col = ncol;
+		sub++;
 	}
-
-	return buf;
+	*start = col;
+	return sub;
 }
 
-void editorOpen(char *file_name)
+void editorWrapRebuild()
 {
-	free(E.file_name);
-	E.file_name = strdup(file_name);
+	int width = editorWrapWidth();
+	long long *vals = malloc(sizeof(long long) * (E.buf->num_rows ? E.buf->num_rows : 1));
 
-	editorSelectSyntaxHighlight();
+	for (int j = 0; j < E.buf->num_rows; j++)
+		vals[j] = editorWrapRowLines(&E.buf->row[j], width);
+	fenwickBuild(&E.buf->wrap_index, vals, E.buf->num_rows);
+	free(vals);
 
-	FILE *fp = fopen(file_name, "r");
-	if (!fp) die("fopen");
-	
-	char *line = NULL;
-	size_t line_cap = 0;
-	ssize_t line_len;
+	E.buf->wrap_width = width;
+	E.buf->wrap_valid = 1;
+}
 
-	while ((line_len = getline(&line, &line_cap, fp)) != -1) {
-		while (line_len > 0 && 
-				(line[line_len -1] == '\n' || line[line_len - 1] == '\r'))
-					line_len--;
+void editorWrapEnsure()
+{
+	if (!E.buf->wrap_valid || E.buf->wrap_width != editorWrapWidth() || E.buf->wrap_index.n != E.buf->num_rows)
+		editorWrapRebuild();
+}
 
-		editorInsertRow(E.num_rows, line, line_len);
-	}
+void editorWrapUpdateRow(editor_row_t *row)
+{
+	if (!E.buf->wrap || !E.buf->wrap_valid || row->idx >= E.buf->wrap_index.n) return;
 
-	free(line);
-	fclose(fp);
-	
-	E.dirty = 0;
+	long long old = fenwickGet(&E.buf->wrap_index, row->idx);
+	long long lines = editorWrapRowLines(row, E.buf->wrap_width);
+	if (lines != old)
+		fenwickAdd(&E.buf->wrap_index, row->idx, lines - old);
 }
 
-void editorSave() 
+/*
+ * @brief		Находит строку файла и номер её экранной строки по смещению в экранных строках
+ */
+void editorWrapLocate(long long vline, int *file_row, int *sub)
 {
-	if (E.file_name == NULL) {
-		E.file_name = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-		if (E.file_name == NULL) {
-			editorSetStatusMessage("Save aborted");
-			return;
-		}
-		editorSelectSyntaxHighlight();
-	}
+	long long rem;
+	*file_row = fenwickFind(&E.buf->wrap_index, vline, &rem);
+	*sub = (*file_row < E.buf->num_rows) ? rem : 0;
+}
 
-	int len;
-	char *buf = editorRowsToString(&len);
+void editorWrapScroll()
+{
+	editorWrapEnsure();
 
-	int fd = open(E.file_name, O_RDWR | O_CREAT, 0644);
-	if (fd != -1) {
-		if (ftruncate(fd, len) != -1) {
-			if (write(fd, buf, len) != -1) {
-				close(fd);
-				free(buf);
+	int width = E.buf->wrap_width;
+	int sub = 0, start = 0;
+	if (E.buf->cy < E.buf->num_rows)
+		sub = editorWrapLineOf(&E.buf->row[E.buf->cy], width, E.buf->render_cx, &start);
+	long long vline = fenwickSum(&E.buf->wrap_index, E.buf->cy) + sub;
+	long long total = fenwickSum(&E.buf->wrap_index, E.buf->num_rows);
 
-				E.dirty = 0;
-				editorSetStatusMessage("%d bytes written to disk", len);
-				return;
-			}
-		}
-		close(fd);
-	}
+	if (E.buf->wrap_offset > total) E.buf->wrap_offset = total;
+	if (vline < E.buf->wrap_offset) E.buf->wrap_offset = vline;
+	if (vline >= E.buf->wrap_offset + E.screen_rows) E.buf->wrap_offset = vline - E.screen_rows + 1;
 
-	free(buf);
-	editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+	editorWrapLocate(E.buf->wrap_offset, &E.buf->row_offset, &sub);
+
+	/* курсор в конце строки, целиком занявшей экранную, остаётся на её краю */
+	E.buf->col_offset = start;
+	if (E.buf->render_cx - start >= width) E.buf->col_offset = E.buf->render_cx - width + 1;
+	E.buf->render_cy = vline - E.buf->wrap_offset;
 }
 
-/* *** Find *** */
+void editorToggleWrap()
+{
+	E.buf->wrap = !E.buf->wrap;
+	E.buf->wrap_valid = 0;
+	E.buf->col_offset = 0;
+	if (E.buf->wrap) {
+		editorWrapEnsure();
+		E.buf->wrap_offset = fenwickSum(&E.buf->wrap_index, E.buf->row_offset);
+	} else {
+		fenwickFree(&E.buf->wrap_index);
+	}
+	editorSetStatusMessage("Soft wrap %s", E.buf->wrap ? "on" : "off");
+}
+
+/* *** Line offsets *** */
+
+/*
+ * Длины строк в байтах (вместе с переводом строки) хранятся в дереве Фенвика:
+ * смещение начала строки и строка по смещению в файле находятся за O(log n).
+ * Как и индекс переноса, дерево точечно обновляется при правке внутри строки,
+ * растёт при добавлении строк в конец, а после вставки или удаления строк
+ * в середине перестраивается при первом дальнем переходе.
+ *
+ * Размер текста и смещение одной строки (pos_row) поддерживаются отдельно
+ * при каждой правке: процент в строке статуса считается на каждом кадре,
+ * а курсор между кадрами сдвигается на несколько строк, так что дерево
+ * для него не нужно и не перестраивается.
+ */
+
+#define EDITOR_OFFSET_WALK 256	/* дальше этого смещение строки берётся из дерева */
+
+void editorOffsetRebuild()
+{
+	long long *vals = malloc(sizeof(long long) * (E.buf->num_rows ? E.buf->num_rows : 1));
+
+	for (int j = 0; j < E.buf->num_rows; j++)
+		vals[j] = E.buf->row[j].size + 1;
+	fenwickBuild(&E.buf->offset_index, vals, E.buf->num_rows);
+	free(vals);
+
+	E.buf->offset_valid = 1;
+}
+
+void editorOffsetEnsure()
+{
+	if (!E.buf->offset_valid || E.buf->offset_index.n != E.buf->num_rows)
+		editorOffsetRebuild();
+}
+
+/*
+ * @brief		Учитывает изменение длины строки на delta байт
+ */
+void editorOffsetResize(editor_row_t *row, long long delta)
+{
+	editor_buffer_t *b = E.buf;
+
+	b->text_bytes += delta;
+	if (row->idx < b->pos_row) b->pos_offset += delta;
+	if (b->offset_valid && row->idx < b->offset_index.n)
+		fenwickAdd(&b->offset_index, row->idx, delta);
+}
+
+/*
+ * @brief		Учитывает строки [at, at + n), только что вставленные в буфер
+ */
+void editorOffsetInserted(int at, int n)
+{
+	editor_buffer_t *b = E.buf;
+	long long bytes = 0;
+
+	for (int j = at; j < at + n; j++)
+		bytes += b->row[j].size + 1;
+	b->text_bytes += bytes;
+	if (at <= b->pos_row) {
+		b->pos_row += n;
+		b->pos_offset += bytes;
+	}
+}
+
+/*
+ * @brief		Учитывает строки [at, at + n), которые сейчас будут удалены
+ */
+void editorOffsetDeleting(int at, int n)
+{
+	editor_buffer_t *b = E.buf;
+
+	for (int j = at; j < at + n; j++) {
+		long long len = b->row[j].size + 1;
+		b->text_bytes -= len;
+		if (j < b->pos_row) b->pos_offset -= len;
+	}
+	if (b->pos_row >= at + n) b->pos_row -= n;
+	else if (b->pos_row > at) b->pos_row = at;
+}
+
+/*
+ * @brief		Пересчитывает размер текста после перестройки массива строк
+ */
+void editorOffsetReset()
+{
+	editor_buffer_t *b = E.buf;
+
+	b->text_bytes = 0;
+	for (int j = 0; j < b->num_rows; j++)
+		b->text_bytes += b->row[j].size + 1;
+	b->pos_row = 0;
+	b->pos_offset = 0;
+}
+
+/*
+ * @brief		Смещение начала строки at от начала файла в байтах. Считается
+ *				от pos_row по строкам, если она рядом, иначе берётся из дерева,
+ *				устаревшее дерево перед этим перестраивается.
+ */
+long long editorRowOffset(int at)
+{
+	editor_buffer_t *b = E.buf;
+	if (at > b->num_rows) at = b->num_rows;
+
+	if (abs(at - b->pos_row) > EDITOR_OFFSET_WALK) {
+		editorOffsetEnsure();
+		b->pos_offset = fenwickSum(&b->offset_index, at);
+		b->pos_row = at;
+	}
+	for (; b->pos_row < at; b->pos_row++)
+		b->pos_offset += b->row[b->pos_row].size + 1;
+	for (; b->pos_row > at; b->pos_row--)
+		b->pos_offset -= b->row[b->pos_row - 1].size + 1;
+	return b->pos_offset;
+}
+
+long long editorFileSize()
+{
+	return E.buf->text_bytes;
+}
+
+/*
+ * @brief		Ставит курсор на строку at, сохраняя столбец, насколько позволяет её длина
+ */
+void editorCursorToRow(int at)
+{
+	if (at < 0) at = 0;
+	if (at > E.buf->num_rows) at = E.buf->num_rows;
+	E.buf->cy = at;
+	editorClampCursor();
+}
+
+/*
+ * @brief		Ставит курсор на байт offset от начала файла
+ */
+void editorCursorToOffset(long long offset)
+{
+	editorOffsetEnsure();
+
+	long long rem;
+	int at = fenwickFind(&E.buf->offset_index, offset, &rem);
+	E.buf->cy = at;
+	E.buf->cx = (at < E.buf->num_rows) ? (int) rem : 0;
+	editorClampCursor();
+}
+
+/*
+ * @brief		Переход по номеру строки, смещению в байтах (@N) или проценту файла (N%)
+ */
+void editorGoTo()
+{
+	char *target = editorPrompt("Go to line, @byte or N%%: %s (ESC to cancel)", NULL);
+	if (target == NULL) return;
+
+	char *end;
+	if (target[0] == '@') {
+		long long offset = strtoll(target + 1, &end, 10);
+		if (end == target + 1 || offset < 0) editorSetStatusMessage("Bad position: %s", target);
+		else editorCursorToOffset(offset);
+	} else {
+		long long n = strtoll(target, &end, 10);
+		if (end == target || n < 0) {
+			editorSetStatusMessage("Bad position: %s", target);
+		} else if (*end == '%') {
+			editorCursorToOffset(editorFileSize() * (n > 100 ? 100 : n) / 100);
+			E.buf->cx = 0;
+		} else {
+			editorCursorToRow(n > INT_MAX ? INT_MAX : (int) n - 1);
+		}
+	}
+	free(target);
+
+	/* найденная строка оказывается в середине экрана */
+	E.buf->row_offset = E.buf->cy - E.screen_rows / 2;
+	if (E.buf->row_offset < 0) E.buf->row_offset = 0;
+	if (E.buf->wrap) E.buf->wrap_offset = INT_MAX;
+}
+
+/*
+ * @brief		Позиция курсора в процентах от размера файла
+ */
+int editorCursorPercent()
+{
+	long long total = editorFileSize();
+	if (total == 0) return 0;
+	long long pos = editorRowOffset(E.buf->cy) + (E.buf->cy < E.buf->num_rows ? E.buf->cx : 0);
+	return (int) (pos * 100 / total);
+}
+
+/* *** Row operations *** */
+
+/*
+ * @brief		Переводит курсор из позиции в файле в позицию, изображаемую в терминале
+ * @param row	Указатель на строку
+ * @param cx	Расположение курсора в файле по оси х
+ * @return		Расположение курсора в терминале
+ */
+int editorRowCxToRx(editor_row_t *row, int cx) 
+{
+	int render_x = 0;
+	int j;
+
+	if (row->ascii && row->tabs == 0) return (cx < row->size) ? cx : row->size;
+	if (row->ascii) {
+		for (j = 0; j < cx; j++) {
+			if (row->chars[j] == '\t') {
+				render_x += (EDITOR_TAB_SIZE - 1) - (render_x % EDITOR_TAB_SIZE);
+			}
+			render_x++;
+		}
+		return render_x;
+	}
+
+	for (j = 0; j < cx && j < row->size;) {
+		if (row->chars[j] == '\t') {
+			render_x += EDITOR_TAB_SIZE - (render_x % EDITOR_TAB_SIZE);
+			j++;
+		} else {
+			int cp;
+			j += utf8Decode(&row->chars[j], row->size - j, &cp);
+			render_x += (cp == -1) ? 1 : utf8CharWidth(cp);
+		}
+	}
+	return render_x;
+}
+
+int editorRowRxToCx(editor_row_t *row, int rx) 
+{
+	int curr_rx = 0;
+	int cx;
+
+	if (row->ascii && row->tabs == 0) return (rx < row->size) ? rx : row->size;
+	if (row->ascii) {
+		for (cx = 0; cx < row->size; cx++) {
+			if (row->chars[cx] == '\t') {
+				curr_rx += (EDITOR_TAB_SIZE - 1) - (curr_rx % EDITOR_TAB_SIZE);
+			}
+			curr_rx++;
+
+			if (curr_rx > rx) return cx;
+		}
+		return cx;
+	}
+
+	for (cx = 0; cx < row->size;) {
+		int n = 1;
+		if (row->chars[cx] == '\t') {
+			curr_rx += EDITOR_TAB_SIZE - (curr_rx % EDITOR_TAB_SIZE);
+		} else {
+			int cp;
+			n = utf8Decode(&row->chars[cx], row->size - cx, &cp);
+			curr_rx += (cp == -1) ? 1 : utf8CharWidth(cp);
+		}
+
+		if (curr_rx > rx) return cx;
+		cx += n;
+	}
+
+	return cx;
+}
+
+/*
+ * @brief		Переводит позицию в chars в смещение в байтах внутри render
+ */
+int editorRowCxToRenderIdx(editor_row_t *row, int cx)
+{
+	if (row->ascii) return editorRowCxToRx(row, cx);
+
+	int idx = 0, col = 0;
+	for (int j = 0; j < cx && j < row->size;) {
+		if (row->chars[j] == '\t') {
+			int spaces = EDITOR_TAB_SIZE - (col % EDITOR_TAB_SIZE);
+			idx += spaces;
+			col += spaces;
+			j++;
+		} else {
+			int cp;
+			int n = utf8Decode(&row->chars[j], row->size - j, &cp);
+			idx += n;
+			col += (cp == -1) ? 1 : utf8CharWidth(cp);
+			j += n;
+		}
+	}
+	return idx;
+}
+
+int editorRowRenderIdxToCx(editor_row_t *row, int render_idx)
+{
+	if (row->ascii) return editorRowRxToCx(row, render_idx);
+
+	int idx = 0, col = 0, cx;
+	for (cx = 0; cx < row->size;) {
+		int n = 1, len;
+		if (row->chars[cx] == '\t') {
+			len = EDITOR_TAB_SIZE - (col % EDITOR_TAB_SIZE);
+			col += len;
+		} else {
+			int cp;
+			n = len = utf8Decode(&row->chars[cx], row->size - cx, &cp);
+			col += (cp == -1) ? 1 : utf8CharWidth(cp);
+		}
+
+		idx += len;
+		if (idx > render_idx) return cx;
+		cx += n;
+	}
+	return cx;
+}
+
+/*
+ * @brief		Считает ascii, tabs и render_cols строки, не строя render: их
+ *				ждут курсор и перенос у строк, которые ещё не подсвечивались
+ */
+void editorRowMeasure(editor_row_t *row)
+{
+	int tabs = 0, col = 0;
+
+	row->ascii = 1;
+	for (int j = 0; j < row->size;) {
+		unsigned char c = row->chars[j];
+		if (c == '\t') {
+			tabs++;
+			col += EDITOR_TAB_SIZE - col % EDITOR_TAB_SIZE;
+			j++;
+		} else if (c < 0x80) {
+			col++;
+			j++;
+		} else {
+			int cp;
+			row->ascii = 0;
+			j += utf8Decode(&row->chars[j], row->size - j, &cp);
+			col += (cp == -1) ? 1 : utf8CharWidth(cp);
+		}
+	}
+	row->tabs = tabs;
+	row->render_cols = col;
+}
+
+void editorUpdateRender(editor_row_t *row)
+{
+	int tabs = 0;
+	int j;
+
+	row->ascii = 1;
+	for (j = 0; j < row->size; j++) {
+		if (row->chars[j] == '\t') tabs++;
+		else if ((unsigned char) row->chars[j] >= 0x80) row->ascii = 0;
+	}
+
+	/* render и hl живут в одном блоке: hl начинается сразу за render */
+	int cap = row->size + tabs*(EDITOR_TAB_SIZE - 1);
+	if (row->render) {
+		E.buf->derived_bytes -= 2 * row->render_size + 1;
+	} else {
+		E.buf->render_rows++;
+		if (E.render_cache_rows) {
+			if (E.buf->render_log_len == E.buf->render_log_cap) {
+				E.buf->render_log_cap = E.buf->render_log_cap ? E.buf->render_log_cap * 2 : 256;
+				E.buf->render_log = realloc(E.buf->render_log, sizeof(int) * E.buf->render_log_cap);
+			}
+			E.buf->render_log[E.buf->render_log_len++] = row->idx;
+		}
+	}
+	free (row->render);
+	row->render = malloc(2 * cap + 1);
+	row->hl = (unsigned char *) &row->render[cap + 1];
+
+	int idx = 0;
+	row->tabs = tabs;
+	if (row->ascii) {
+		for (j = 0; j < row->size; j++) {
+			if (row->chars[j] == '\t') {
+				row->render[idx++] = ' ';
+				while (idx % EDITOR_TAB_SIZE != 0) row->render[idx++] = ' ';
+			} else {
+				row->render[idx++] = row->chars[j];
+			}
+		}
+		row->render_cols = idx;
+	} else {
+		/* табуляция выравнивается по колонкам экрана, а не по байтам */
+		int col = 0;
+		for (j = 0; j < row->size;) {
+			if (row->chars[j] == '\t') {
+				do {
+					row->render[idx++] = ' ';
+					col++;
+				} while (col % EDITOR_TAB_SIZE != 0);
+				j++;
+			} else {
+				int cp;
+				int n = utf8Decode(&row->chars[j], row->size - j, &cp);
+				memcpy(&row->render[idx], &row->chars[j], n);
+				idx += n;
+				col += (cp == -1) ? 1 : utf8CharWidth(cp);
+				j += n;
+			}
+		}
+		row->render_cols = col;
+	}
+
+	row->render[idx] = '\0';
+	row->render_size = idx;
+	E.buf->derived_bytes += 2 * row->render_size + 1;
+
+	editorWrapUpdateRow(row);
+}
+
+void editorUpdateRow(editor_row_t *row)
+{
+	editorDiffTouch(row->idx, 0);
+	editorUpdateRender(row);
+	editorUpdateSyntax(row);
+}
+
+editor_block_t *editorBlockNew(size_t size)
+{
+	editor_block_t *b = malloc(sizeof(editor_block_t) + size);
+	b->refs = 1;
+	b->size = size;
+	return b;
+}
+
+void editorBlockRelease(editor_block_t *b)
+{
+	if (b && --b->refs == 0) free(b);
+}
+
+/*
+ * @brief		Копирует текст строки из общего блока в собственный буфер перед правкой
+ */
+void editorRowOwnChars(editor_row_t *row)
+{
+	if (row->block == NULL) return;
+
+	char *chars = malloc(row->size + 1);
+	memcpy(chars, row->chars, row->size);
+	chars[row->size] = '\0';
+
+	editorBlockRelease(row->block);
+	row->block = NULL;
+	row->chars = chars;
+}
+
+void editorRowsReserve(int n)
+{
+	if (n <= E.buf->row_cap) return;
+
+	int cap = E.buf->row_cap ? E.buf->row_cap : 64;
+	while (cap < n) cap *= 2;
+	E.buf->row = realloc(E.buf->row, sizeof(editor_row_t) * cap);
+	E.buf->row_cap = cap;
+}
+
+void editorInitRow(editor_row_t *row, int at, char *s, int len, editor_block_t *block)
+{
+	row->idx = at;
+	row->size = len;
+	row->chars = s;
+	row->block = block;
+	row->render_size = 0;
+	row->render = NULL;
+	row->hl = NULL;
+	row->hl_open_comment = 0;
+	row->brackets.low_after = BRACKET_UNKNOWN;
+}
+
+/*
+ * @brief		Добавляет в конец буфера строку, ссылающуюся на текст в блоке, без копирования
+ * @param s		Текст строки внутри блока, завершённый '\0'
+ * @param flags	Признаки строки из индекса кэша или NULL. С ними строка не
+ *				разбирается: render и подсветка строятся, когда она попадёт на экран
+ */
+void editorAppendRowIndexed(char *s, int len, editor_block_t *block, const uint32_t *flags)
+{
+	int at = E.buf->num_rows;
+
+	editorRowsReserve(at + 1);
+
+	block->refs++;
+	editorInitRow(&E.buf->row[at], at, s, len, block);
+	editorDiffTouch(at, 1);
+	if (flags) {
+		editorCacheApplyRow(&E.buf->row[at], *flags);
+	} else {
+		editorUpdateRow(&E.buf->row[at]);
+		if (!editorRowInRenderCache(at)) editorRowDropRender(E.buf, &E.buf->row[at]);
+	}
+
+	/* строка в конце не сдвигает остальные, индексы просто растут */
+	if (E.buf->wrap_valid && E.buf->wrap_index.n == at)
+		fenwickAppend(&E.buf->wrap_index, editorWrapRowLines(&E.buf->row[at], E.buf->wrap_width));
+	if (E.buf->offset_valid && E.buf->offset_index.n == at)
+		fenwickAppend(&E.buf->offset_index, len + 1);
+
+	E.buf->num_rows++;
+	E.buf->dirty++;
+	editorOffsetInserted(at, 1);
+
+	editorUndoPush(UNDO_INSERT_ROW, at, 0, NULL, 0);
+}
+
+void editorAppendRowRef(char *s, int len, editor_block_t *block)
+{
+	editorAppendRowIndexed(s, len, block, NULL);
+}
+
+void editorInsertRow(int at, char *s, size_t len)
+{
+	if (at < 0 || at > E.buf->num_rows) return;
+
+	E.buf->wrap_valid = 0;
+	E.buf->offset_valid = 0;
+	editorSyntaxStaleShift(at, 1);
+	editorRenderLogShift(at, 1);
+	if (E.hl_defer) editorSyntaxDeferShift(at, 1);
+	editorRowsReserve(E.buf->num_rows + 1);
+	memmove(&E.buf->row[at + 1], &E.buf->row[at], sizeof(editor_row_t) * (E.buf->num_rows - at));
+	for (int j = at + 1; j <= E.buf->num_rows; j++)
+		E.buf->row[j].idx++;
+
+	char *chars = malloc(len + 1);
+	memcpy(chars, s, len);
+	chars[len] = '\0';
+	editorInitRow(&E.buf->row[at], at, chars, len, NULL);
+	editorDiffTouch(at, 1);
+	E.buf->num_rows++;
+	editorOffsetInserted(at, 1);
+	editorBracketShift(at, 1);
+
+	editorUpdateRow(&E.buf->row[at]);
+
+	E.buf->dirty++;
+
+	editorJournalOp(UNDO_INSERT_ROW, at, 0, s, len);
+	editorUndoPush(UNDO_INSERT_ROW, at, 0, NULL, 0);
+}
+
+void editorFreeRow(editor_row_t *row)
+{
+	editorRowDropRender(E.buf, row);
+	if (row->block) editorBlockRelease(row->block);
+	else free(row->chars);
+}
+
+void editorDelRow(int at)
+{
+	if (at < 0 || at >= E.buf->num_rows) return;
+
+	E.buf->wrap_valid = 0;
+	E.buf->offset_valid = 0;
+	editorSyntaxStaleShift(at, -1);
+	editorRenderLogShift(at, -1);
+	if (E.hl_defer) editorSyntaxDeferShift(at, -1);
+	editorDiffTouch(at, -1);
+	editorOffsetDeleting(at, 1);
+	editorJournalOp(UNDO_DELETE_ROW, at, 0, NULL, 0);
+	if (!E.buf->undo_suspend) editorRowOwnChars(&E.buf->row[at]);
+	if (editorUndoPush(UNDO_DELETE_ROW, at, 0, E.buf->row[at].chars, E.buf->row[at].size))
+		E.buf->row[at].chars = NULL;
+	editorFreeRow(&E.buf->row[at]);
+	memmove(&E.buf->row[at], &E.buf->row[at + 1], sizeof(editor_row_t) * (E.buf->num_rows - at - 1));
+	for (int j = at; j <= E.buf->num_rows - 1; j++)
+		E.buf->row[j].idx--;
+	E.buf->num_rows--;
+	E.buf->dirty++;
+	editorBracketShift(at, -1);
+}
+
+/*
+ * @brief		Вставляет n строк перед at одним сдвигом массива, не копируя текст
+ * @param spans	Текст строк; владение им переходит буферу
+ */
+void editorInsertRowsRef(int at, editor_span_t *spans, int n)
+{
+	if (at < 0 || at > E.buf->num_rows || n <= 0) return;
+
+	E.buf->wrap_valid = 0;
+	E.buf->offset_valid = 0;
+	editorSyntaxStaleShift(at, n);
+	editorRenderLogShift(at, n);
+	if (E.hl_defer) editorSyntaxDeferShift(at, n);
+	editorRowsReserve(E.buf->num_rows + n);
+	memmove(&E.buf->row[at + n], &E.buf->row[at], sizeof(editor_row_t) * (E.buf->num_rows - at));
+	for (int j = at + n; j < E.buf->num_rows + n; j++)
+		E.buf->row[j].idx += n;
+	E.buf->num_rows += n;
+	editorDiffTouch(at, n);
+	editorDiffTouch(at + n - 1, 0);
+
+	for (int j = at; j < at + n; j++) {
+		editorInitRow(&E.buf->row[j], j, spans[j - at].s, spans[j - at].len, spans[j - at].block);
+		editorRowMeasure(&E.buf->row[j]);
+	}
+	editorOffsetInserted(at, n);
+	editorBracketShift(at, n);
+
+	/*
+	 * Строки не подсвечиваются: render строится, когда они попадут на экран.
+	 * Состояние комментария после них становится неизвестным, его
+	 * досчитывает hl_stale.
+	 */
+	editor_buffer_t *b = E.buf;
+	if (b->syntax && b->syntax->multiline_comment_start && b->syntax->multiline_comment_end)
+		if (b->hl_stale < 0 || b->hl_stale > at) b->hl_stale = at;
+	editorJournalRows(at, spans, n);
+
+	E.buf->dirty++;
+	editorUndoPush(UNDO_INSERT_ROWS, at, 0, NULL, n);
+}
+
+void editorSpansFree(editor_span_t *spans, int n)
+{
+	for (int j = 0; j < n; j++) {
+		if (spans[j].block) editorBlockRelease(spans[j].block);
+		else free(spans[j].s);
+	}
+	free(spans);
+}
+
+/*
+ * @brief		Удаляет строки [at, at + n) одним сдвигом массива; текст уходит в журнал отмены
+ */
+void editorDelRows(int at, int n)
+{
+	if (at < 0 || n <= 0 || at + n > E.buf->num_rows) return;
+
+	E.buf->wrap_valid = 0;
+	E.buf->offset_valid = 0;
+	editorSyntaxStaleShift(at, -n);
+	editorRenderLogShift(at, -n);
+	if (E.hl_defer) editorSyntaxDeferShift(at, -n);
+	editorDiffTouch(at, -n);
+	editorOffsetDeleting(at, n);
+
+	editor_span_t *spans = E.buf->undo_suspend ? NULL : malloc(sizeof(editor_span_t) * n);
+	for (int j = 0; j < n; j++) {
+		editor_row_t *row = &E.buf->row[at + j];
+		editorJournalOp(UNDO_DELETE_ROW, at, 0, NULL, 0);
+		editorRowDropRender(E.buf, row);
+		if (spans) {
+			spans[j].s = row->chars;
+			spans[j].len = row->size;
+			spans[j].block = row->block;
+		} else if (row->block) {
+			editorBlockRelease(row->block);
+		} else {
+			free(row->chars);
+		}
+	}
+
+	memmove(&E.buf->row[at], &E.buf->row[at + n], sizeof(editor_row_t) * (E.buf->num_rows - at - n));
+	E.buf->num_rows -= n;
+	for (int j = at; j < E.buf->num_rows; j++)
+		E.buf->row[j].idx -= n;
+	E.buf->dirty++;
+	editorBracketShift(at, -n);
+
+	if (spans) editorUndoPushSpans(UNDO_DELETE_ROWS, at, spans, n);
+
+	/* следующая строка могла зависеть от многострочного комментария удалённых */
+	if (at < E.buf->num_rows) editorUpdateSyntax(&E.buf->row[at]);
+}
+
+void editorRowInsertChar(editor_row_t *row, int index, int character)
+{
+	if (index < 0 || index > row->size) index = row->size;
+	editorRowOwnChars(row);
+	row->chars = (char *) realloc(row->chars, row->size + 2);
+
+	memmove(&row->chars[index + 1], &row->chars[index], row->size - index + 1);
+
+	row->size++;
+	row->chars[index] = character;
+	editorOffsetResize(row, 1);
+
+	editorUpdateRow(row);
+
+	E.buf->dirty++;
+
+	editorJournalOp(UNDO_INSERT_CHARS, row->idx, index, &row->chars[index], 1);
+	editorUndoPush(UNDO_INSERT_CHARS, row->idx, index, NULL, 1);
+}
+
+void editorRowInsertString(editor_row_t *row, int index, char *s, size_t len)
+{
+	if (index < 0 || index > row->size) index = row->size;
+	editorRowOwnChars(row);
+	row->chars = realloc(row->chars, row->size + len + 1);
+
+	memmove(&row->chars[index + len], &row->chars[index], row->size - index + 1);
+	memcpy(&row->chars[index], s, len);
+	row->size += len;
+	editorOffsetResize(row, len);
+
+	editorUpdateRow(row);
+	E.buf->dirty++;
+
+	editorJournalOp(UNDO_INSERT_CHARS, row->idx, index, s, len);
+	editorUndoPush(UNDO_INSERT_CHARS, row->idx, index, NULL, len);
+}
+
+void editorRowAppendString(editor_row_t *row, char *s, size_t len)
+{
+	editorRowInsertString(row, row->size, s, len);
+}
+
+void editorRowDelString(editor_row_t *row, int index, int len)
+{
+	if (index < 0 || index >= row->size || len <= 0) return;
+	if (len > row->size - index) len = row->size - index;
+
+	editorJournalOp(UNDO_DELETE_CHARS, row->idx, index, NULL, len);
+	if (editorUndoPush(UNDO_DELETE_CHARS, row->idx, index, NULL, len))
+		memcpy(E.buf->undo[E.buf->num_undo - 1].text, &row->chars[index], len);
+
+	editorRowOwnChars(row);
+	memmove(&row->chars[index], &row->chars[index + len], row->size - index - len + 1);
+	row->size -= len;
+	editorOffsetResize(row, -len);
+	editorUpdateRow(row);
+
+	E.buf->dirty++;
+}
+
+void editorRowDelChar(editor_row_t *row, int index_char)
+{
+	editorRowDelString(row, index_char, 1);
+}
+
+/*
+ * @brief		Заменяет содержимое строки, передавая владение буфером s строке
+ * @return		Прежний буфер строки (владение переходит к вызывающему)
+ */
+char *editorRowSetChars(editor_row_t *row, char *s, int len)
+{
+	editorJournalOp(UNDO_SET_ROW, row->idx, 0, s, len);
+	editorDiffTouch(row->idx, 0);
+	editorRowOwnChars(row);
+	char *old = row->chars;
+	editorOffsetResize(row, len - row->size);
+	row->chars = s;
+	row->size = len;
+	E.buf->dirty++;
+	return old;
+}
+
+/* *** Bracket index *** */
+
+/*
+ * Индекс парных скобок. При подсветке строки запоминается, на сколько она
+ * меняет глубину вложенности скобок вне строк и комментариев и как низко
+ * глубина опускается внутри неё. Строки собраны в группы примерно по
+ * BRACKET_GROUP, над группами построено дерево отрезков, которое помнит и
+ * число строк в каждом узле: пара ищется спуском по дереву за O(log n) и
+ * просмотром одной группы, а не всех строк между скобками. Глубина при
+ * поиске считается от скобки, а не от начала файла.
+ *
+ * Вставка и удаление строк меняют только группы, в которые они попали:
+ * переполненная группа делится, опустевшая или слишком маленькая сливается
+ * с соседней, и дерево пересчитывается от изменённых листьев. Группа со
+ * строками, которые ещё не подсвечивались (из кэша индекса или после
+ * перестановки строк), помечена неизвестной и подсвечивается, только
+ * когда до неё дошёл спуск при поиске пары.
+ */
+
+#define BRACKET_GROUP 64
+
+const bracket_sum_t bracket_empty = { 0, BRACKET_NONE, BRACKET_NONE };
+
+/*
+ * @brief		Изменение глубины скобкой в позиции i render: +1, -1 или 0
+ */
+int editorBracketDelta(editor_row_t *row, int i)
+{
+	if (row->hl[i] != HL_NORMAL) return 0;
+
+	switch (row->render[i]) {
+		case '(': case '[': case '{': return 1;
+		case ')': case ']': case '}': return -1;
+		default: return 0;
+	}
+}
+
+int editorBracketPair(char a, char b)
+{
+	return (a == '(' && b == ')') || (a == '[' && b == ']') || (a == '{' && b == '}') ||
+			(b == '(' && a == ')') || (b == '[' && a == ']') || (b == '{' && a == '}');
+}
+
+bracket_sum_t editorBracketCombine(bracket_sum_t a, bracket_sum_t b)
+{
+	bracket_sum_t s = a;
+	s.depth += b.depth;
+	if (a.depth + b.low_after < s.low_after) s.low_after = a.depth + b.low_after;
+	if (a.depth + b.low_before < s.low_before) s.low_before = a.depth + b.low_before;
+	return s;
+}
+
+void editorBracketPull(int i)
+{
+	bracket_node_t *t = E.buf->bracket_index.node;
+	t[i].sum = editorBracketCombine(t[2 * i].sum, t[2 * i + 1].sum);
+	t[i].rows = t[2 * i].rows + t[2 * i + 1].rows;
+	t[i].unknown = t[2 * i].unknown + t[2 * i + 1].unknown;
+}
+
+/*
+ * @brief		Пересчитывает узлы над листьями [lo, hi]
+ */
+void editorBracketPullRange(int lo, int hi)
+{
+	bracket_index_t *t = &E.buf->bracket_index;
+	for (lo = (t->size + lo) / 2, hi = (t->size + hi) / 2; lo > 0; lo /= 2, hi /= 2) {
+		for (int i = lo; i <= hi; i++)
+			editorBracketPull(i);
+	}
+}
+
+/*
+ * @brief		Собирает сводку листа g из его строк, начиная со строки first
+ */
+void editorBracketFillLeaf(int g, int first)
+{
+	bracket_node_t *leaf = &E.buf->bracket_index.node[E.buf->bracket_index.size + g];
+	leaf->sum = bracket_empty;
+	leaf->unknown = 0;
+
+	for (int j = first; j < first + leaf->rows; j++) {
+		editor_row_t *row = &E.buf->row[j];
+		if (row->brackets.low_after == BRACKET_UNKNOWN) leaf->unknown = 1;
+		else leaf->sum = editorBracketCombine(leaf->sum, row->brackets);
+	}
+}
+
+void editorBracketSetGroup(int g, int first)
+{
+	editorBracketFillLeaf(g, first);
+	editorBracketPullRange(g, g);
+}
+
+/*
+ * @brief		Номер первой строки группы g
+ */
+int editorBracketGroupFirst(int g)
+{
+	bracket_index_t *t = &E.buf->bracket_index;
+	int first = 0;
+
+	for (int l = t->size, r = t->size + g; l < r; l /= 2, r /= 2) {
+		if (l & 1) first += t->node[l++].rows;
+		if (r & 1) first += t->node[--r].rows;
+	}
+	return first;
+}
+
+/*
+ * @brief		Группа, в которой лежит строка at; для конца индекса -- последняя
+ * @param first	Номер первой строки группы
+ */
+int editorBracketLocate(int at, int *first)
+{
+	bracket_index_t *t = &E.buf->bracket_index;
+
+	if (at >= t->n) {
+		int g = t->groups - 1;
+		*first = t->n - t->node[t->size + g].rows;
+		return g;
+	}
+
+	int i = 1;
+	*first = 0;
+	while (i < t->size) {
+		if (at < t->node[2 * i].rows) {
+			i = 2 * i;
+		} else {
+			at -= t->node[2 * i].rows;
+			*first += t->node[2 * i].rows;
+			i = 2 * i + 1;
+		}
+	}
+	return i - t->size;
+}
+
+/*
+ * @brief		Подсвечивает ещё не подсвечивавшиеся строки группы g
+ */
+void editorBracketResolve(int g)
+{
+	bracket_index_t *t = &E.buf->bracket_index;
+	int first = editorBracketGroupFirst(g);
+
+	for (int j = first; j < first + t->node[t->size + g].rows; j++) {
+		editor_row_t *row = &E.buf->row[j];
+		if (row->brackets.low_after != BRACKET_UNKNOWN) continue;
+		if (row->render) {
+			editorUpdateSyntaxRow(row);
+		} else {
+			editorRowEnsureRender(row);
+			if (!editorRowInRenderCache(j)) editorRowDropRender(E.buf, row);
+		}
+	}
+	editorBracketSetGroup(g, first);
+}
+
+/*
+ * @brief		Пересчитывает сводку скобок строки после подсветки
+ */
+void editorBracketSummarize(editor_row_t *row)
+{
+	bracket_sum_t s = bracket_empty;
+
+	for (int i = 0; i < row->render_size; i++) {
+		int d = editorBracketDelta(row, i);
+		if (d == 0) continue;
+		if (s.depth < s.low_before) s.low_before = s.depth;
+		s.depth += d;
+		if (s.depth < s.low_after) s.low_after = s.depth;
+	}
+
+	int known = (row->brackets.low_after != BRACKET_UNKNOWN);
+	if (known && !memcmp(&s, &row->brackets, sizeof(s))) return;
+	row->brackets = s;
+
+	/* группа с неизвестной строкой и так пересчитается, когда до неё дойдёт поиск */
+	bracket_index_t *t = &E.buf->bracket_index;
+	if (known && E.buf->bracket_valid && row->idx < t->n) {
+		int first, g = editorBracketLocate(row->idx, &first);
+		editorBracketSetGroup(g, first);
+	}
+}
+
+void editorBracketRebuild()
+{
+	bracket_index_t *t = &E.buf->bracket_index;
+	int groups = (E.buf->num_rows + BRACKET_GROUP - 1) / BRACKET_GROUP;
+	if (groups == 0) groups = 1;
+
+	/* запас листьев, чтобы деление групп не перестраивало дерево сразу */
+	t->size = 1;
+	while (t->size < 2 * groups) t->size *= 2;
+	free(t->node);
+	t->node = malloc(sizeof(bracket_node_t) * 2 * t->size);
+	t->n = E.buf->num_rows;
+	t->groups = groups;
+
+	for (int g = 0; g < t->size; g++) {
+		bracket_node_t *leaf = &t->node[t->size + g];
+		leaf->rows = (g < groups) ? BRACKET_GROUP : 0;
+		if (g == groups - 1) leaf->rows = t->n - g * BRACKET_GROUP;
+		editorBracketFillLeaf(g, g * BRACKET_GROUP);
+	}
+	editorBracketPullRange(0, t->size - 1);
+	E.buf->bracket_valid = 1;
+}
+
+/*
+ * @brief		Раскладывает заново строки групп [g0, g1], у которых изменилось
+ *				число строк: большая группа делится, пустая убирается, маленькая
+ *				сливается с соседней
+ * @param first	Номер первой строки группы g0
+ */
+void editorBracketRegroup(int g0, int g1, int first)
+{
+	bracket_index_t *t = &E.buf->bracket_index;
+	bracket_node_t *leaf = &t->node[t->size];
+
+	if (g0 == g1 && leaf[g0].rows < BRACKET_GROUP / 4 && g1 + 1 < t->groups) g1++;
+
+	int rows = 0;
+	for (int g = g0; g <= g1; g++)
+		rows += leaf[g].rows;
+
+	/* одна группа в пределах нормы просто пересчитывается */
+	if (g0 == g1 && rows > 0 && rows <= 2 * BRACKET_GROUP) {
+		editorBracketSetGroup(g0, first);
+		return;
+	}
+
+	int k = (rows + BRACKET_GROUP - 1) / BRACKET_GROUP;
+	int groups = t->groups - (g1 - g0 + 1) + k;
+	if (groups == 0) {
+		k = groups = 1;
+	}
+	if (groups > t->size) {
+		editorBracketRebuild();
+		return;
+	}
+
+	int old_groups = t->groups;
+	memmove(&leaf[g0 + k], &leaf[g1 + 1], sizeof(bracket_node_t) * (old_groups - g1 - 1));
+	for (int g = groups; g < old_groups; g++) {
+		leaf[g].sum = bracket_empty;
+		leaf[g].rows = 0;
+		leaf[g].unknown = 0;
+	}
+	for (int p = 0; p < k; p++) {
+		leaf[g0 + p].rows = rows / k + (p < rows % k);
+		editorBracketFillLeaf(g0 + p, first);
+		first += leaf[g0 + p].rows;
+	}
+	t->groups = groups;
+
+	if (groups == old_groups) editorBracketPullRange(g0, g0 + k - 1);
+	else editorBracketPullRange(g0, (groups > old_groups ? groups : old_groups) - 1);
+}
+
+/*
+ * @brief		Учитывает в индексе вставку (n > 0) или удаление (n < 0) строк с at.
+ *				Вызывается, когда массив строк уже сдвинут, а вставленные строки
+ *				инициализированы.
+ */
+void editorBracketShift(int at, int n)
+{
+	bracket_index_t *t = &E.buf->bracket_index;
+	/* строки за концом индекса допишет editorBracketEnsure */
+	if (!E.buf->bracket_valid || at > t->n) return;
+
+	int first, g = editorBracketLocate(at, &first);
+	bracket_node_t *leaf = &t->node[t->size];
+
+	if (n > 0) {
+		leaf[g].rows += n;
+		t->n += n;
+		editorBracketRegroup(g, g, first);
+		return;
+	}
+
+	n = -n;
+	if (n > t->n - at) n = t->n - at;
+	t->n -= n;
+
+	/* удалённые строки занимают хвост группы g и начала следующих */
+	int last = g;
+	int take = first + leaf[g].rows - at;
+	for (int left = n; left > 0; last++) {
+		if (take > left) take = left;
+		leaf[last].rows -= take;
+		left -= take;
+		if (left == 0) break;
+		take = leaf[last + 1].rows;
+	}
+	editorBracketRegroup(g, last, first);
+}
+
+void editorBracketEnsure()
+{
+	bracket_index_t *t = &E.buf->bracket_index;
+
+	if (!E.buf->bracket_valid || E.buf->num_rows < t->n) {
+		editorBracketRebuild();
+		return;
+	}
+
+	/* строки, дописанные в конец, попадают в последнюю группу */
+	if (E.buf->num_rows > t->n) editorBracketShift(t->n, E.buf->num_rows - t->n);
+}
+
+void editorBracketFree(editor_buffer_t *b)
+{
+	free(b->bracket_index.node);
+	b->bracket_index.node = NULL;
+	b->bracket_valid = 0;
+}
+
+/*
+ * @brief		Первая группа не левее from, где глубина после скобки опускается до target
+ * @param base	Глубина в начале группы from; на выходе -- в начале найденной группы
+ */
+int editorBracketDescendFirst(int node, int nl, int nr, int from, int *base, int target)
+{
+	bracket_index_t *t = &E.buf->bracket_index;
+
+	if (nr <= from || nl >= t->groups) return -1;
+	if (nr - nl == 1 && t->node[node].unknown) editorBracketResolve(nl);
+
+	bracket_node_t *s = &t->node[node];
+	if (nl >= from && !s->unknown && *base + s->sum.low_after > target) {
+		*base += s->sum.depth;
+		return -1;
+	}
+	if (nr - nl == 1) return nl;
+
+	int mid = (nl + nr) / 2;
+	int g = editorBracketDescendFirst(2 * node, nl, mid, from, base, target);
+	if (g >= 0) return g;
+	return editorBracketDescendFirst(2 * node + 1, mid, nr, from, base, target);
+}
+
+/*
+ * @brief		Последняя группа не правее to, где глубина перед скобкой не выше target
+ * @param end	Глубина в конце группы to; на выходе -- в начале найденной группы
+ */
+int editorBracketDescendLast(int node, int nl, int nr, int to, int *end, int target)
+{
+	bracket_index_t *t = &E.buf->bracket_index;
+
+	if (nl > to) return -1;
+	if (nr - nl == 1 && t->node[node].unknown) editorBracketResolve(nl);
+
+	bracket_node_t *s = &t->node[node];
+	if (nr - 1 <= to && !s->unknown && *end - s->sum.depth + s->sum.low_before > target) {
+		*end -= s->sum.depth;
+		return -1;
+	}
+	if (nr - nl == 1) {
+		*end -= s->sum.depth;
+		return nl;
+	}
+
+	int mid = (nl + nr) / 2;
+	int g = editorBracketDescendLast(2 * node + 1, mid, nr, to, end, target);
+	if (g >= 0) return g;
+	return editorBracketDescendLast(2 * node, nl, mid, to, end, target);
+}
+
+/*
+ * @brief		Первая строка не выше from, в которой глубина после скобки опускается
+ *				до target; глубина считается от начала строки from
+ * @param base	Глубина в начале найденной строки
+ */
+int editorBracketFindFirst(int from, int target, int *base)
+{
+	bracket_index_t *t = &E.buf->bracket_index;
+	int first, g = editorBracketLocate(from, &first);
+	int depth = 0;
+	int j = from;
+
+	for (int pass = 0; pass < 2; pass++) {
+		if (t->node[t->size + g].unknown) editorBracketResolve(g);
+		for (; j < first + t->node[t->size + g].rows; j++) {
+			if (depth + E.buf->row[j].brackets.low_after <= target) {
+				*base = depth;
+				return j;
+			}
+			depth += E.buf->row[j].brackets.depth;
+		}
+		if (pass || j >= t->n) break;
+
+		g = editorBracketDescendFirst(1, 0, t->size, g + 1, &depth, target);
+		if (g < 0) break;
+		first = j = editorBracketGroupFirst(g);
+	}
+	return -1;
+}
+
+/*
+ * @brief		Последняя строка не ниже to, в которой глубина перед скобкой не выше
+ *				target; глубина считается от конца строки to
+ * @param base	Глубина в начале найденной строки
+ */
+int editorBracketFindLast(int to, int target, int *base)
+{
+	bracket_index_t *t = &E.buf->bracket_index;
+	int first, g = editorBracketLocate(to, &first);
+	int depth = 0;
+	int j = to;
+
+	for (int pass = 0; pass < 2; pass++) {
+		if (t->node[t->size + g].unknown) editorBracketResolve(g);
+		for (; j >= first; j--) {
+			depth -= E.buf->row[j].brackets.depth;
+			if (depth + E.buf->row[j].brackets.low_before <= target) {
+				*base = depth;
+				return j;
+			}
+		}
+		if (pass || g == 0) break;
+
+		/* спуск начинается с глубины в конце группы g - 1, то есть в начале g */
+		int end = depth;
+		g = editorBracketDescendLast(1, 0, t->size, g - 1, &end, target);
+		if (g < 0) break;
+		first = editorBracketGroupFirst(g);
+		j = first + t->node[t->size + g].rows - 1;
+		depth = end + t->node[t->size + g].sum.depth;
+	}
+	return -1;
+}
+
+/*
+ * @brief		Находит парную скобку к скобке в строке at, байт i в render
+ * @return		1, если пара найдена: строка в match_row, байт render в match_at
+ */
+int editorBracketMatch(int at, int i, int *match_row, int *match_at)
+{
+	editor_row_t *row = &E.buf->row[at];
+	editorRowEnsureRender(row);
+
+	int d = (i < row->render_size) ? editorBracketDelta(row, i) : 0;
+	if (d == 0) return 0;
+	char c = row->render[i];
+
+	/* сначала пара ищется в той же строке */
+	int depth = 0, j;
+	if (d > 0) {
+		for (j = i; j < row->render_size; j++)
+			if ((depth += editorBracketDelta(row, j)) == 0) break;
+	} else {
+		for (j = i; j >= 0; j--)
+			if ((depth -= editorBracketDelta(row, j)) == 0) break;
+	}
+
+	int s = at;
+	if (j < 0 || j >= row->render_size) {
+		editorBracketEnsure();
+
+		/* глубина отсчитывается от границы строки at, непарных скобок в ней depth */
+		int base, target = -depth;
+		if (d > 0) {
+			s = (at + 1 < E.buf->num_rows) ? editorBracketFindFirst(at + 1, target, &base) : -1;
+			if (s < 0) return 0;
+
+			row = &E.buf->row[s];
+			editorRowEnsureRender(row);
+			for (j = 0; j < row->render_size; j++)
+				if ((base += editorBracketDelta(row, j)) <= target) break;
+		} else {
+			s = (at > 0) ? editorBracketFindLast(at - 1, target, &base) : -1;
+			if (s < 0) return 0;
+
+			row = &E.buf->row[s];
+			editorRowEnsureRender(row);
+			base += row->brackets.depth;
+			for (j = row->render_size - 1; j >= 0; j--)
+				if ((base -= editorBracketDelta(row, j)) <= target) break;
+		}
+		if (j < 0 || j >= row->render_size) return 0;
+	}
+
+	int ok = editorBracketPair(c, row->render[j]);
+	if (ok) {
+		*match_row = s;
+		*match_at = j;
+	}
+	if (s != at && !editorRowInRenderCache(s)) editorRowDropRender(E.buf, row);
+	return ok;
+}
+
+/*
+ * @brief		Запоминает пару скобки под курсором для подсветки
+ */
+void editorBracketUpdateMatch()
+{
+	editor_buffer_t *b = E.buf;
+	b->bracket_row = -1;
+
+	if (b->cy >= b->num_rows) return;
+	editor_row_t *row = &b->row[b->cy];
+	if (b->cx >= row->size || !strchr("()[]{}", row->chars[b->cx])) return;
+
+	editorBracketMatch(b->cy, editorRowCxToRenderIdx(row, b->cx), &b->bracket_row, &b->bracket_at);
+}
+
+/*
+ * @brief		Переводит курсор на скобку, парную скобке под ним
+ */
+void editorBracketJump()
+{
+	editor_buffer_t *b = E.buf;
+	editor_row_t *row = (b->cy < b->num_rows) ? &b->row[b->cy] : NULL;
+	int match_row, match_at;
+
+	if (row == NULL || b->cx >= row->size ||
+			!editorBracketMatch(b->cy, editorRowCxToRenderIdx(row, b->cx), &match_row, &match_at)) {
+		editorSetStatusMessage("No matching bracket");
+		return;
+	}
+
+	b->cy = match_row;
+	b->cx = editorRowRenderIdxToCx(&b->row[match_row], match_at);
+}
+
+/* *** Editor opertations *** */
+
+void editorInsertChar(int c)
+{
+	if (E.buf->cy == E.buf->num_rows) {
+		editorInsertRow(E.buf->num_rows, "", 0);
+	}
+
+	editorRowInsertChar(&E.buf->row[E.buf->cy], E.buf->cx, c);
+	E.buf->cx++;
+}
+
+void editorInsertString(char *s, int len)
+{
+	if (E.buf->cy == E.buf->num_rows) {
+		editorInsertRow(E.buf->num_rows, "", 0);
+	}
+
+	editorRowInsertString(&E.buf->row[E.buf->cy], E.buf->cx, s, len);
+	E.buf->cx += len;
+}
+
+/*
+ * @brief		Дочитывает из ввода оставшиеся байты символа UTF-8 и вставляет его целиком
+ * @param c		Первый байт символа
+ */
+void editorInsertUtf8(int c)
+{
+	char seq[4];
+	int len = utf8SeqLen(c);
+	int n = 1;
+
+	seq[0] = c;
+	while (n < len && utf8IsCont((unsigned char) (seq[n] = editorReadKey())))
+		n++;
+
+	editorInsertString(seq, n);
+}
+
+void editorInsertNewLine() 
+{
+	if (E.buf->cx == 0) {
+		editorInsertRow(E.buf->cy, "", 0);
+	} else {
+		editor_row_t *row = &E.buf->row[E.buf->cy];
+
+		editorInsertRow(E.buf->cy + 1, &row->chars[E.buf->cx], row->size - E.buf->cx);
+		row = &E.buf->row[E.buf->cy];
+		editorRowDelString(row, E.buf->cx, row->size - E.buf->cx);
+	}
+	E.buf->cy++;
+	E.buf->cx = 0;
+}
+
+void editorDeleteChar()
+{
+	if (E.buf->cy == E.buf->num_rows) return;
+	if (E.buf->cx == 0 && E.buf->cy == 0) return;
+
+	editor_row_t *row = &E.buf->row[E.buf->cy];
+	if (E.buf->cx > 0) {
+		int prev = utf8Prev(row->chars, E.buf->cx);
+		editorRowDelString(row, prev, E.buf->cx - prev);
+		E.buf->cx = prev;
+	} else {
+		E.buf->cx = E.buf->row[E.buf->cy - 1].size;
+		editorRowAppendString(&E.buf->row[E.buf->cy - 1], row->chars, row->size);
+		editorDelRow(E.buf->cy);
+		E.buf->cy--;
+	}
+}
+
+/* *** Clipboard *** */
+
+/*
+ * Выделение и буфер обмена. ^Space ставит метку, выделена область от неё
+ * до курсора. Копирование не переносит текст: полные строки области
+ * попадают в буфер обмена ссылками на неизменяемые блоки, как строки,
+ * прочитанные из файла. Изменённые строки области сначала переезжают в
+ * один общий блок и сами начинают ссылаться на него, так что следующая
+ * правка скопирует их текст, как у любой строки из файла. Вставка
+ * добавляет строки пачкой со ссылками на те же блоки, в том числе в
+ * другом буфере. Копируются только крайние строки области: они могут
+ * быть неполными.
+ */
+
+/*
+ * @brief		Упорядоченные границы выделения: от (r1, c1) до (r2, c2) не включительно
+ * @return		0, если метка не поставлена
+ */
+int editorSelection(int *r1, int *c1, int *r2, int *c2)
+{
+	editor_buffer_t *b = E.buf;
+	if (!b->mark || b->num_rows == 0) return 0;
+
+	int my = b->mark_cy, mx = b->mark_cx;
+	int cy = b->cy, cx = b->cx;
+
+	/* строка за концом файла выделяется до конца последней строки */
+	if (my >= b->num_rows) {
+		my = b->num_rows - 1;
+		mx = b->row[my].size;
+	}
+	if (cy >= b->num_rows) {
+		cy = b->num_rows - 1;
+		cx = b->row[cy].size;
+	}
+	if (mx > b->row[my].size) mx = b->row[my].size;
+	if (cx > b->row[cy].size) cx = b->row[cy].size;
+
+	if (my < cy || (my == cy && mx <= cx)) {
+		*r1 = my; *c1 = mx; *r2 = cy; *c2 = cx;
+	} else {
+		*r1 = cy; *c1 = cx; *r2 = my; *c2 = mx;
+	}
+	return 1;
+}
+
+/*
+ * @brief		Выделенная часть строки в байтах render, для отрисовки
+ * @return		0, если строка не выделена
+ */
+int editorSelectionRange(editor_row_t *row, int *from, int *to)
+{
+	int r1, c1, r2, c2;
+
+	*from = *to = -1;
+	if (!editorSelection(&r1, &c1, &r2, &c2) || row->idx < r1 || row->idx > r2) return 0;
+
+	*from = (row->idx == r1) ? editorRowCxToRenderIdx(row, c1) : 0;
+	*to = (row->idx == r2) ? editorRowCxToRenderIdx(row, c2) : row->render_size;
+	return 1;
+}
+
+void editorToggleMark()
+{
+	E.buf->mark = !E.buf->mark;
+	E.buf->mark_cx = E.buf->cx;
+	E.buf->mark_cy = E.buf->cy;
+	editorSetStatusMessage(E.buf->mark ? "Mark set" : "Mark cleared");
+}
+
+void editorClipFree()
+{
+	if (E.clip_lines == 0) return;
+
+	free(E.clip_first.s);
+	if (E.clip_lines > 1) free(E.clip_last.s);
+	for (int j = 0; j < E.clip_num_runs; j++)
+		editorBlockRelease(E.clip_runs[j].block);
+	free(E.clip_runs);
+	free(E.clip_lens);
+
+	E.clip_runs = NULL;
+	E.clip_lens = NULL;
+	E.clip_num_runs = 0;
+	E.clip_lines = 0;
+}
+
+editor_span_t editorSpanCopy(const char *s, int len)
+{
+	editor_span_t span = { malloc(len + 1), len, NULL };
+	memcpy(span.s, s, len);
+	span.s[len] = '\0';
+	return span;
+}
+
+/*
+ * @brief		Копирует выделение в буфер обмена
+ * @return		0, если выделения нет
+ */
+int editorClipCopy()
+{
+	int r1, c1, r2, c2;
+	if (!editorSelection(&r1, &c1, &r2, &c2)) {
+		editorSetStatusMessage("No selection (^Space sets the mark)");
+		return 0;
+	}
+
+	editorClipFree();
+	int n = r2 - r1 + 1;
+
+	/* изменённые строки середины переезжают в общий блок */
+	size_t owned = 0;
+	for (int j = r1 + 1; j < r2; j++)
+		if (E.buf->row[j].block == NULL) owned += E.buf->row[j].size + 1;
+
+	editor_block_t *blk = owned ? editorBlockNew(owned) : NULL;
+	size_t pos = 0;
+	int cap = 0;
+	E.clip_lens = malloc(sizeof(int) * (n > 2 ? n - 2 : 1));
+
+	/* соседние строки одного блока лежат подряд и хранятся одним отрезком */
+	for (int j = r1 + 1; j < r2; j++) {
+		editor_row_t *row = &E.buf->row[j];
+		if (row->block == NULL) {
+			memcpy(blk->data + pos, row->chars, row->size);
+			blk->data[pos + row->size] = '\0';
+			free(row->chars);
+			row->chars = blk->data + pos;
+			row->block = blk;
+			blk->refs++;
+			pos += row->size + 1;
+		}
+
+		editor_clip_run_t *run = E.clip_num_runs ? &E.clip_runs[E.clip_num_runs - 1] : NULL;
+		if (run == NULL || run->block != row->block || run->s + run->size != row->chars) {
+			if (E.clip_num_runs == cap) {
+				cap = cap ? cap * 2 : 16;
+				E.clip_runs = realloc(E.clip_runs, sizeof(editor_clip_run_t) * cap);
+			}
+			run = &E.clip_runs[E.clip_num_runs++];
+			*run = (editor_clip_run_t) { row->block, row->chars, 0, 0 };
+			row->block->refs++;
+		}
+		run->size += row->size + 1;
+		run->lines++;
+		E.clip_lens[j - r1 - 1] = row->size;
+	}
+	editorBlockRelease(blk);
+
+	editor_row_t *first = &E.buf->row[r1];
+	E.clip_first = editorSpanCopy(first->chars + c1, ((r1 == r2) ? c2 : first->size) - c1);
+	if (n > 1) E.clip_last = editorSpanCopy(E.buf->row[r2].chars, c2);
+	E.clip_lines = n;
+
+	E.buf->mark = 0;
+	editorSetStatusMessage("Copied %d lines", n);
+	return 1;
+}
+
+void editorClipCut()
+{
+	if (!editorCheckWritable()) return;
+
+	int r1, c1, r2, c2;
+	if (!editorSelection(&r1, &c1, &r2, &c2) || !editorClipCopy()) return;
+
+	editor_row_t *first = &E.buf->row[r1];
+	if (r1 == r2) {
+		editorRowDelString(first, c1, c2 - c1);
+	} else {
+		editor_row_t *last = &E.buf->row[r2];
+		editorRowDelString(first, c1, first->size - c1);
+		editorRowAppendString(first, last->chars + c2, last->size - c2);
+		editorDelRows(r1 + 1, r2 - r1);
+	}
+
+	E.buf->cy = r1;
+	E.buf->cx = c1;
+	editorSetStatusMessage("Cut %d lines", E.clip_lines);
+}
+
+void editorClipPaste()
+{
+	if (!editorCheckWritable()) return;
+	if (E.clip_lines == 0) {
+		editorSetStatusMessage("Clipboard is empty");
+		return;
+	}
+
+	if (E.buf->cy == E.buf->num_rows) editorInsertRow(E.buf->num_rows, "", 0);
+
+	int n = E.clip_lines;
+	editor_span_t *first = &E.clip_first;
+	editor_span_t *last = &E.clip_last;
+	editor_row_t *row = &E.buf->row[E.buf->cy];
+
+	if (n == 1) {
+		editorRowInsertString(row, E.buf->cx, first->s, first->len);
+		E.buf->cx += first->len;
+		return;
+	}
+
+	/* хвост строки под курсором уходит за последнюю вставленную строку */
+	int tail_len = row->size - E.buf->cx;
+	char *tail = malloc(last->len + tail_len + 1);
+	memcpy(tail, last->s, last->len);
+	memcpy(tail + last->len, row->chars + E.buf->cx, tail_len);
+	editorRowDelString(row, E.buf->cx, tail_len);
+	editorRowInsertString(row, E.buf->cx, first->s, first->len);
+
+	/* середина вставляется ссылками на те же блоки */
+	editor_span_t *mid = malloc(sizeof(editor_span_t) * n);
+	int k = 0;
+	for (int r = 0; r < E.clip_num_runs; r++) {
+		editor_clip_run_t *run = &E.clip_runs[r];
+		char *p = run->s;
+		for (int j = 0; j < run->lines; j++, k++) {
+			mid[k] = (editor_span_t) { p, E.clip_lens[k], run->block };
+			run->block->refs++;
+			p += E.clip_lens[k] + 1;
+		}
+	}
+	editorInsertRowsRef(E.buf->cy + 1, mid, n - 2);
+	free(mid);
+
+	editorInsertRow(E.buf->cy + n - 1, tail, last->len + tail_len);
+	free(tail);
+
+	E.buf->cy += n - 1;
+	E.buf->cx = last->len;
+	editorSetStatusMessage("Pasted %d lines", n);
+}
+
+/* *** Undo *** */
+
+void editorUndoBeginGroup()
+{
+	if (macro_pos >= 0) return;		/* весь прогон макроса отменяется целиком */
+	E.buf->undo_group++;
+}
+
+void editorUndoFreeEntry(editor_undo_t *u)
+{
+	free(u->text);
+	if (u->spans) editorSpansFree(u->spans, u->len);
+}
+
+/*
+ * @brief		Выбрасывает самые старые группы, пока журнал не уложится в пределы с запасом
+ * @note		Текущая группа не трогается, даже если она одна больше предела
+ */
+void editorUndoTrim()
+{
+	size_t max_bytes = (size_t) EDITOR_UNDO_MAX_MB << 20;
+	if (E.buf->num_undo < EDITOR_UNDO_MAX_ENTRIES && E.buf->undo_bytes <= max_bytes) return;
+
+	int drop = 0;
+	size_t bytes = E.buf->undo_bytes;
+	while (drop < E.buf->num_undo && E.buf->undo[drop].group != E.buf->undo_group &&
+		   (E.buf->num_undo - drop > EDITOR_UNDO_MAX_ENTRIES / 4 * 3 || bytes > max_bytes / 4 * 3)) {
+		int group = E.buf->undo[drop].group;
+		while (drop < E.buf->num_undo && E.buf->undo[drop].group == group) {
+			bytes -= E.buf->undo[drop].bytes;
+			editorUndoFreeEntry(&E.buf->undo[drop++]);
+		}
+	}
+	if (drop == 0) return;
+
+	memmove(E.buf->undo, E.buf->undo + drop, sizeof(editor_undo_t) * (E.buf->num_undo - drop));
+	E.buf->num_undo -= drop;
+	E.buf->undo_bytes = bytes;
+	/* сохранённое состояние ушло вместе со старыми группами */
+	if (E.buf->undo_saved >= 0) E.buf->undo_saved = (E.buf->undo_saved >= drop) ? E.buf->undo_saved - drop : -1;
+}
+
+/*
+ * @brief		Записывает операцию редактирования в журнал отмены
+ * @param text	Удалённый текст; владение буфером переходит журналу
+ * @return		1, если операция записана, 0 -- если запись приостановлена
+ */
+int editorUndoPush(int type, int row, int col, char *text, int len)
+{
+	if (E.buf->undo_suspend) return 0;
+
+	/* после отмены ниже точки сохранения новая правка уводит от сохранённого текста */
+	if (E.buf->num_undo < E.buf->undo_saved) E.buf->undo_saved = -1;
+	editorUndoTrim();
+
+	if (E.buf->num_undo == E.buf->undo_cap) {
+		E.buf->undo_cap = E.buf->undo_cap ? E.buf->undo_cap * 2 : 64;
+		E.buf->undo = realloc(E.buf->undo, sizeof(editor_undo_t) * E.buf->undo_cap);
+	}
+
+	if (type == UNDO_DELETE_CHARS && text == NULL)
+		text = malloc(len);
+
+	editor_undo_t *u = &E.buf->undo[E.buf->num_undo++];
+	u->type = type;
+	u->group = E.buf->undo_group;
+	u->row = row;
+	u->col = col;
+	u->len = len;
+	u->text = text;
+	u->spans = NULL;
+	u->bytes = text ? ((type == UNDO_PERMUTE_ROWS || type == UNDO_FILTER_ROWS) ? len * sizeof(int) : (size_t) len) : 0;
+	u->cx = E.buf->cx;
+	u->cy = E.buf->cy;
+	E.buf->undo_bytes += u->bytes;
+
+	return 1;
+}
+
+/*
+ * @brief		Отдаёт удалённые строки последней записи журнала отмены
+ */
+void editorUndoAttachSpans(editor_span_t *spans)
+{
+	editor_undo_t *u = &E.buf->undo[E.buf->num_undo - 1];
+	size_t bytes = 0;
+
+	u->spans = spans;
+	for (int j = 0; j < u->len; j++)
+		bytes += sizeof(editor_span_t) + spans[j].len;
+	u->bytes += bytes;
+	E.buf->undo_bytes += bytes;
+}
+
+/*
+ * @brief		Записывает удаление строк, забирая их текст без копирования
+ */
+void editorUndoPushSpans(int type, int row, editor_span_t *spans, int n)
+{
+	if (editorUndoPush(type, row, 0, NULL, n))
+		editorUndoAttachSpans(spans);
+	else
+		editorSpansFree(spans, n);
+}
+
+/*
+ * @brief		Очищает журнал отмены; вызывается, когда буфер совпадает с файлом
+ */
+void editorUndoClear()
+{
+	for (int j = 0; j < E.buf->num_undo; j++)
+		editorUndoFreeEntry(&E.buf->undo[j]);
+	E.buf->num_undo = 0;
+	E.buf->undo_bytes = 0;
+	E.buf->undo_saved = 0;
+}
+
+/*
+ * @brief		Отменяет последнюю группу операций (одно нажатие клавиши или одну команду)
+ */
+void editorUndo()
+{
+	if (E.buf->num_undo == 0) {
+		editorSetStatusMessage("Nothing to undo");
+		return;
+	}
+
+	int group = E.buf->undo[E.buf->num_undo - 1].group;
+	int touched_from = E.buf->num_rows;
+	int touched_to = -1;
+
+	E.buf->undo_suspend++;
+	while (E.buf->num_undo > 0 && E.buf->undo[E.buf->num_undo - 1].group == group) {
+		editor_undo_t *u = &E.buf->undo[--E.buf->num_undo];
+		E.buf->undo_bytes -= u->bytes;
+		editor_row_t *row = (u->row < E.buf->num_rows) ? &E.buf->row[u->row] : NULL;
+
+		switch (u->type) {
+			case UNDO_INSERT_ROW:
+				editorDelRow(u->row);
+				break;
+			case UNDO_DELETE_ROW:
+				editorInsertRow(u->row, u->text, u->len);
+				break;
+			case UNDO_INSERT_ROWS:
+				editorDelRows(u->row, u->len);
+				break;
+			case UNDO_DELETE_ROWS:
+				editorInsertRowsRef(u->row, u->spans, u->len);
+				free(u->spans);
+				u->spans = NULL;
+				break;
+			case UNDO_PERMUTE_ROWS:
+				editorRowsUnpermute((int *) u->text, u->len);
+				break;
+			case UNDO_FILTER_ROWS:
+				editorRowsUnfilter((int *) u->text, u->spans, u->len);
+				free(u->spans);
+				u->spans = NULL;
+				break;
+			case UNDO_INSERT_CHARS:
+				if (row) editorRowDelString(row, u->col, u->len);
+				break;
+			case UNDO_DELETE_CHARS:
+				if (row) editorRowInsertString(row, u->col, u->text, u->len);
+				break;
+			case UNDO_SET_ROW:
+				if (row) {
+					u->text = editorRowSetChars(row, u->text, u->len);
+					editorUpdateRender(row);
+					if (u->row < touched_from) touched_from = u->row;
+					if (u->row > touched_to) touched_to = u->row;
+				}
+				break;
+		}
+		free(u->text);
+
+		E.buf->cx = u->cx;
+		E.buf->cy = u->cy;
+	}
+	E.buf->undo_suspend--;
+
+	/* вернулись к сохранённому состоянию -- буфер снова совпадает с файлом */
+	if (E.buf->num_undo == E.buf->undo_saved) E.buf->dirty = 0;
+
+	/* строки, заменённые целиком, подсвечиваются одним проходом */
+	if (touched_to >= 0)
+		editorUpdateSyntaxRows(touched_from, touched_to, NULL);
+
+	if (E.buf->cy > E.buf->num_rows) E.buf->cy = E.buf->num_rows;
+	int row_len = (E.buf->cy < E.buf->num_rows) ? E.buf->row[E.buf->cy].size : 0;
+	if (E.buf->cx > row_len) E.buf->cx = row_len;
+}
+
+/* *** Journal *** */
+
+/*
+ * Журнал восстановления: рядом с файлом ведётся .имя.journal, куда
+ * дописываются правки строк в прямом виде. Записи копятся в буфере и
+ * сбрасываются на диск с fdatasync при простое, так что цена записи
+ * пропорциональна размеру правки, а не файла. Заголовок журнала хранит
+ * состояние исходного файла; при следующем открытии того же файла журнал
+ * можно проиграть поверх него. После сохранения журнал удаляется.
+ */
+
+#define JOURNAL_MAGIC "EDJ1"
+#define JOURNAL_HEADER_SIZE (4 + 4 * 8)
+#define JOURNAL_RECORD_SIZE (1 + 3 * 4)
+
+char *editorJournalPath(const char *file_name)
+{
+	char *dir_copy = strdup(file_name);
+	char *base_copy = strdup(file_name);
+	char *dir = dirname(dir_copy);
+	char *base = basename(base_copy);
+
+	size_t size = strlen(dir) + strlen(base) + 16;
+	char *path = malloc(size);
+	snprintf(path, size, "%s/.%s.journal", dir, base);
+
+	free(dir_copy);
+	free(base_copy);
+	return path;
+}
+
+void editorJournalHeader(editor_buffer_t *b, char *out)
+{
+	int64_t fields[4] = {
+		(int64_t) b->disk_ino, (int64_t) b->disk_size,
+		(int64_t) b->disk_mtime.tv_sec, (int64_t) b->disk_mtime.tv_nsec
+	};
+	memcpy(out, JOURNAL_MAGIC, 4);
+	memcpy(out + 4, fields, sizeof(fields));
+}
+
+void editorJournalFlush(editor_buffer_t *b)
+{
+	if (b->journal_fd < 0 || b->journal_len == 0) return;
+	editorWriteAll(b->journal_fd, b->journal_buf, b->journal_len);
+	b->journal_len = 0;
+	b->journal_unsynced = 1;
+}
+
+void editorJournalAppend(editor_buffer_t *b, const char *data, int len)
+{
+	if (b->journal_len + len > EDITOR_JOURNAL_BUF) editorJournalFlush(b);
+	if (len > EDITOR_JOURNAL_BUF) {
+		editorWriteAll(b->journal_fd, data, len);
+		b->journal_unsynced = 1;
+		return;
+	}
+	memcpy(b->journal_buf + b->journal_len, data, len);
+	b->journal_len += len;
+}
+
+/*
+ * @brief		Создаёт журнал буфера при первой правке после открытия или сохранения
+ * @return		1, если журнал открыт
+ */
+int editorJournalStart(editor_buffer_t *b)
+{
+	if (b->journal_fd != -1) return b->journal_fd >= 0;
+
+	char *path = editorJournalPath(b->file_name);
+	b->journal_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	free(path);
+	if (b->journal_fd == -1) {
+		b->journal_fd = -2;		/* не пытаться снова до следующего сохранения */
+		return 0;
+	}
+
+	if (b->journal_buf == NULL) b->journal_buf = malloc(EDITOR_JOURNAL_BUF);
+	b->journal_len = 0;
+
+	char header[JOURNAL_HEADER_SIZE];
+	editorJournalHeader(b, header);
+	editorJournalAppend(b, header, sizeof(header));
+	b->journal_sync_ms = editorNowMs();
+	return 1;
+}
+
+/*
+ * @brief		Дописывает правку текущего буфера в журнал
+ * @param text	Вставляемый текст для вставок и замены строки, иначе NULL
+ */
+void editorJournalOp(int type, int row, int col, const char *text, int len)
+{
+	editor_buffer_t *b = E.buf;
+	if (b->journal_suspend || b->journal_pending || b->file_name == NULL) return;
+	if (!editorJournalStart(b)) return;
+
+	char rec[JOURNAL_RECORD_SIZE];
+	int32_t fields[3] = { row, col, len };
+	rec[0] = type;
+	memcpy(rec + 1, fields, sizeof(fields));
+	editorJournalAppend(b, rec, sizeof(rec));
+	if (text) editorJournalAppend(b, text, len);
+}
+
+/*
+ * @brief		Дописывает вставку строк одной записью UNDO_INSERT_ROWS: в col
+ *				число строк, в тексте строки подряд, каждая завершена '\0'.
+ *				Строки, лежащие в блоке вплотную, копируются одним куском.
+ */
+void editorJournalRows(int at, const editor_span_t *spans, int n)
+{
+	editor_buffer_t *b = E.buf;
+	if (b->journal_suspend || b->journal_pending || b->file_name == NULL) return;
+	if (!editorJournalStart(b)) return;
+
+	int k = 0;
+	while (k < n) {
+		int count = 0, len = 0;
+		while (k + count < n && spans[k + count].len < INT_MAX - len) {
+			len += spans[k + count].len + 1;
+			count++;
+		}
+		if (count == 0) return;
+
+		char rec[JOURNAL_RECORD_SIZE];
+		int32_t fields[3] = { at + k, count, len };
+		rec[0] = UNDO_INSERT_ROWS;
+		memcpy(rec + 1, fields, sizeof(fields));
+		editorJournalAppend(b, rec, sizeof(rec));
+
+		int end = k + count;
+		while (k < end) {
+			int run = k + 1;
+			while (run < end && spans[run].s == spans[run - 1].s + spans[run - 1].len + 1) run++;
+			editorJournalAppend(b, spans[k].s, spans[run - 1].s + spans[run - 1].len + 1 - spans[k].s);
+			k = run;
+		}
+	}
+}
+
+/*
+ * @brief		Сбрасывает журналы на диск, если с прошлой синхронизации прошло
+ *				EDITOR_JOURNAL_SYNC_MS. Вызывается, пока редактор ждёт ввода.
+ */
+void editorJournalTick()
+{
+	long long now = editorNowMs();
+
+	for (int j = 0; j < E.num_buffers; j++) {
+		editor_buffer_t *b = E.buffers[j];
+		if (b->journal_fd < 0 || (b->journal_len == 0 && !b->journal_unsynced)) continue;
+		if (now - b->journal_sync_ms < EDITOR_JOURNAL_SYNC_MS) continue;
+
+		editorJournalFlush(b);
+		fdatasync(b->journal_fd);
+		b->journal_unsynced = 0;
+		b->journal_sync_ms = now;
+	}
+}
+
+/*
+ * @brief		Удаляет журнал буфера: изменения сохранены или отброшены намеренно
+ */
+void editorJournalDiscard(editor_buffer_t *b)
+{
+	if (b->journal_fd >= 0) close(b->journal_fd);
+	if (b->file_name && (b->journal_fd != -1 || b->journal_pending)) {
+		char *path = editorJournalPath(b->file_name);
+		unlink(path);
+		free(path);
+	}
+	b->journal_fd = -1;
+	b->journal_len = 0;
+	b->journal_unsynced = 0;
+	b->journal_pending = 0;
+}
+
+/*
+ * @brief		Сбрасывает журналы при обрыве сеанса (SIGHUP, SIGTERM), возвращает
+ *				терминал в исходный режим и завершается тем же сигналом.
+ *				Вызывается из цикла ввода: обработчик сигнала только ставит
+ *				E.hangup, поэтому буфер журнала не может оказаться недописанным.
+ */
+void editorJournalHangup(int sig)
+{
+	for (int j = 0; j < E.num_buffers; j++) {
+		editor_buffer_t *b = E.buffers[j];
+		if (b->journal_fd < 0) continue;
+		editorJournalFlush(b);
+		fdatasync(b->journal_fd);
+	}
+
+	/* терминала после SIGHUP может уже не быть, ошибка здесь не важна */
+	if (!E.server) tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/*
+ * @brief		Отмечает буфер, если для его файла остался журнал прошлого сеанса
+ */
+void editorJournalCheck(editor_buffer_t *b)
+{
+	char *path = editorJournalPath(b->file_name);
+	b->journal_pending = (access(path, F_OK) == 0);
+	free(path);
+}
+
+/*
+ * @brief		Проверяет запись перестановки или фильтра строк перед проигрыванием:
+ *				перестановка должна быть взаимно однозначной, номера удалённых
+ *				строк -- возрастать и не выходить за буфер
+ */
+int editorJournalRowsValid(int type, const char *data, int n)
+{
+	int num_rows = E.buf->num_rows;
+	if (type == UNDO_PERMUTE_ROWS && n != num_rows) return 0;
+
+	unsigned char *seen = (type == UNDO_PERMUTE_ROWS) ? calloc(num_rows ? num_rows : 1, 1) : NULL;
+	int ok = 1, prev = -1;
+	for (int k = 0; k < n && ok; k++) {
+		int32_t j;
+		memcpy(&j, data + k * sizeof(int32_t), sizeof(j));
+		if (j < 0 || j >= num_rows) ok = 0;
+		else if (seen) ok = !seen[j]++;
+		else ok = (j > prev);
+		prev = j;
+	}
+	free(seen);
+	return ok;
+}
+
+/*
+ * @brief		Проверяет, что текст записи UNDO_INSERT_ROWS -- ровно n строк,
+ *				каждая завершена '\0'
+ */
+int editorJournalRowsSplit(const char *data, int len, int n)
+{
+	if (n <= 0 || len <= 0 || data[len - 1] != '\0') return 0;
+	int count = 0;
+	for (int k = 0; k < len; k++)
+		if (data[k] == '\0') count++;
+	return count == n;
+}
+
+/*
+ * @brief		Проигрывает записи журнала поверх строк текущего буфера.
+ *				Оборванная при сбое последняя запись отбрасывается.
+ * @return		Количество применённых правок или -1, если журнал от другой версии файла
+ */
+int editorJournalReplay(const char *data, size_t size)
+{
+	char header[JOURNAL_HEADER_SIZE];
+	editorJournalHeader(E.buf, header);
+	if (size < JOURNAL_HEADER_SIZE || memcmp(data, header, JOURNAL_HEADER_SIZE)) return -1;
+
+	const char *p = data + JOURNAL_HEADER_SIZE;
+	const char *end = data + size;
+	int applied = 0;
+
+	while (end - p >= JOURNAL_RECORD_SIZE) {
+		int type = p[0];
+		int32_t fields[3];
+		memcpy(fields, p + 1, sizeof(fields));
+		int r = fields[0], col = fields[1], len = fields[2];
+		p += JOURNAL_RECORD_SIZE;
+
+		int whole = (type == UNDO_PERMUTE_ROWS || type == UNDO_FILTER_ROWS);
+		int has_text = (type == UNDO_INSERT_ROW || type == UNDO_INSERT_ROWS || type == UNDO_INSERT_CHARS || type == UNDO_SET_ROW || whole);
+		if (len < 0 || (has_text && end - p < len)) break;
+		if (whole) {
+			if (len % sizeof(int) || !editorJournalRowsValid(type, p, len / sizeof(int))) break;
+		} else if (r < 0 || r > E.buf->num_rows || (type != UNDO_INSERT_ROW && type != UNDO_INSERT_ROWS && r == E.buf->num_rows)) {
+			break;
+		}
+
+		editor_row_t *row = (r < E.buf->num_rows) ? &E.buf->row[r] : NULL;
+		if ((type == UNDO_INSERT_CHARS || type == UNDO_DELETE_CHARS) && (col < 0 || col > row->size)) break;
+		if (type == UNDO_INSERT_ROWS && !editorJournalRowsSplit(p, len, col)) break;
+
+		switch (type) {
+			case UNDO_INSERT_ROW:
+				editorInsertRow(r, (char *) p, len);
+				break;
+			case UNDO_INSERT_ROWS:
+				{
+					/* строки уже разделены '\0' и ссылаются прямо на копию записи */
+					editor_block_t *blk = editorBlockNew(len);
+					memcpy(blk->data, p, len);
+					editor_span_t *spans = malloc(sizeof(editor_span_t) * col);
+					char *s = blk->data;
+					for (int k = 0; k < col; k++) {
+						int l = strlen(s);
+						spans[k] = (editor_span_t) { s, l, blk };
+						blk->refs++;
+						s += l + 1;
+					}
+					editorBlockRelease(blk);
+					editorInsertRowsRef(r, spans, col);
+					free(spans);
+				}
+				break;
+			case UNDO_DELETE_ROW:
+				editorDelRow(r);
+				break;
+			case UNDO_INSERT_CHARS:
+				editorRowInsertString(row, col, (char *) p, len);
+				break;
+			case UNDO_DELETE_CHARS:
+				editorRowDelString(row, col, len);
+				break;
+			case UNDO_SET_ROW:
+				{
+					char *chars = malloc(len + 1);
+					memcpy(chars, p, len);
+					chars[len] = '\0';
+					free(editorRowSetChars(row, chars, len));
+					editorUpdateRow(row);
+				}
+				break;
+			case UNDO_PERMUTE_ROWS:
+				{
+					int *perm = malloc(len ? len : 1);
+					memcpy(perm, p, len);
+					editorRowsPermute(perm);
+				}
+				break;
+			case UNDO_FILTER_ROWS:
+				{
+					unsigned char *keep = malloc(E.buf->num_rows ? E.buf->num_rows : 1);
+					memset(keep, 1, E.buf->num_rows);
+					for (int k = 0; k < len / (int) sizeof(int); k++) {
+						int32_t j;
+						memcpy(&j, p + k * sizeof(int32_t), sizeof(j));
+						keep[j] = 0;
+					}
+					editorRowsFilter(keep);
+					free(keep);
+				}
+				break;
+			default:
+				return applied;
+		}
+		if (has_text) p += len;
+		applied++;
+	}
+
+	return applied;
+}
+
+/*
+ * @brief		Предлагает восстановить правки из журнала, оставшегося после сбоя
+ */
+void editorJournalOffer()
+{
+	editor_buffer_t *b = E.buf;
+	if (!b->journal_pending || b->loader) return;
+
+	char *answer = editorPrompt("Unsaved edits found in journal. Recover? (y/n): %s", NULL);
+	int yes = answer && (answer[0] == 'y' || answer[0] == 'Y');
+	free(answer);
+	b->journal_pending = 0;
+
+	char *path = editorJournalPath(b->file_name);
+	int fd = yes ? open(path, O_RDWR | O_APPEND | O_CLOEXEC) : -1;
+
+	struct stat st;
+	char *data = NULL;
+	size_t size = 0;
+	if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+		data = malloc(st.st_size);
+		ssize_t n;
+		while (size < (size_t) st.st_size && (n = read(fd, data + size, st.st_size - size)) > 0)
+			size += n;
+	}
+
+	/* проигранные записи уже лежат в журнале, новые правки дописываются следом */
+	int applied = -1;
+	if (data) {
+		b->journal_suspend++;
+		b->undo_suspend++;
+		applied = editorJournalReplay(data, size);
+		b->undo_suspend--;
+		b->journal_suspend--;
+		free(data);
+	}
+
+	if (applied < 0) {
+		if (fd != -1) close(fd);
+		unlink(path);
+		free(path);
+		editorSetStatusMessage(yes ? "Journal does not match the file on disk, discarded"
+									: "Journal discarded");
+		return;
+	}
+	free(path);
+
+	if (b->journal_buf == NULL) b->journal_buf = malloc(EDITOR_JOURNAL_BUF);
+	b->journal_fd = fd;
+	b->journal_sync_ms = editorNowMs();
+	b->dirty = applied;
+	/* проигранные правки не записаны в журнал отмены, файл на диске им уже не достичь */
+	if (applied) b->undo_saved = -1;
+	if (b->cy > b->num_rows) b->cy = b->num_rows;
+	editorSetStatusMessage("Recovered %d edits from journal", applied);
+}
+
+/* *** Compression *** */
+
+/*
+ * Сжатые файлы (.gz, .zst) читаются и пишутся потоком, без временной копии:
+ * распакованные данные идут прямо в разбиение на строки, а при сохранении
+ * строки по одной сжимаются в файл. gzip обрабатывается zlib; zstd -- libzstd,
+ * если редактор собран с HAVE_ZSTD, иначе через внешнюю программу zstd,
+ * соединённую с редактором каналом.
+ */
+
+enum editorCompression {
+	COMPRESS_NONE = 0,
+	COMPRESS_GZIP,
+	COMPRESS_ZSTD
+};
+
+#define COMPRESS_BUF_SIZE (128 << 10)
+
+/*
+ * @brief		Определяет сжатие по первым байтам файла
+ */
+int editorDetectCompression(int fd)
+{
+	unsigned char magic[4];
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic)) return COMPRESS_NONE;
+
+	if (magic[0] == 0x1f && magic[1] == 0x8b) return COMPRESS_GZIP;
+	if (magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd) return COMPRESS_ZSTD;
+	return COMPRESS_NONE;
+}
+
+/*
+ * @brief		Определяет сжатие для сохранения по расширению имени файла
+ */
+int editorCompressionForName(const char *file_name)
+{
+	size_t len = strlen(file_name);
+	if (len > 3 && !strcmp(file_name + len - 3, ".gz")) return COMPRESS_GZIP;
+	if (len > 4 && !strcmp(file_name + len - 4, ".zst")) return COMPRESS_ZSTD;
+	return COMPRESS_NONE;
+}
+
+/*
+ * @brief		Запускает внешнюю программу с каналом на месте stdin или stdout
+ * @param in	Дескриптор для stdin программы или -1, если stdin -- канал
+ * @param out	Дескриптор для stdout программы или -1, если stdout -- канал
+ * @param pipe_fd	Конец канала, оставшийся у редактора
+ * @return		pid процесса или -1
+ */
+pid_t editorSpawnFilter(char *const argv[], int in, int out, int *pipe_fd)
+{
+	int p[2];
+	if (pipe2(p, O_CLOEXEC) == -1) return -1;
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		close(p[0]);
+		close(p[1]);
+		return -1;
+	}
+
+	if (pid == 0) {
+		dup2(in == -1 ? p[0] : in, STDIN_FILENO);
+		dup2(out == -1 ? p[1] : out, STDOUT_FILENO);
+		int null = open("/dev/null", O_WRONLY);
+		if (null != -1) dup2(null, STDERR_FILENO);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+
+	if (in == -1) {
+		close(p[0]);
+		*pipe_fd = p[1];
+	} else {
+		close(p[1]);
+		*pipe_fd = p[0];
+	}
+	return pid;
+}
+
+int editorWaitFilter(pid_t pid)
+{
+	int status;
+	while (waitpid(pid, &status, 0) == -1) {
+		if (errno != EINTR) return -1;
+	}
+	return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+typedef struct gzip_source_s {
+	z_stream zs;
+	unsigned char in[COMPRESS_BUF_SIZE];
+	int in_eof;
+	off_t consumed;			/* сжатых байт отдано inflate */
+} gzip_source_t;
+
+/*
+ * @brief		Распаковывает очередную порцию gzip. Склеенные gzip-потоки
+ *				(как у ротированных логов) читаются друг за другом.
+ */
+ssize_t editorGzipRead(editor_reader_t *r, char *buf, size_t len)
+{
+	gzip_source_t *src = r->stream;
+	z_stream *zs = &src->zs;
+
+	zs->next_out = (unsigned char *) buf;
+	zs->avail_out = len;
+
+	while (zs->avail_out > 0) {
+		if (zs->avail_in == 0 && !src->in_eof) {
+			ssize_t n = read(r->fd, src->in, sizeof(src->in));
+			if (n == -1 && errno == EINTR) continue;
+			if (n <= 0) src->in_eof = 1;
+			else {
+				zs->next_in = src->in;
+				zs->avail_in = n;
+			}
+		}
+		if (zs->avail_in == 0 && src->in_eof) break;
+
+		unsigned int avail = zs->avail_in;
+		int ret = inflate(zs, Z_NO_FLUSH);
+		src->consumed += avail - zs->avail_in;
+		if (ret == Z_STREAM_END) {
+			if (inflateReset(zs) != Z_OK) break;
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			break;
+		}
+	}
+
+	return len - zs->avail_out;
+}
+
+#ifdef HAVE_ZSTD
+typedef struct zstd_source_s {
+	ZSTD_DStream *zds;
+	char in[COMPRESS_BUF_SIZE];
+	ZSTD_inBuffer input;
+	int in_eof;
+	off_t consumed;
+} zstd_source_t;
+
+ssize_t editorZstdRead(editor_reader_t *r, char *buf, size_t len)
+{
+	zstd_source_t *src = r->stream;
+	ZSTD_outBuffer output = { buf, len, 0 };
+
+	while (output.pos < output.size) {
+		if (src->input.pos == src->input.size && !src->in_eof) {
+			ssize_t n = read(r->fd, src->in, sizeof(src->in));
+			if (n == -1 && errno == EINTR) continue;
+			if (n <= 0) src->in_eof = 1;
+			src->input.src = src->in;
+			src->input.size = n > 0 ? n : 0;
+			src->input.pos = 0;
+		}
+		if (src->input.pos == src->input.size && src->in_eof) break;
+
+		size_t pos = src->input.pos;
+		size_t ret = ZSTD_decompressStream(src->zds, &output, &src->input);
+		src->consumed += src->input.pos - pos;
+		if (ZSTD_isError(ret)) break;
+	}
+
+	return output.pos;
+}
+#endif
+
+/*
+ * @brief		Готовит чтение файла, распаковывая его, если он сжат
+ * @return		0 или -1, если распаковку запустить не удалось
+ */
+int editorReaderInit(editor_reader_t *r, int fd, size_t block_size)
+{
+	memset(r, 0, sizeof(*r));
+	r->fd = fd;
+	r->src_fd = fd;
+	r->block_size = block_size;
+	r->compression = editorDetectCompression(fd);
+
+	if (r->compression == COMPRESS_GZIP) {
+		gzip_source_t *src = calloc(1, sizeof(gzip_source_t));
+		if (inflateInit2(&src->zs, 15 + 32) != Z_OK) {
+			free(src);
+			return -1;
+		}
+		r->stream = src;
+	} else if (r->compression == COMPRESS_ZSTD) {
+#ifdef HAVE_ZSTD
+		zstd_source_t *src = calloc(1, sizeof(zstd_source_t));
+		src->zds = ZSTD_createDStream();
+		ZSTD_initDStream(src->zds);
+		r->stream = src;
+#else
+		/* распаковщик читает файл через общий дескриптор, по его позиции виден прогресс */
+		char *argv[] = { "zstd", "-d", "-c", "-q", NULL };
+		r->child = editorSpawnFilter(argv, fd, -1, &r->fd);
+		if (r->child == -1) return -1;
+#endif
+	}
+	return 0;
+}
+
+ssize_t editorReaderRead(editor_reader_t *r, char *buf, size_t len)
+{
+	if (r->compression == COMPRESS_GZIP) return editorGzipRead(r, buf, len);
+#ifdef HAVE_ZSTD
+	if (r->compression == COMPRESS_ZSTD) return editorZstdRead(r, buf, len);
+#endif
+	ssize_t n;
+	while ((n = read(r->fd, buf, len)) == -1 && errno == EINTR);
+	return n;
+}
+
+/*
+ * @brief		Сколько байт самого файла уже разобрано: для прогресса загрузки
+ */
+off_t editorReaderSourcePos(editor_reader_t *r)
+{
+	if (r->compression == COMPRESS_GZIP) return ((gzip_source_t *) r->stream)->consumed;
+#ifdef HAVE_ZSTD
+	if (r->compression == COMPRESS_ZSTD) return ((zstd_source_t *) r->stream)->consumed;
+#endif
+	if (r->child > 0) return lseek(r->src_fd, 0, SEEK_CUR);
+	return r->offset;
+}
+
+/*
+ * @brief		Освобождает состояние распаковки и закрывает файл
+ * @return		0 или -1, если распаковщик сообщил об ошибке
+ */
+int editorReaderClose(editor_reader_t *r)
+{
+	int ret = 0;
+
+	editorBlockRelease(r->next);
+	r->next = NULL;
+
+	if (r->compression == COMPRESS_GZIP) {
+		gzip_source_t *src = r->stream;
+		inflateEnd(&src->zs);
+		free(src);
+	}
+#ifdef HAVE_ZSTD
+	if (r->compression == COMPRESS_ZSTD) {
+		zstd_source_t *src = r->stream;
+		ZSTD_freeDStream(src->zds);
+		free(src);
+	}
+#endif
+	if (r->child > 0) {
+		close(r->fd);
+		if (r->eof) {
+			ret = editorWaitFilter(r->child);
+		} else {
+			/* чтение прервано: распаковщик останавливается, его гибель от SIGTERM -- не ошибка */
+			int status = 0;
+			pid_t w;
+			kill(r->child, SIGTERM);
+			while ((w = waitpid(r->child, &status, 0)) == -1 && errno == EINTR);
+			int stopped = WIFSIGNALED(status) && (WTERMSIG(status) == SIGTERM || WTERMSIG(status) == SIGPIPE);
+			ret = (w == r->child && ((WIFEXITED(status) && WEXITSTATUS(status) == 0) || stopped)) ? 0 : -1;
+		}
+	}
+	close(r->src_fd);
+	return ret;
+}
+
+typedef struct compress_sink_s {
+	int compression;
+	int fd;					/* файл или канал к внешнему zstd */
+	char *out;
+	z_stream zs;
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *cctx;
+#endif
+} compress_sink_t;
+
+/*
+ * @brief		Сжимает порцию данных и пишет результат в файл; несжатый поток пишется как есть
+ * @param finish	Последняя порция: поток завершается
+ */
+int editorSinkWrite(compress_sink_t *sink, const char *data, size_t len, int finish)
+{
+	if (sink->compression == COMPRESS_NONE) return editorWriteAll(sink->fd, data, len);
+
+	if (sink->compression == COMPRESS_GZIP) {
+		z_stream *zs = &sink->zs;
+		zs->next_in = (unsigned char *) data;
+		zs->avail_in = len;
+		do {
+			zs->next_out = (unsigned char *) sink->out;
+			zs->avail_out = COMPRESS_BUF_SIZE;
+			if (deflate(zs, finish ? Z_FINISH : Z_NO_FLUSH) == Z_STREAM_ERROR) return -1;
+			int have = COMPRESS_BUF_SIZE - zs->avail_out;
+			if (have && editorWriteAll(sink->fd, sink->out, have) == -1) return -1;
+		} while (zs->avail_out == 0);
+		return 0;
+	}
+
+#ifdef HAVE_ZSTD
+	ZSTD_inBuffer in = { data, len, 0 };
+	size_t remaining;
+	do {
+		ZSTD_outBuffer o = { sink->out, COMPRESS_BUF_SIZE, 0 };
+		remaining = ZSTD_compressStream2(sink->cctx, &o, &in, finish ? ZSTD_e_end : ZSTD_e_continue);
+		if (ZSTD_isError(remaining)) return -1;
+		if (o.pos && editorWriteAll(sink->fd, sink->out, o.pos) == -1) return -1;
+	} while (finish ? remaining != 0 : in.pos < in.size);
+	return 0;
+#else
+	/* внешний zstd сжимает сам, ему достаточно закрытия канала в конце */
+	(void) finish;
+	return editorWriteAll(sink->fd, data, len);
+#endif
+}
+
+/*
+ * @brief		Пишет все строки буфера в fd, при необходимости сжимая их потоком.
+ *				Строки собираются в порции по COMPRESS_BUF_SIZE, весь файл в памяти не строится.
+ * @return		Количество несжатых байт или -1 при ошибке
+ */
+long long editorWriteRows(int fd, int compression)
+{
+	compress_sink_t sink;
+	memset(&sink, 0, sizeof(sink));
+	sink.compression = compression;
+	sink.fd = fd;
+
+	pid_t pid = 0;
+	if (compression == COMPRESS_GZIP) {
+		if (deflateInit2(&sink.zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return -1;
+	} else if (compression != COMPRESS_NONE) {
+#ifdef HAVE_ZSTD
+		sink.cctx = ZSTD_createCCtx();
+#else
+		char *argv[] = { "zstd", "-c", "-q", NULL };
+		pid = editorSpawnFilter(argv, -1, fd, &sink.fd);
+		if (pid == -1) return -1;
+#endif
+	}
+
+	char *stage = malloc(COMPRESS_BUF_SIZE);
+	sink.out = malloc(COMPRESS_BUF_SIZE);
+	long long total = 0;
+	int used = 0;
+	int ok = 1;
+
+	for (int j = 0; j < E.buf->num_rows && ok; j++) {
+		editor_row_t *row = &E.buf->row[j];
+		if (used + row->size + 1 > COMPRESS_BUF_SIZE) {
+			if (editorSinkWrite(&sink, stage, used, 0) == -1) ok = 0;
+			used = 0;
+		}
+		if (row->size + 1 > COMPRESS_BUF_SIZE) {
+			if (editorSinkWrite(&sink, row->chars, row->size, 0) == -1 ||
+					editorSinkWrite(&sink, "\n", 1, 0) == -1) ok = 0;
+		} else {
+			memcpy(stage + used, row->chars, row->size);
+			stage[used + row->size] = '\n';
+			used += row->size + 1;
+		}
+		total += row->size + 1;
+	}
+	if (ok && editorSinkWrite(&sink, stage, used, 1) == -1) ok = 0;
+
+	if (compression == COMPRESS_GZIP) deflateEnd(&sink.zs);
+#ifdef HAVE_ZSTD
+	if (sink.cctx) ZSTD_freeCCtx(sink.cctx);
+#endif
+	if (pid > 0) {
+		close(sink.fd);
+		if (editorWaitFilter(pid) == -1) ok = 0;
+	}
+
+	free(stage);
+	free(sink.out);
+	return ok ? total : -1;
+}
+
+/* *** File I/O *** */
+
+/*
+ * @brief		Разбивает прочитанный кусок файла на строки, ссылающиеся на блок
+ * @param eof	Последний кусок: хвост без '\n' тоже становится строкой
+ * @return		Количество байт в начале незавершённой последней строки
+ */
+size_t editorSplitBlock(editor_block_t *blk, size_t len, int eof, editor_line_fn emit, void *ctx)
+{
+	char *p = blk->data;
+	char *end = blk->data + len;
+
+	while (p < end) {
+		char *nl = memchr(p, '\n', end - p);
+		if (nl == NULL) {
+			if (!eof) break;
+			nl = end;
+		}
+
+		size_t line_len = nl - p;
+		while (line_len > 0 && (p[line_len - 1] == '\n' || p[line_len - 1] == '\r'))
+			line_len--;
+		p[line_len] = '\0';
+
+		emit(ctx, p, line_len, blk);
+		p = nl + 1;
+	}
+
+	return (p < end) ? (size_t) (end - p) : 0;
+}
+
+/*
+ * @brief		Читает очередной кусок файла и передаёт каждую строку в emit.
+ *				Незавершённая строка в конце куска заранее копируется в начало
+ *				следующего блока, так что возвращённый блок читатель больше не трогает.
+ * @return		Прочитанный блок со ссылкой, принадлежащей вызывающему
+ */
+editor_block_t *editorReaderChunk(editor_reader_t *r, editor_line_fn emit, void *ctx, int *eof)
+{
+	size_t carry = r->carry;
+	size_t want = (carry > r->block_size) ? carry : r->block_size;
+	editor_block_t *blk = r->next ? r->next : editorBlockNew(carry + want + 1);
+
+	size_t len = carry;
+	ssize_t n;
+	while (len < carry + want && (n = editorReaderRead(r, blk->data + len, carry + want - len)) > 0)
+		len += n;
+	r->offset += len - carry;
+
+	*eof = (len < carry + want);
+	r->eof = *eof;
+	if (*eof) blk = realloc(blk, sizeof(editor_block_t) + len + 1);
+	blk->size = len;
+	r->carry = editorSplitBlock(blk, len, *eof, emit, ctx);
+	r->next = NULL;
+	r->block_size = EDITOR_BLOCK_SIZE;
+
+	if (!*eof) {
+		want = (r->carry > r->block_size) ? r->carry : r->block_size;
+		r->next = editorBlockNew(r->carry + want + 1);
+		memcpy(r->next->data, blk->data + len - r->carry, r->carry);
+	}
+	return blk;
+}
+
+/*
+ * @brief		Читает файл целиком большими блоками и передаёт каждую строку в emit.
+ *				emit сам берёт ссылку на блок, если строка должна в нём остаться.
+ *				Сжатый файл распаковывается на лету; fd закрывается.
+ */
+int editorReadLines(int fd, editor_line_fn emit, void *ctx)
+{
+	editor_reader_t r;
+	int eof = 0;
+
+	if (editorReaderInit(&r, fd, EDITOR_BLOCK_SIZE) == -1) {
+		close(fd);
+		return -1;
+	}
+	while (!eof)
+		editorBlockRelease(editorReaderChunk(&r, emit, ctx, &eof));
+	return editorReaderClose(&r);
+}
+
+void editorOpenLine(void *ctx, char *s, int len, editor_block_t *block)
+{
+	(void) ctx;
+	editorAppendRowRef(s, len, block);
+}
+
+/*
+ * @brief		Открывает файл: первый небольшой кусок читается сразу, чтобы
+ *				показать первый экран, остальное дочитывает фоновый поток
+ */
+int editorOpen(char *file_name)
+{
+	int fd = open(file_name, O_RDONLY);
+	if (fd == -1) return -1;
+
+	free(E.buf->file_name);
+	E.buf->file_name = strdup(file_name);
+	editorDiskStamp(E.buf, fd);
+
+	/* двоичный файл не разбивается на строки, а сразу показывается в hex */
+	if (editorDetectCompression(fd) == COMPRESS_NONE && editorIsBinary(fd)) {
+		close(fd);
+		E.buf->hex = E.buf->hex_binary = 1;
+		if (editorHexOpen(E.buf) == -1) return -1;
+		editorWatchBuffer(E.buf);
+		return 0;
+	}
+
+	editorSelectSyntaxHighlight();
+
+	/* неизменённый файл с сохранённым индексом не разбирается заново */
+	if (editorCacheLoad(fd) == -1) {
+		editor_reader_t r;
+		int eof;
+
+		lseek(fd, 0, SEEK_SET);
+		if (editorReaderInit(&r, fd, EDITOR_FIRST_BLOCK_SIZE) == -1) {
+			close(fd);
+			return -1;
+		}
+
+		E.buf->undo_suspend++;
+		editorBlockRelease(editorReaderChunk(&r, editorOpenLine, NULL, &eof));
+		E.buf->undo_suspend--;
+
+		if (eof) editorReaderClose(&r);
+		else editorLoaderStart(E.buf, &r);
+	}
+
+	editorWatchBuffer(E.buf);
+	editorJournalCheck(E.buf);
+	
+	editorUndoClear();
+	E.buf->dirty = 0;
+	return 0;
+}
+
+/*
+ * @brief		Сохраняет буфер, сжимая строки потоком, если имя файла того требует.
+ *				Строки пишутся во временный файл рядом, который заменяет исходный
+ *				только после полной записи и fsync, так что ни ошибка записи, ни
+ *				сбой компрессора файл не портят; журнал правок удаляется лишь после этого.
+ */
+void editorSave() 
+{
+	if (!editorCheckWritable()) return;
+
+	if (E.buf->file_name == NULL) {
+		E.buf->file_name = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+		if (E.buf->file_name == NULL) {
+			editorSetStatusMessage("Save aborted");
+			return;
+		}
+		editorSelectSyntaxHighlight();
+	}
+
+	int compression = editorCompressionForName(E.buf->file_name);
+	char *dir_copy = strdup(E.buf->file_name);
+	char *base_copy = strdup(E.buf->file_name);
+	size_t size = strlen(E.buf->file_name) + 16;
+	char *tmp = malloc(size);
+	snprintf(tmp, size, "%s/.%s.XXXXXX", dirname(dir_copy), basename(base_copy));
+	free(dir_copy);
+	free(base_copy);
+
+	errno = 0;
+	int fd = mkstemp(tmp);
+	if (fd != -1) {
+		/* права как у прежнего файла, для нового -- обычные с учётом umask */
+		struct stat st;
+		mode_t mask = umask(0);
+		umask(mask);
+		fchmod(fd, stat(E.buf->file_name, &st) == 0 ? (st.st_mode & 07777) : (0666 & ~mask));
+		errno = 0;
+
+		long long len = editorWriteRows(fd, compression);
+		if (len != -1 && fsync(fd) == 0 && rename(tmp, E.buf->file_name) == 0) {
+			fstat(fd, &st);
+			editorDiskStamp(E.buf, fd);
+			close(fd);
+			free(tmp);
+
+			editorWatchBuffer(E.buf);
+			editorJournalDiscard(E.buf);
+			E.buf->dirty = 0;
+			E.buf->undo_saved = E.buf->num_undo;
+			editorDiffRebase();
+			if (compression == COMPRESS_NONE) {
+				editorCacheStore(E.buf);
+				editorSetStatusMessage("%lld bytes written to disk", len);
+			} else {
+				editorSetStatusMessage("%lld bytes written to disk (%lld compressed)", len, (long long) st.st_size);
+			}
+			return;
+		}
+		close(fd);
+		unlink(tmp);
+	}
+	free(tmp);
+
+	editorSetStatusMessage("Can't save! I/O error: %s", errno ? strerror(errno) : "compressor failed");
+}
+
+/* *** Background loading *** */
+
+/*
+ * Большой файл дочитывается фоновым потоком. Поток только читает блоки и
+ * режет их на строки, складывая пачки в очередь; строки в буфер добавляет
+ * главный поток, пока ждёт ввода, порциями не дольше LOAD_SLICE_MS, так что
+ * остальной код по-прежнему работает с буфером без блокировок. Пока файл
+ * загружается, буфер доступен только для просмотра и поиска.
+ *
+ * Если для файла есть индекс строк в кэше, поток режет блоки по смещениям
+ * из индекса, а не ищет '\n', и пачка несёт признаки строк из индекса --
+ * такие строки не разбираются вовсе.
+ */
+
+#define LOAD_SLICE_MS 20
+
+typedef struct load_batch_s {
+	struct load_batch_s *next;
+	editor_block_t *block;
+	char **s;
+	int *len;
+	int num;
+	int cap;
+	int pos;				/* сколько строк пачки уже добавлено в буфер */
+	off_t src_end;			/* позиция в файле после этой пачки */
+	const uint32_t *flags;	/* признаки строк пачки из индекса кэша или NULL */
+} load_batch_t;
+
+struct editor_loader_s {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	editor_reader_t reader;
+	load_batch_t *head, *tail;		/* под lock */
+	int done;						/* под lock */
+	int cancel;						/* под lock */
+	off_t added;					/* позиция в файле, до которой строки добавлены в буфер */
+	off_t total;
+	const uint64_t *starts;			/* смещения строк из индекса или NULL, если его нет */
+	const uint32_t *flags;
+	int index_rows;
+	int index_pos;					/* первая строка индекса, ещё не прочитанная потоком */
+	void *index_map;				/* отображение файла индекса, живёт вместе с загрузкой */
+	size_t index_map_size;
+	cache_job_t *index_job;			/* новый индекс, собираемый по мере добавления строк */
+};
+
+int editorCacheChunk(editor_loader_t *l, load_batch_t *batch, size_t limit, int *eof);
+
+void editorLoaderLine(void *ctx, char *s, int len, editor_block_t *block)
+{
+	load_batch_t *batch = ctx;
+	(void) block;
+
+	if (batch->num == batch->cap) {
+		batch->cap = batch->cap ? batch->cap * 2 : 4096;
+		batch->s = realloc(batch->s, sizeof(char *) * batch->cap);
+		batch->len = realloc(batch->len, sizeof(int) * batch->cap);
+	}
+	batch->s[batch->num] = s;
+	batch->len[batch->num] = len;
+	batch->num++;
+}
+
+/*
+ * @brief		Читает следующую пачку строк: по индексу, пока он сходится с файлом,
+ *				иначе обычным разбором
+ */
+void editorLoaderChunk(editor_loader_t *l, load_batch_t *batch, size_t limit, int *eof)
+{
+	if (l->starts && editorCacheChunk(l, batch, limit, eof) == 0) return;
+
+	batch->block = editorReaderChunk(&l->reader, editorLoaderLine, batch, eof);
+	batch->src_end = editorReaderSourcePos(&l->reader);
+}
+
+void *editorLoaderThread(void *arg)
+{
+	editor_loader_t *l = arg;
+	int eof = 0;
+
+	while (!eof) {
+		pthread_mutex_lock(&l->lock);
+		int cancel = l->cancel;
+		pthread_mutex_unlock(&l->lock);
+		if (cancel) break;
+
+		load_batch_t *batch = calloc(1, sizeof(load_batch_t));
+		editorLoaderChunk(l, batch, EDITOR_BLOCK_SIZE, &eof);
+
+		pthread_mutex_lock(&l->lock);
+		if (l->tail) l->tail->next = batch;
+		else l->head = batch;
+		l->tail = batch;
+		pthread_mutex_unlock(&l->lock);
+	}
+
+	pthread_mutex_lock(&l->lock);
+	l->done = 1;
+	pthread_mutex_unlock(&l->lock);
+	return NULL;
+}
+
+void editorLoadBatchFree(load_batch_t *batch)
+{
+	editorBlockRelease(batch->block);
+	free(batch->s);
+	free(batch->len);
+	free(batch);
+}
+
+/*
+ * @brief		Добавляет строки пачки в текущий буфер до строки stop
+ */
+void editorLoadBatchAppend(load_batch_t *batch, int stop)
+{
+	for (; batch->pos < stop; batch->pos++)
+		editorAppendRowIndexed(batch->s[batch->pos], batch->len[batch->pos], batch->block,
+								batch->flags ? &batch->flags[batch->pos] : NULL);
+}
+
+/*
+ * @param r		Читатель файла; его состояние переходит загрузке
+ */
+editor_loader_t *editorLoaderNew(editor_buffer_t *b, editor_reader_t *r)
+{
+	editor_loader_t *l = calloc(1, sizeof(editor_loader_t));
+	l->reader = *r;
+	l->total = b->disk_size;
+	l->added = editorReaderSourcePos(r);
+	pthread_mutex_init(&l->lock, NULL);
+	return l;
+}
+
+void editorLoaderFree(editor_loader_t *l)
+{
+	editorReaderClose(&l->reader);
+	pthread_mutex_destroy(&l->lock);
+	if (l->index_map) munmap(l->index_map, l->index_map_size);
+	editorCacheJobFree(l->index_job);
+	free(l);
+}
+
+/*
+ * @brief		Передаёт дочитывание файла фоновому потоку
+ */
+void editorLoaderRun(editor_buffer_t *b, editor_loader_t *l)
+{
+	if (pthread_create(&l->thread, NULL, editorLoaderThread, l) != 0) {
+		/* без потока файл дочитывается сразу */
+		int eof = 0;
+		editor_buffer_t *saved = E.buf;
+		E.buf = b;
+		b->undo_suspend++;
+		while (!eof) {
+			load_batch_t *batch = calloc(1, sizeof(load_batch_t));
+			editorLoaderChunk(l, batch, EDITOR_BLOCK_SIZE, &eof);
+			editorLoadBatchAppend(batch, batch->num);
+			editorLoadBatchFree(batch);
+		}
+		b->undo_suspend--;
+		E.buf = saved;
+		editorLoaderFree(l);
+		return;
+	}
+	b->loader = l;
+}
+
+/*
+ * @brief		Передаёт дочитывание файла фоновому потоку
+ * @param r		Читатель после первого куска; его состояние переходит потоку
+ */
+void editorLoaderStart(editor_buffer_t *b, editor_reader_t *r)
+{
+	editorLoaderRun(b, editorLoaderNew(b, r));
+}
+
+void editorLoaderFinish(editor_buffer_t *b)
+{
+	editor_loader_t *l = b->loader;
+
+	pthread_join(l->thread, NULL);
+	while (l->head) {
+		load_batch_t *next = l->head->next;
+		editorLoadBatchFree(l->head);
+		l->head = next;
+	}
+	editorLoaderFree(l);
+	b->loader = NULL;
+}
+
+/*
+ * @brief		Останавливает загрузку, например при закрытии буфера
+ */
+void editorLoaderStop(editor_buffer_t *b)
+{
+	if (b->loader == NULL) return;
+
+	pthread_mutex_lock(&b->loader->lock);
+	b->loader->cancel = 1;
+	pthread_mutex_unlock(&b->loader->lock);
+	editorLoaderFinish(b);
+}
+
+int editorLoading()
+{
+	for (int j = 0; j < E.num_buffers; j++) {
+		if (E.buffers[j]->loader) return 1;
+	}
+	return 0;
+}
+
+/*
+ * @brief		Ставит курсор на отложенную строку goto_row, если она уже загружена
+ *				или загрузка закончилась
+ */
+void editorLoadGoTo(editor_buffer_t *b)
+{
+	if (b->goto_row < 0 || (b->loader && b->goto_row >= b->num_rows)) return;
+
+	editor_buffer_t *saved = E.buf;
+	E.buf = b;
+	editorCursorToRow(b->goto_row);
+	b->cx = b->goto_col;
+	editorClampCursor();
+	b->row_offset = b->num_rows;
+	b->wrap_offset = INT_MAX;
+	b->goto_row = -1;
+	E.buf = saved;
+}
+
+/*
+ * @brief		Добавляет в буферы строки, прочитанные фоновыми потоками
+ * @return		1, если что-то было добавлено
+ */
+int editorLoadPoll()
+{
+	long long start = editorNowMs();
+	int progress = 0;
+	int redraw = 0;
+
+	for (int j = 0; j < E.num_buffers; j++) {
+		editor_buffer_t *b = E.buffers[j];
+		editor_loader_t *l = b->loader;
+		if (l == NULL) continue;
+
+		pthread_mutex_lock(&l->lock);
+		load_batch_t *batch = l->head;
+		pthread_mutex_unlock(&l->lock);
+
+		editor_buffer_t *saved = E.buf;
+		int dirty = b->dirty;
+		E.buf = b;
+		b->undo_suspend++;
+
+		while (batch && editorNowMs() - start < LOAD_SLICE_MS) {
+			int stop = batch->pos + 4096;
+			if (stop > batch->num) stop = batch->num;
+			editorLoadBatchAppend(batch, stop);
+			progress = 1;
+			if (b == saved) redraw = 1;
+
+			if (batch->pos < batch->num) continue;
+
+			l->added = batch->src_end;
+			load_batch_t *done = batch;
+			pthread_mutex_lock(&l->lock);
+			l->head = batch->next;
+			if (l->head == NULL) l->tail = NULL;
+			batch = l->head;
+			pthread_mutex_unlock(&l->lock);
+
+			editorLoadBatchFree(done);
+		}
+
+		b->undo_suspend--;
+		b->dirty = dirty;
+		E.buf = saved;
+
+		/* файл, собираемый по индексу, с ним совпадает, новый индекс нужен, только если он разошёлся */
+		if (l->starts == NULL && l->reader.compression == COMPRESS_NONE && editorCacheWanted(b))
+			editorCacheCollect(b, &l->index_job);
+
+		pthread_mutex_lock(&l->lock);
+		int finished = l->done && l->head == NULL;
+		pthread_mutex_unlock(&l->lock);
+
+		if (finished) {
+			cache_job_t *job = l->index_job;
+			l->index_job = NULL;
+			editorLoaderFinish(b);
+			if (job) editorCacheWrite(b, job);
+			editorSetStatusMessage("%.30s: %d lines loaded", b->file_name, b->num_rows);
+			redraw = 1;
+		}
+		editorLoadGoTo(b);
+	}
+
+	if (redraw) editorScheduleRedraw();
+	return progress;
+}
+
+/*
+ * @brief		Доля загруженного файла в процентах или -1, если файл загружен
+ */
+int editorLoadPercent(editor_buffer_t *b)
+{
+	editor_loader_t *l = b->loader;
+	if (l == NULL) return -1;
+	if (l->total <= 0 || l->added >= l->total) return 99;
+
+	return (int) ((double) l->added * 100 / l->total);
+}
+
+/*
+ * @brief		Проверяет, можно ли менять текущий буфер
+ */
+int editorCheckWritable()
+{
+	if (E.buf->loader) {
+		editorSetStatusMessage("Buffer is still loading (%d%%), read-only", editorLoadPercent(E.buf));
+		return 0;
+	}
+	if (E.buf->follow) {
+		editorSetStatusMessage("Buffer is in follow mode, read-only (^U to stop)");
+		return 0;
+	}
+	if (E.buf->hex) {
+		editorSetStatusMessage("Hex view is read-only (^Y to leave)");
+		return 0;
+	}
+	if (E.buf->grep) {
+		editorSetStatusMessage("Search results are read-only (Enter opens a match)");
+		return 0;
+	}
+	return 1;
+}
+
+/* *** Diff *** */
+
+/*
+ * Сравнение двух последовательностей строк, заданных 64-битными хешами.
+ * Алгоритм Майерса O(ND) в варианте с линейной памятью: ищется "средняя
+ * змея" одновременно с начала и с конца, задача делится на две половины.
+ * Если расстояние превышает DIFF_MAX_COST, остаток считается одной заменой.
+ */
+
+#define DIFF_MAX_COST 4096
+
+typedef struct diff_s {
+	const uint64_t *a, *b;
+	int *v1, *v2;
+	diff_hunk_t *hunks;
+	int num_hunks;
+	int cap;
+} diff_t;
+
+uint64_t editorHashBytes(const char *s, int len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (int j = 0; j < len; j++) {
+		h ^= (unsigned char) s[j];
+		h *= 0x100000001b3ULL;
+	}
+	return h ^ (uint64_t) len;
+}
+
+void diffAddHunk(diff_t *d, int a_start, int a_len, int b_start, int b_len)
+{
+	if (d->num_hunks) {
+		diff_hunk_t *last = &d->hunks[d->num_hunks - 1];
+		if (last->a_start + last->a_len == a_start && last->b_start + last->b_len == b_start) {
+			last->a_len += a_len;
+			last->b_len += b_len;
+			return;
+		}
+	}
+
+	if (d->num_hunks == d->cap) {
+		d->cap = d->cap ? d->cap * 2 : 16;
+		d->hunks = realloc(d->hunks, sizeof(diff_hunk_t) * d->cap);
+	}
+	diff_hunk_t *h = &d->hunks[d->num_hunks++];
+	h->a_start = a_start;
+	h->a_len = a_len;
+	h->b_start = b_start;
+	h->b_len = b_len;
+}
+
+/*
+ * @brief		Ищет точку разбиения (x, y) на оптимальном пути редактирования
+ * @return		1, если точка найдена в пределах DIFF_MAX_COST
+ */
+int diffBisect(diff_t *d, int a0, int n, int b0, int m, int *split_x, int *split_y)
+{
+	const uint64_t *a = d->a + a0;
+	const uint64_t *b = d->b + b0;
+	int max_d = (n + m + 1) / 2;
+	if (max_d > DIFF_MAX_COST) max_d = DIFF_MAX_COST;
+
+	int v_offset = max_d + 1;
+	int v_length = 2 * max_d + 3;
+	int *v1 = d->v1;
+	int *v2 = d->v2;
+	for (int i = 0; i < v_length; i++) v1[i] = v2[i] = -1;
+	v1[v_offset + 1] = 0;
+	v2[v_offset + 1] = 0;
+
+	int delta = n - m;
+	int front = (delta % 2 != 0);
+	int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+
+	for (int dd = 0; dd < max_d; dd++) {
+		for (int k1 = -dd + k1start; k1 <= dd - k1end; k1 += 2) {
+			int k1_offset = v_offset + k1;
+			int x1;
+			if (k1 == -dd || (k1 != dd && v1[k1_offset - 1] < v1[k1_offset + 1]))
+				x1 = v1[k1_offset + 1];
+			else
+				x1 = v1[k1_offset - 1] + 1;
+			int y1 = x1 - k1;
+			while (x1 < n && y1 < m && a[x1] == b[y1]) {
+				x1++;
+				y1++;
+			}
+			v1[k1_offset] = x1;
+			if (x1 > n) {
+				k1end += 2;
+			} else if (y1 > m) {
+				k1start += 2;
+			} else if (front) {
+				int k2_offset = v_offset + delta - k1;
+				if (k2_offset >= 0 && k2_offset < v_length && v2[k2_offset] != -1) {
+					if (x1 >= n - v2[k2_offset]) {
+						*split_x = x1;
+						*split_y = y1;
+						return 1;
+					}
+				}
+			}
+		}
+
+		for (int k2 = -dd + k2start; k2 <= dd - k2end; k2 += 2) {
+			int k2_offset = v_offset + k2;
+			int x2;
+			if (k2 == -dd || (k2 != dd && v2[k2_offset - 1] < v2[k2_offset + 1]))
+				x2 = v2[k2_offset + 1];
+			else
+				x2 = v2[k2_offset - 1] + 1;
+			int y2 = x2 - k2;
+			while (x2 < n && y2 < m && a[n - x2 - 1] == b[m - y2 - 1]) {
+				x2++;
+				y2++;
+			}
+			v2[k2_offset] = x2;
+			if (x2 > n) {
+				k2end += 2;
+			} else if (y2 > m) {
+				k2start += 2;
+			} else if (!front) {
+				int k1_offset = v_offset + delta - k2;
+				if (k1_offset >= 0 && k1_offset < v_length && v1[k1_offset] != -1) {
+					int x1 = v1[k1_offset];
+					int y1 = v_offset + x1 - k1_offset;
+					if (x1 >= n - x2) {
+						*split_x = x1;
+						*split_y = y1;
+						return 1;
+					}
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+void diffRecurse(diff_t *d, int a0, int a1, int b0, int b1)
+{
+	while (a0 < a1 && b0 < b1 && d->a[a0] == d->b[b0]) {
+		a0++;
+		b0++;
+	}
+	while (a0 < a1 && b0 < b1 && d->a[a1 - 1] == d->b[b1 - 1]) {
+		a1--;
+		b1--;
+	}
+
+	if (a0 == a1 || b0 == b1) {
+		if (a0 < a1 || b0 < b1) diffAddHunk(d, a0, a1 - a0, b0, b1 - b0);
+		return;
+	}
+
+	int x, y;
+	if (!diffBisect(d, a0, a1 - a0, b0, b1 - b0, &x, &y)) {
+		diffAddHunk(d, a0, a1 - a0, b0, b1 - b0);
+		return;
+	}
+
+	diffRecurse(d, a0, a0 + x, b0, b0 + y);
+	diffRecurse(d, a0 + x, a1, b0 + y, b1);
+}
+
+/*
+ * @brief		Вычисляет список отличий между последовательностями a и b
+ * @param hunks	Массив отличий по возрастанию позиций (освобождает вызывающий)
+ * @return		Количество отличий
+ */
+int diffCompute(const uint64_t *a, int n, const uint64_t *b, int m, diff_hunk_t **hunks)
+{
+	diff_t d;
+	int v_size = 2 * DIFF_MAX_COST + 3;
+	int need = (n + m + 1) / 2 * 2 + 3;
+	if (need < v_size) v_size = need;
+
+	d.a = a;
+	d.b = b;
+	d.v1 = malloc(sizeof(int) * v_size);
+	d.v2 = malloc(sizeof(int) * v_size);
+	d.hunks = NULL;
+	d.num_hunks = 0;
+	d.cap = 0;
+
+	diffRecurse(&d, 0, n, 0, m);
+
+	free(d.v1);
+	free(d.v2);
+	*hunks = d.hunks;
+	return d.num_hunks;
+}
+
+/* *** Index cache *** */
+
+/*
+ * Для больших файлов после загрузки и после сохранения на диск фоновым
+ * потоком пишется индекс строк: смещения начал строк и на каждую строку слово с шириной
+ * на экране, признаками ASCII и табуляций и состоянием многострочного
+ * комментария на конце. Индекс лежит в $XDG_CACHE_HOME/editor (или
+ * ~/.cache/editor) под хешем пути и привязан к inode, размеру и mtime файла.
+ * При повторном открытии неизменённого файла он отображается в память, и
+ * фоновая загрузка собирает строки по смещениям из него без поиска '\n':
+ * первый экран читается сразу, остальное -- блоками в потоке загрузки.
+ * render и подсветка строятся только для строк, которые попадают на экран.
+ *
+ * Файлы с переводами строк "\r\n" и сжатые файлы не кэшируются: смещения
+ * в них не восстанавливаются по длинам строк в памяти.
+ */
+
+#define CACHE_MAGIC "EDC1"
+#define CACHE_MIN_FILE_SIZE (1 << 20)
+
+#define CACHE_ROW_COMMENT	(1u << 0)
+#define CACHE_ROW_ASCII		(1u << 1)
+#define CACHE_ROW_TABS		(1u << 2)
+#define CACHE_ROW_COLS_SHIFT 3
+
+typedef struct cache_header_s {
+	char magic[4];
+	int32_t syntax;			/* индекс в HLDB + 1, 0 -- без подсветки */
+	int64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t num_rows;
+	int64_t path_len;		/* путь хранится после заголовка, выровненный до 8 байт */
+} cache_header_t;
+
+/*
+ * @brief		Строит имя файла индекса для файла буфера
+ * @return		Путь (освобождает вызывающий) или NULL
+ */
+char *editorCachePath(editor_buffer_t *b, char **real_path, int create)
+{
+	char *real = realpath(b->file_name, NULL);
+	if (real == NULL) return NULL;
+
+	char base[PATH_MAX - 16], dir[PATH_MAX];
+	char *xdg = getenv("XDG_CACHE_HOME");
+	char *home = getenv("HOME");
+	if (xdg && *xdg) {
+		snprintf(base, sizeof(base), "%s", xdg);
+	} else if (home && *home) {
+		snprintf(base, sizeof(base), "%s/.cache", home);
+	} else {
+		free(real);
+		return NULL;
+	}
+	snprintf(dir, sizeof(dir), "%s/editor", base);
+	if (create) {
+		mkdir(base, 0700);
+		mkdir(dir, 0700);
+	}
+
+	size_t size = strlen(dir) + 32;
+	char *path = malloc(size);
+	snprintf(path, size, "%s/%016llx.idx", dir,
+				(unsigned long long) editorHashBytes(real, strlen(real)));
+
+	*real_path = real;
+	return path;
+}
+
+void editorCacheHeader(editor_buffer_t *b, cache_header_t *h, const char *real, int64_t num_rows)
+{
+	memset(h, 0, sizeof(*h));
+	memcpy(h->magic, CACHE_MAGIC, 4);
+	h->syntax = b->syntax ? (int32_t) (b->syntax - HLDB) + 1 : 0;
+	h->ino = b->disk_ino;
+	h->size = b->disk_size;
+	h->mtime_sec = b->disk_mtime.tv_sec;
+	h->mtime_nsec = b->disk_mtime.tv_nsec;
+	h->num_rows = num_rows;
+	h->path_len = strlen(real);
+}
+
+struct cache_job_s {
+	cache_header_t h;
+	char *real;
+	char *path;
+	uint64_t *starts;		/* num + 1 смещений */
+	uint32_t *flags;
+	int num;
+	int cap;
+};
+
+int editorCacheWanted(editor_buffer_t *b)
+{
+	return b->file_name != NULL && b->disk_size >= CACHE_MIN_FILE_SIZE;
+}
+
+void editorCacheJobFree(cache_job_t *job)
+{
+	if (job == NULL) return;
+	free(job->real);
+	free(job->path);
+	free(job->starts);
+	free(job->flags);
+	free(job);
+}
+
+/*
+ * @brief		Дописывает в индекс строки буфера, добавленные после прошлого вызова.
+ *				Загрузка вызывает его после каждой порции строк, так что к её концу
+ *				индекс уже собран и главному потоку остаётся только отдать его на запись.
+ */
+void editorCacheCollect(editor_buffer_t *b, cache_job_t **job)
+{
+	if (*job == NULL) *job = calloc(1, sizeof(cache_job_t));
+	cache_job_t *c = *job;
+
+	if (c->cap < b->num_rows + 1) {
+		c->cap = (c->cap * 2 > b->num_rows + 1) ? c->cap * 2 : b->num_rows + 1;
+		c->starts = realloc(c->starts, sizeof(uint64_t) * c->cap);
+		c->flags = realloc(c->flags, sizeof(uint32_t) * c->cap);
+	}
+	if (c->num == 0) c->starts[0] = 0;
+
+	for (; c->num < b->num_rows; c->num++) {
+		editor_row_t *row = &b->row[c->num];
+		c->starts[c->num + 1] = c->starts[c->num] + row->size + 1;
+		c->flags[c->num] = ((uint32_t) row->render_cols << CACHE_ROW_COLS_SHIFT) |
+							(row->hl_open_comment ? CACHE_ROW_COMMENT : 0) |
+							(row->ascii ? CACHE_ROW_ASCII : 0) |
+							(row->tabs ? CACHE_ROW_TABS : 0);
+	}
+}
+
+void *editorCacheWriteThread(void *arg)
+{
+	cache_job_t *job = arg;
+	size_t path_pad = (job->h.path_len + 7) & ~(size_t) 7;
+	char *pad = calloc(1, path_pad);
+	memcpy(pad, job->real, job->h.path_len);
+
+	/* индекс подменяется целиком, читатель не увидит половину записи */
+	size_t tmp_size = strlen(job->path) + 8;
+	char *tmp = malloc(tmp_size);
+	snprintf(tmp, tmp_size, "%s.XXXXXX", job->path);
+	int fd = mkostemp(tmp, O_CLOEXEC);
+	if (fd != -1) {
+		int ok = editorWriteAll(fd, (const char *) &job->h, sizeof(job->h)) == 0 &&
+				 editorWriteAll(fd, pad, path_pad) == 0 &&
+				 editorWriteAll(fd, (const char *) job->starts, sizeof(uint64_t) * (job->num + 1)) == 0 &&
+				 editorWriteAll(fd, (const char *) job->flags, sizeof(uint32_t) * job->num) == 0;
+		close(fd);
+		if (ok) rename(tmp, job->path);
+		else unlink(tmp);
+	}
+
+	free(tmp);
+	free(pad);
+	editorCacheJobFree(job);
+	return NULL;
+}
+
+/*
+ * @brief		Отдаёт собранный индекс на запись фоновому потоку, если буфер
+ *				совпадает с файлом на диске. Задание переходит функции.
+ */
+void editorCacheWrite(editor_buffer_t *b, cache_job_t *job)
+{
+	/* смещения восстанавливаются по длинам строк, лишние '\r' их сбили бы */
+	int64_t total = job->starts[job->num];
+	if (!editorCacheWanted(b) || b->dirty || b->hl_stale >= 0 || job->num != b->num_rows ||
+			(total != b->disk_size && total != b->disk_size + 1) ||
+			(job->path = editorCachePath(b, &job->real, 1)) == NULL) {
+		editorCacheJobFree(job);
+		return;
+	}
+	editorCacheHeader(b, &job->h, job->real, b->num_rows);
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, editorCacheWriteThread, job) == 0)
+		pthread_detach(thread);
+	else
+		editorCacheWriteThread(job);
+}
+
+/*
+ * @brief		Записывает индекс строк буфера, если буфер совпадает с файлом на диске
+ */
+void editorCacheStore(editor_buffer_t *b)
+{
+	if (!editorCacheWanted(b) || b->dirty) return;
+
+	cache_job_t *job = NULL;
+	editorCacheCollect(b, &job);
+	editorCacheWrite(b, job);
+}
+
+void editorCacheApplyRow(editor_row_t *row, uint32_t flags)
+{
+	row->hl_open_comment = (flags & CACHE_ROW_COMMENT) != 0;
+	row->ascii = (flags & CACHE_ROW_ASCII) != 0;
+	row->tabs = (flags & CACHE_ROW_TABS) != 0;
+	row->render_cols = flags >> CACHE_ROW_COLS_SHIFT;
+}
+
+/*
+ * @brief		Читает по индексу строки, занимающие в файле не больше limit байт
+ *				(но хотя бы одну), одним блоком в пачку
+ * @return		-1, если индекс разошёлся с файлом на первой же строке. Индекс
+ *				при расхождении отбрасывается, и файл дальше разбирается обычным
+ *				чтением с той строки, на которой он разошёлся.
+ */
+int editorCacheChunk(editor_loader_t *l, load_batch_t *batch, size_t limit, int *eof)
+{
+	const uint64_t *starts = l->starts;
+	int first = l->index_pos, last = first + 1;
+	while (last < l->index_rows && starts[last + 1] - starts[first] <= limit) last++;
+
+	/* у последней строки файла может не быть '\n' */
+	uint64_t from = starts[first];
+	uint64_t to = (starts[last] < (uint64_t) l->total) ? starts[last] : (uint64_t) l->total;
+	int j = first;
+	if (from <= to) {
+		size_t size = to - from;
+		editor_block_t *blk = editorBlockNew(size + 1);
+		batch->block = blk;
+
+		/* индекс проверяется там, где его всё равно надо читать: на концах строк */
+		if (editorReadAll(l->reader.fd, blk->data, size) == 0) {
+			blk->data[size] = '\0';
+			for (; j < last; j++) {
+				if (starts[j + 1] <= starts[j]) break;
+				uint64_t start = starts[j] - from, end = starts[j + 1] - 1 - from;
+				if (end > size || (end < size && blk->data[end] != '\n')) break;
+				blk->data[end] = '\0';
+				editorLoaderLine(batch, blk->data + start, end - start, blk);
+			}
+		}
+	}
+
+	batch->flags = l->flags + first;
+	l->index_pos = j;
+	*eof = (j == l->index_rows);
+	if (*eof) {
+		batch->src_end = l->total;
+		return 0;
+	}
+	batch->src_end = starts[j];
+
+	if (j < last) {
+		l->starts = NULL;
+		lseek(l->reader.fd, starts[j], SEEK_SET);
+		l->reader.offset = starts[j];
+		if (j == first) {
+			editorBlockRelease(batch->block);
+			batch->block = NULL;
+			batch->flags = NULL;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * @brief		Начинает загрузку текущего буфера по индексу из кэша: первый экран
+ *				собирается сразу, остальное дочитывает фоновый поток
+ * @return		0, если загрузка начата (fd переходит ей), -1 если индекса нет
+ *				или он устарел
+ */
+int editorCacheLoad(int fd)
+{
+	editor_buffer_t *b = E.buf;
+	if (b->disk_size < CACHE_MIN_FILE_SIZE || b->num_rows) return -1;
+	if (editorDetectCompression(fd) != COMPRESS_NONE) return -1;
+
+	char *real;
+	char *path = editorCachePath(b, &real, 0);
+	if (path == NULL) return -1;
+
+	int cfd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	struct stat st;
+	if (cfd == -1 || fstat(cfd, &st) == -1 || (size_t) st.st_size < sizeof(cache_header_t)) {
+		if (cfd != -1) close(cfd);
+		free(real);
+		return -1;
+	}
+
+	/* индекс подменяется переименованием, а не переписывается, так что отображение не укоротится */
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, cfd, 0);
+	close(cfd);
+	if (map == MAP_FAILED) {
+		free(real);
+		return -1;
+	}
+
+	cache_header_t h, want;
+	memcpy(&h, map, sizeof(h));
+	editorCacheHeader(b, &want, real, h.num_rows);
+
+	size_t path_pad = (h.path_len + 7) & ~(size_t) 7;
+	int valid = !memcmp(&h, &want, sizeof(h)) && h.num_rows > 0 && h.num_rows < INT_MAX &&
+				(size_t) st.st_size == sizeof(h) + path_pad + sizeof(uint64_t) * (h.num_rows + 1)
+											+ sizeof(uint32_t) * h.num_rows &&
+				!memcmp(map + sizeof(h), real, h.path_len);
+	free(real);
+
+	editor_reader_t r;
+	if (!valid || lseek(fd, 0, SEEK_SET) == -1 ||
+			editorReaderInit(&r, fd, EDITOR_FIRST_BLOCK_SIZE) == -1) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	editor_loader_t *l = editorLoaderNew(b, &r);
+	l->index_map = map;
+	l->index_map_size = st.st_size;
+	l->starts = (const uint64_t *) (map + sizeof(h) + path_pad);
+	l->flags = (const uint32_t *) (l->starts + h.num_rows + 1);
+	l->index_rows = h.num_rows;
+
+	int eof;
+	load_batch_t *batch = calloc(1, sizeof(load_batch_t));
+	editorLoaderChunk(l, batch, EDITOR_FIRST_BLOCK_SIZE, &eof);
+	b->undo_suspend++;
+	editorLoadBatchAppend(batch, batch->num);
+	b->undo_suspend--;
+	l->added = batch->src_end;
+	editorLoadBatchFree(batch);
+
+	if (eof) editorLoaderFree(l);
+	else editorLoaderRun(b, l);
+	return 0;
+}
+
+/* *** File watching *** */
+
+/*
+ * За каждым открытым файлом следит inotify на его каталоге: так замечаются
+ * и запись на месте, и подмена файла переименованием (деплой, ротация логов).
+ * Когда запись затихает, чистый буфер перечитывается: новое содержимое
+ * сравнивается со строками буфера, заменяются только изменившиеся диапазоны,
+ * остальные строки сохраняют render и подсветку.
+ */
+
+#define WATCH_SETTLE_MS 100
+
+long long editorNowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void editorDiskStamp(editor_buffer_t *b, int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) == -1) return;
+	b->disk_ino = st.st_ino;
+	b->disk_size = st.st_size;
+	b->disk_mtime = st.st_mtim;
+}
+
+void editorUnwatchBuffer(editor_buffer_t *b)
+{
+	if (b->watch == -1) return;
+
+	int shared = 0;
+	for (int j = 0; j < E.num_buffers; j++) {
+		if (E.buffers[j] != b && E.buffers[j]->watch == b->watch) shared = 1;
+	}
+	if (!shared) inotify_rm_watch(E.inotify_fd, b->watch);
+	b->watch = -1;
+}
+
+void editorWatchBuffer(editor_buffer_t *b)
+{
+	if (E.inotify_fd == -1 || b->file_name == NULL || b->watch != -1) return;
+
+	char *path = strdup(b->file_name);
+	b->watch = inotify_add_watch(E.inotify_fd, dirname(path),
+									IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+	free(path);
+}
+
+struct reload_lines_s {
+	char **s;
+	int *len;
+	editor_block_t **block;
+	int num;
+	int cap;
+};
+
+void editorReloadLine(void *ctx, char *s, int len, editor_block_t *block)
+{
+	struct reload_lines_s *lines = ctx;
+
+	if (lines->num == lines->cap) {
+		lines->cap = lines->cap ? lines->cap * 2 : 1024;
+		lines->s = realloc(lines->s, sizeof(char *) * lines->cap);
+		lines->len = realloc(lines->len, sizeof(int) * lines->cap);
+		lines->block = realloc(lines->block, sizeof(editor_block_t *) * lines->cap);
+	}
+	block->refs++;
+	lines->s[lines->num] = s;
+	lines->len[lines->num] = len;
+	lines->block[lines->num] = block;
+	lines->num++;
+}
+
+/*
+ * @brief		Перечитывает файл текущего буфера, заменяя только изменившиеся строки
+ * @return		Количество изменённых диапазонов строк или -1 при ошибке
+ */
+int editorReloadBuffer()
+{
+	int fd = open(E.buf->file_name, O_RDONLY);
+	if (fd == -1) return -1;
+
+	struct reload_lines_s lines = { NULL, NULL, NULL, 0, 0 };
+	editorDiskStamp(E.buf, fd);
+	if (editorReadLines(fd, editorReloadLine, &lines) == -1) {
+		for (int j = 0; j < lines.num; j++)
+			editorBlockRelease(lines.block[j]);
+		free(lines.s);
+		free(lines.len);
+		free(lines.block);
+		return -1;
+	}
+
+	int n = E.buf->num_rows;
+	int m = lines.num;
+	editor_row_t *rows = E.buf->row;
+
+	/* общие начало и конец сравниваются напрямую, хешируется только середина */
+	int pre = 0;
+	while (pre < n && pre < m && rows[pre].size == lines.len[pre] &&
+			!memcmp(rows[pre].chars, lines.s[pre], lines.len[pre]))
+		pre++;
+	int suf = 0;
+	while (suf < n - pre && suf < m - pre && rows[n - suf - 1].size == lines.len[m - suf - 1] &&
+			!memcmp(rows[n - suf - 1].chars, lines.s[m - suf - 1], lines.len[m - suf - 1]))
+		suf++;
+
+	int mid_a = n - pre - suf;
+	int mid_b = m - pre - suf;
+	uint64_t *ha = malloc(sizeof(uint64_t) * (mid_a + 1));
+	uint64_t *hb = malloc(sizeof(uint64_t) * (mid_b + 1));
+	for (int j = 0; j < mid_a; j++)
+		ha[j] = editorHashBytes(rows[pre + j].chars, rows[pre + j].size);
+	for (int j = 0; j < mid_b; j++)
+		hb[j] = editorHashBytes(lines.s[pre + j], lines.len[pre + j]);
+
+	diff_hunk_t *hunks = NULL;
+	int num_hunks = diffCompute(ha, mid_a, hb, mid_b, &hunks);
+	free(ha);
+	free(hb);
+
+	/* новый массив строк собирается за один проход: неизменные строки переносятся как есть */
+	editor_row_t *new_rows = malloc(sizeof(editor_row_t) * (m ? m : 1));
+	unsigned char *touched = calloc(m ? m : 1, 1);
+	int ai = 0, bi = 0;
+
+	for (int h = 0; h <= num_hunks; h++) {
+		int a_start = (h < num_hunks) ? pre + hunks[h].a_start : n;
+		int b_start = (h < num_hunks) ? pre + hunks[h].b_start : m;
+
+		memcpy(&new_rows[bi], &rows[ai], sizeof(editor_row_t) * (a_start - ai));
+		ai = a_start;
+		bi = b_start;
+		if (h == num_hunks) break;
+
+		for (int j = 0; j < hunks[h].a_len; j++)
+			editorFreeRow(&rows[ai + j]);
+		for (int j = 0; j < hunks[h].b_len; j++) {
+			editor_row_t *row = &new_rows[bi + j];
+			lines.block[bi + j]->refs++;
+			editorInitRow(row, bi + j, lines.s[bi + j], lines.len[bi + j], lines.block[bi + j]);
+			touched[bi + j] = 1;
+		}
+		ai += hunks[h].a_len;
+		bi += hunks[h].b_len;
+		/* следующая строка могла зависеть от удалённого многострочного комментария */
+		if (bi < m && !touched[bi]) touched[bi] = 2;
+	}
+
+	free(E.buf->row);
+	E.buf->row = new_rows;
+	E.buf->num_rows = m;
+	E.buf->row_cap = m ? m : 1;
+	E.buf->wrap_valid = 0;
+	E.buf->offset_valid = 0;
+	E.buf->bracket_valid = 0;
+	editorOffsetReset();
+	editorRenderLogRebuild();
+	/* номера строк сдвинулись, недосчитанное проверяется с начала */
+	if (E.buf->hl_stale > 0) E.buf->hl_stale = 0;
+
+	int first = -1, last = -1;
+	for (int j = 0; j < m; j++) {
+		new_rows[j].idx = j;
+		if (touched[j]) {
+			if (touched[j] == 1) editorUpdateRender(&new_rows[j]);
+			if (first == -1) first = j;
+			last = j;
+		}
+	}
+	if (first != -1)
+		editorUpdateSyntaxRows(first, last, &touched[first]);
+
+	for (int j = 0; j < lines.num; j++)
+		editorBlockRelease(lines.block[j]);
+	free(lines.s);
+	free(lines.len);
+	free(lines.block);
+	free(touched);
+	free(hunks);
+
+	/* позиции в журналах отмены и восстановления относятся к старому содержимому */
+	editorUndoClear();
+	editorJournalDiscard(E.buf);
+	E.buf->dirty = 0;
+
+	if (E.buf->cy > E.buf->num_rows) E.buf->cy = E.buf->num_rows;
+	if (E.buf->cy < E.buf->num_rows && E.buf->cx > E.buf->row[E.buf->cy].size)
+		E.buf->cx = E.buf->row[E.buf->cy].size;
+	if (E.buf->row_offset > E.buf->num_rows) E.buf->row_offset = E.buf->num_rows;
+
+	return num_hunks;
+}
+
+/*
+ * @brief		Разбирает события inotify и перечитывает изменившиеся файлы
+ *				после того, как запись в них затихла
+ */
+void editorPollFileChanges()
+{
+	if (E.inotify_fd == -1) return;
+
+	char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	long long now = editorNowMs();
+
+	while ((len = read(E.inotify_fd, events, sizeof(events))) > 0) {
+		for (char *p = events; p < events + len; ) {
+			struct inotify_event *ev = (struct inotify_event *) p;
+			p += sizeof(struct inotify_event) + ev->len;
+			if (ev->len == 0) continue;
+
+			for (int j = 0; j < E.num_buffers; j++) {
+				editor_buffer_t *b = E.buffers[j];
+				if (b->watch != ev->wd || b->file_name == NULL) continue;
+
+				char *path = strdup(b->file_name);
+				if (!strcmp(basename(path), ev->name)) {
+					b->disk_changed = 1;
+					b->disk_event_ms = now;
+				}
+				free(path);
+			}
+		}
+	}
+
+	int redraw = 0;
+	for (int j = 0; j < E.num_buffers; j++) {
+		editor_buffer_t *b = E.buffers[j];
+		if (!b->disk_changed || b->loader || now - b->disk_event_ms < WATCH_SETTLE_MS) continue;
+		if (b->follow) {
+			b->disk_changed = 0;
+			continue;
+		}
+		b->disk_changed = 0;
+
+		struct stat st;
+		if (stat(b->file_name, &st) == -1) continue;
+		if (st.st_ino == b->disk_ino && st.st_size == b->disk_size &&
+				st.st_mtim.tv_sec == b->disk_mtime.tv_sec && st.st_mtim.tv_nsec == b->disk_mtime.tv_nsec)
+			continue;
+
+		if (b->hex) {
+			editorHexOpen(b);
+			redraw = 1;
+			if (b->hex_binary) continue;
+		}
+
+		if (b->dirty) {
+			editorSetStatusMessage("%.30s changed on disk; buffer has unsaved changes", b->file_name);
+			redraw = 1;
+			continue;
+		}
+
+		editor_buffer_t *saved = E.buf;
+		E.buf = b;
+		int changes = editorReloadBuffer();
+		if (changes >= 0) editorDiffRebase();
+		E.buf = saved;
+
+		if (changes >= 0)
+			editorSetStatusMessage("%.30s reloaded: %d changed region%s", b->file_name,
+									changes, changes == 1 ? "" : "s");
+		redraw = 1;
+	}
+
+	if (redraw) editorScheduleRedraw();
+}
+
+/* *** Follow mode *** */
+
+/*
+ * Режим слежения (tail -f): буфер только для чтения, дописанные в файл байты
+ * читаются порциями в новые блоки, и каждая полная строка добавляется в конец
+ * массива строк ссылкой на блок -- без копирования текста и сдвига массива.
+ * Подсвечиваются только новые строки. Если курсор стоял на последней строке,
+ * вид прокручивается вслед за файлом. Незавершённая последняя строка ждёт
+ * своего '\n'; если же файл без '\n' в конце был открыт целиком, его
+ * последняя строка уже в буфере, и дописанное продолжает её. При ротации
+ * (файл подменён или усечён) чтение начинается с начала нового файла.
+ */
+
+#define FOLLOW_CHUNK (4 << 20)
+#define FOLLOW_ROTATE_CHECK_MS 500
+
+void editorFollowLine(void *ctx, char *s, int len, editor_block_t *block)
+{
+	(void) ctx;
+	editorAppendRowRef(s, len, block);
+}
+
+/*
+ * @brief		Читает очередную порцию дописанных данных в буфер b
+ * @return		Количество прочитанных байт
+ */
+ssize_t editorFollowRead(editor_buffer_t *b, off_t avail)
+{
+	size_t carry = b->follow_carry_len;
+	size_t want = (avail > FOLLOW_CHUNK) ? FOLLOW_CHUNK : (size_t) avail;
+
+	editor_block_t *blk = editorBlockNew(carry + want + 1);
+	if (carry) memcpy(blk->data, b->follow_carry, carry);
+
+	ssize_t n;
+	while ((n = read(b->follow_fd, blk->data + carry, want)) == -1 && errno == EINTR);
+	if (n <= 0) {
+		editorBlockRelease(blk);
+		return 0;
+	}
+
+	size_t len = carry + n;
+
+	/* начало порции дописывается к незавершённой последней строке буфера */
+	if (b->follow_open_row) {
+		char *nl = memchr(blk->data, '\n', len);
+		size_t head = nl ? (size_t) (nl - blk->data) : len;
+		size_t skip = nl ? head + 1 : len;
+		while (nl && head > 0 && blk->data[head - 1] == '\r') head--;
+
+		editor_row_t *row = &b->row[b->num_rows - 1];
+		b->journal_suspend++;
+		editorRowAppendString(row, blk->data, head);
+		b->journal_suspend--;
+
+		if (nl == NULL) {
+			editorBlockRelease(blk);
+			return n;
+		}
+		b->follow_open_row = 0;
+		len -= skip;
+		memmove(blk->data, blk->data + skip, len);
+	}
+
+	if ((size_t) n < want) blk = realloc(blk, sizeof(editor_block_t) + len + 1);
+	blk->size = len;
+	size_t rest = editorSplitBlock(blk, len, 0, editorFollowLine, NULL);
+
+	/* хвост без '\n' копируется отдельно, чтобы не держать ради него весь блок */
+	if (rest > b->follow_carry_cap) {
+		b->follow_carry_cap = rest;
+		b->follow_carry = realloc(b->follow_carry, rest);
+	}
+	memmove(b->follow_carry, blk->data + len - rest, rest);
+	b->follow_carry_len = rest;
+
+	editorBlockRelease(blk);
+	return n;
+}
+
+/*
+ * @brief		Переоткрывает файл, если его подменили при ротации
+ */
+void editorFollowCheckRotation(editor_buffer_t *b)
+{
+	struct stat st, cur;
+	if (stat(b->file_name, &st) == -1 || fstat(b->follow_fd, &cur) == -1) return;
+
+	if (st.st_ino != cur.st_ino) {
+		int fd = open(b->file_name, O_RDONLY | O_CLOEXEC);
+		if (fd == -1) return;
+		close(b->follow_fd);
+		b->follow_fd = fd;
+		b->follow_carry_len = 0;
+		b->follow_open_row = 0;
+		editorSetStatusMessage("%.30s: file rotated, following the new one", b->file_name);
+	} else if (st.st_size < lseek(b->follow_fd, 0, SEEK_CUR)) {
+		lseek(b->follow_fd, 0, SEEK_SET);
+		b->follow_carry_len = 0;
+		b->follow_open_row = 0;
+		editorSetStatusMessage("%.30s: file truncated, following from the start", b->file_name);
+	}
+}
+
+/*
+ * @brief		Добавляет в следящие буферы дописанные строки, тратя не больше LOAD_SLICE_MS
+ * @return		1, если в файлах остались непрочитанные данные
+ */
+int editorFollowPoll()
+{
+	long long start = editorNowMs();
+	int more = 0;
+
+	for (int j = 0; j < E.num_buffers; j++) {
+		editor_buffer_t *b = E.buffers[j];
+		if (!b->follow) continue;
+
+		if (start - b->follow_check_ms >= FOLLOW_ROTATE_CHECK_MS) {
+			editorFollowCheckRotation(b);
+			b->follow_check_ms = start;
+		}
+
+		struct stat st;
+		if (fstat(b->follow_fd, &st) == -1) continue;
+		off_t pos = lseek(b->follow_fd, 0, SEEK_CUR);
+		if (st.st_size <= pos) continue;
+
+		editor_buffer_t *saved = E.buf;
+		int pinned = (b->cy >= b->num_rows - 1);
+		int dirty = b->dirty;
+		int added = b->num_rows;
+
+		E.buf = b;
+		b->undo_suspend++;
+		while (pos < st.st_size && editorNowMs() - start < LOAD_SLICE_MS) {
+			ssize_t n = editorFollowRead(b, st.st_size - pos);
+			if (n == 0) break;
+			pos += n;
+		}
+		b->undo_suspend--;
+		b->dirty = dirty;
+		E.buf = saved;
+
+		if (pos < st.st_size) more = 1;
+		b->disk_size = st.st_size;
+		b->disk_mtime = st.st_mtim;
+		b->disk_ino = st.st_ino;
+
+		added = b->num_rows - added;
+		if (added && pinned) {
+			b->cy = b->num_rows - 1;
+			b->cx = 0;
+		}
+		if (added && b == E.buf) editorScheduleRedraw();
+	}
+
+	return more;
+}
+
+int editorFollowing()
+{
+	for (int j = 0; j < E.num_buffers; j++) {
+		if (E.buffers[j]->follow) return 1;
+	}
+	return 0;
+}
+
+void editorFollowStop(editor_buffer_t *b)
+{
+	if (!b->follow) return;
+	close(b->follow_fd);
+	free(b->follow_carry);
+	b->follow_carry = NULL;
+	b->follow_carry_len = b->follow_carry_cap = 0;
+	b->follow_open_row = 0;
+	b->follow = 0;
+}
+
+/*
+ * @brief		Включает или выключает слежение за файлом текущего буфера
+ */
+void editorToggleFollow()
+{
+	editor_buffer_t *b = E.buf;
+
+	if (b->follow) {
+		/* незавершённая последняя строка становится обычной строкой буфера */
+		if (b->follow_carry_len) {
+			int dirty = b->dirty;
+			b->undo_suspend++;
+			b->journal_suspend++;
+			editorInsertRow(b->num_rows, b->follow_carry, b->follow_carry_len);
+			b->journal_suspend--;
+			b->undo_suspend--;
+			b->dirty = dirty;
+		}
+		editorFollowStop(b);
+		editorSetStatusMessage("Follow mode off");
+		return;
+	}
+
+	if (b->file_name == NULL || b->dirty || b->loader) {
+		editorSetStatusMessage("Follow mode needs a saved, fully loaded file");
+		return;
+	}
+
+	int fd = open(b->file_name, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		editorSetStatusMessage("Can't follow %s: %s", b->file_name, strerror(errno));
+		return;
+	}
+	if (editorDetectCompression(fd) != COMPRESS_NONE) {
+		close(fd);
+		editorSetStatusMessage("Follow mode is not supported for compressed files");
+		return;
+	}
+
+	/* всё, что в файле до текущего размера, уже в буфере */
+	char last = '\n';
+	if (b->disk_size > 0 && pread(fd, &last, 1, b->disk_size - 1) != 1) last = '\n';
+	lseek(fd, b->disk_size, SEEK_SET);
+	editorDiffStop(b);
+	b->follow_fd = fd;
+	b->follow = 1;
+	b->follow_open_row = (last != '\n' && b->num_rows > 0);
+	b->follow_check_ms = editorNowMs();
+	b->cy = b->num_rows ? b->num_rows - 1 : 0;
+	b->cx = 0;
+	editorSetStatusMessage("Following %.30s (read-only, ^U to stop)", b->file_name);
+}
+
+/* *** Diff view *** */
+
+/*
+ * Режим сравнения (^D): в колонке номеров строк вместо '|' показывается,
+ * чем строка отличается от файла на диске: '+' добавлена, '~' изменена,
+ * '-' перед строкой удалены строки файла. Строки файла хранятся только
+ * хешами. После правок сравнение не повторяется целиком: изменённые строки
+ * копятся диапазоном, и перед отрисовкой заново сравнивается лишь участок
+ * между ближайшими к нему совпадающими строками, остальные отличия только
+ * сдвигаются.
+ */
+
+void editorDiffHashLine(void *ctx, char *s, int len, editor_block_t *block)
+{
+	(void) block;
+	editor_buffer_t *b = ctx;
+	if (b->diff_base_len == b->diff_base_cap) {
+		b->diff_base_cap = b->diff_base_cap ? b->diff_base_cap * 2 : 1024;
+		b->diff_base = realloc(b->diff_base, sizeof(uint64_t) * b->diff_base_cap);
+	}
+	b->diff_base[b->diff_base_len++] = editorHashBytes(s, len);
+}
+
+uint64_t *editorDiffRowHashes(int from, int to)
+{
+	uint64_t *h = malloc(sizeof(uint64_t) * (to - from + 1));
+	for (int j = from; j < to; j++)
+		h[j - from] = editorHashBytes(E.buf->row[j].chars, E.buf->row[j].size);
+	return h;
+}
+
+/*
+ * @brief		Добавляет сдвинутое отличие в конец списка, сливая его с предыдущим,
+ *				если они идут вплотную
+ * @return		Новая длина списка
+ */
+int diffSpliceHunk(diff_hunk_t *out, int n, const diff_hunk_t *h, int a_shift, int b_shift)
+{
+	int a_start = h->a_start + a_shift;
+	int b_start = h->b_start + b_shift;
+
+	if (n > 0 && out[n - 1].a_start + out[n - 1].a_len == a_start &&
+			out[n - 1].b_start + out[n - 1].b_len == b_start) {
+		out[n - 1].a_len += h->a_len;
+		out[n - 1].b_len += h->b_len;
+		return n;
+	}
+	out[n].a_start = a_start;
+	out[n].a_len = h->a_len;
+	out[n].b_start = b_start;
+	out[n].b_len = h->b_len;
+	return n + 1;
+}
+
+/*
+ * @brief		Отмечает изменённые строки текущего буфера
+ * @param delta	1 -- строка at вставлена, -1 -- удалена, 0 -- изменена
+ */
+void editorDiffTouch(int at, int delta)
+{
+	editor_buffer_t *b = E.buf;
+	if (!b->diff) return;
+
+	if (b->diff_from == -1) {
+		b->diff_from = b->diff_to = at;
+		return;
+	}
+	if ((delta > 0 && b->diff_to >= at) || (delta < 0 && b->diff_to > at))
+		b->diff_to += delta;
+	if (at < b->diff_from) b->diff_from = at;
+	if (at > b->diff_to) b->diff_to = at;
+}
+
+/*
+ * @brief		Пересравнивает изменённый участок и вклеивает результат
+ *				в список отличий, сдвигая отличия после участка
+ */
+void editorDiffUpdate()
+{
+	editor_buffer_t *b = E.buf;
+	if (!b->diff || b->diff_from == -1) return;
+
+	diff_hunk_t *hunks = b->diff_hunks;
+	int num = b->diff_num_hunks;
+	int delta = b->num_rows - b->diff_rows;
+
+	int lo = b->diff_from;
+	int hi = b->diff_to + 1;
+	if (hi > b->num_rows) hi = b->num_rows;
+	if (lo > hi) lo = hi;
+	int hi_old = hi - delta;
+
+	/* диапазон не согласован с числом строк -- сравнивается весь буфер */
+	if (hi_old < lo || hi_old > b->diff_rows) {
+		lo = 0;
+		hi = b->num_rows;
+		hi_old = b->diff_rows;
+	}
+
+	/* участок расширяется до границ отличий, которые он задевает */
+	int i0 = 0;
+	while (i0 < num && hunks[i0].b_start + hunks[i0].b_len < lo) i0++;
+	if (i0 < num && hunks[i0].b_start < lo) lo = hunks[i0].b_start;
+	int i1 = i0;
+	while (i1 < num && hunks[i1].b_start < hi_old) i1++;
+	if (i1 > i0 && hunks[i1 - 1].b_start + hunks[i1 - 1].b_len > hi_old)
+		hi_old = hunks[i1 - 1].b_start + hunks[i1 - 1].b_len;
+	hi = hi_old + delta;
+
+	/* между отличиями строки совпадают, и позиция в файле отсчитывается от конца предыдущего */
+	int a_lo = lo, a_hi = hi_old;
+	if (i0 > 0) a_lo = hunks[i0 - 1].a_start + hunks[i0 - 1].a_len + lo - (hunks[i0 - 1].b_start + hunks[i0 - 1].b_len);
+	if (i1 > 0) a_hi = hunks[i1 - 1].a_start + hunks[i1 - 1].a_len + hi_old - (hunks[i1 - 1].b_start + hunks[i1 - 1].b_len);
+
+	uint64_t *rows = editorDiffRowHashes(lo, hi);
+	diff_hunk_t *seg = NULL;
+	int num_seg = diffCompute(b->diff_base + a_lo, a_hi - a_lo, rows, hi - lo, &seg);
+	free(rows);
+
+	diff_hunk_t *out = malloc(sizeof(diff_hunk_t) * (i0 + num_seg + (num - i1) + 1));
+	int num_out = i0;
+	memcpy(out, hunks, sizeof(diff_hunk_t) * i0);
+	for (int j = 0; j < num_seg; j++)
+		num_out = diffSpliceHunk(out, num_out, &seg[j], a_lo, lo);
+	for (int j = i1; j < num; j++)
+		num_out = diffSpliceHunk(out, num_out, &hunks[j], 0, delta);
+	free(seg);
+	free(hunks);
+
+	b->diff_hunks = out;
+	b->diff_num_hunks = num_out;
+	b->diff_rows = b->num_rows;
+	b->diff_from = b->diff_to = -1;
+}
+
+/*
+ * @brief		Считает содержимое буфера совпадающим с диском, например после сохранения
+ */
+void editorDiffRebase()
+{
+	editor_buffer_t *b = E.buf;
+	if (!b->diff) return;
+
+	free(b->diff_base);
+	b->diff_base = editorDiffRowHashes(0, b->num_rows);
+	b->diff_base_len = b->diff_base_cap = b->num_rows;
+	b->diff_num_hunks = 0;
+	b->diff_rows = b->num_rows;
+	b->diff_from = b->diff_to = -1;
+}
+
+void editorDiffStop(editor_buffer_t *b)
+{
+	free(b->diff_base);
+	free(b->diff_hunks);
+	b->diff_base = NULL;
+	b->diff_hunks = NULL;
+	b->diff_base_len = b->diff_base_cap = b->diff_num_hunks = 0;
+	b->diff = 0;
+}
+
+/*
+ * @brief		Возвращает метку строки для колонки номеров
+ */
+char editorDiffMarker(int at)
+{
+	diff_hunk_t *hunks = E.buf->diff_hunks;
+	int lo = 0, hi = E.buf->diff_num_hunks;
+
+	/* последнее отличие, начинающееся не позже строки */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (hunks[mid].b_start <= at) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == 0) return '|';
+
+	diff_hunk_t *h = &hunks[lo - 1];
+	if (at < h->b_start + h->b_len) return h->a_len ? '~' : '+';
+	if (h->b_len == 0 && h->b_start == at) return '-';
+	return '|';
+}
+
+void editorToggleDiff()
+{
+	editor_buffer_t *b = E.buf;
+
+	if (b->diff) {
+		editorDiffStop(b);
+		editorSetStatusMessage("Diff view off");
+		return;
+	}
+	if (b->file_name == NULL || b->loader || b->follow) {
+		editorSetStatusMessage("Diff view needs a fully loaded file that is not followed");
+		return;
+	}
+
+	int fd = open(b->file_name, O_RDONLY);
+	if (fd == -1) {
+		editorSetStatusMessage("Can't read %s: %s", b->file_name, strerror(errno));
+		return;
+	}
+	b->diff_base_len = 0;
+	if (editorReadLines(fd, editorDiffHashLine, b) == -1) {
+		editorDiffStop(b);
+		editorSetStatusMessage("Can't read %s: %s", b->file_name, strerror(errno));
+		return;
+	}
+
+	uint64_t *rows = editorDiffRowHashes(0, b->num_rows);
+	b->diff_num_hunks = diffCompute(b->diff_base, b->diff_base_len, rows, b->num_rows, &b->diff_hunks);
+	free(rows);
+	b->diff = 1;
+	b->diff_rows = b->num_rows;
+	b->diff_from = b->diff_to = -1;
+
+	editorSetStatusMessage("Diff against disk: %d changed region%s", b->diff_num_hunks,
+							b->diff_num_hunks == 1 ? "" : "s");
+}
+
+/* *** Buffers *** */
+
+/*
+ * Каждый открытый файл -- отдельный буфер со своими строками, курсором
+ * и журналом отмены; E.buf указывает на текущий.
+ * Производные данные строк (render и hl) считаются общим бюджетом памяти:
+ * при его превышении они выбрасываются у буферов, которые дольше всех
+ * не показывались, и восстанавливаются построчно при отрисовке.
+ * Состояние комментария на конце строки (hl_open_comment) сохраняется,
+ * поэтому любую строку можно подсветить заново независимо от соседей.
+ */
+
+editor_buffer_t *editorBufferNew()
+{
+	editor_buffer_t *b = calloc(1, sizeof(editor_buffer_t));
+	b->watch = -1;
+	b->journal_fd = -1;
+	b->hex_fd = -1;
+	b->hl_from = b->hl_to = -1;
+	b->hl_stale = -1;
+	b->bracket_row = -1;
+	b->goto_row = -1;
+
+	E.buffers = realloc(E.buffers, sizeof(editor_buffer_t *) * (E.num_buffers + 1));
+	E.buffers[E.num_buffers++] = b;
+	return b;
+}
+
+/*
+ * @brief		Создаёт пустой буфер и делает его текущим
+ */
+editor_buffer_t *editorBufferAdd()
+{
+	E.buf = editorBufferNew();
+	return E.buf;
+}
+
+int editorBufferIndex(editor_buffer_t *b)
+{
+	for (int j = 0; j < E.num_buffers; j++) {
+		if (E.buffers[j] == b) return j;
+	}
+	return -1;
+}
+
+void editorBufferFree(editor_buffer_t *b)
+{
+	editor_buffer_t *saved = E.buf;
+
+	editorLoaderStop(b);
+	editorGrepFree(b);
+	editorFollowStop(b);
+	editorDiffStop(b);
+	editorHexClose(b);
+	editorBracketFree(b);
+	editorUnwatchBuffer(b);
+	editorJournalDiscard(b);
+	free(b->journal_buf);
+	E.buf = b;
+	for (int j = 0; j < b->num_rows; j++)
+		editorFreeRow(&b->row[j]);
+	free(b->row);
+	editorUndoClear();
+	free(b->undo);
+	fenwickFree(&b->wrap_index);
+	fenwickFree(&b->offset_index);
+	free(b->render_log);
+	free(b->file_name);
+	E.buf = saved;
+
+	int idx = editorBufferIndex(b);
+	memmove(&E.buffers[idx], &E.buffers[idx + 1], sizeof(editor_buffer_t *) * (E.num_buffers - idx - 1));
+	E.num_buffers--;
+	free(b);
+}
+
+void editorSwitchBuffer(int idx)
+{
+	if (E.num_buffers == 0) return;
+	idx = (idx % E.num_buffers + E.num_buffers) % E.num_buffers;
+
+	E.buf = E.buffers[idx];
+	editorSetStatusMessage("Buffer %d/%d: %s", idx + 1, E.num_buffers,
+							E.buf->file_name ? E.buf->file_name : "[No name]");
+}
+
+int editorAnyDirty()
+{
+	for (int j = 0; j < E.num_buffers; j++) {
+		if (E.buffers[j]->dirty) return 1;
+	}
+	return 0;
+}
+
+/*
+ * @brief		Открывает файл в новом буфере или переключается на буфер, где он уже открыт
+ */
+void editorOpenBuffer(char *file_name)
+{
+	for (int j = 0; j < E.num_buffers; j++) {
+		if (E.buffers[j]->file_name && !strcmp(E.buffers[j]->file_name, file_name)) {
+			editorSwitchBuffer(j);
+			return;
+		}
+	}
+
+	editor_buffer_t *prev = E.buf;
+	int reuse = (E.buf->file_name == NULL && E.buf->num_rows == 0 && !E.buf->dirty);
+	if (!reuse) editorBufferAdd();
+
+	if (editorOpen(file_name) == -1) {
+		editorSetStatusMessage("Can't open %s: %s", file_name, strerror(errno));
+		if (!reuse) editorBufferFree(E.buf);
+		E.buf = prev;
+	} else {
+		editorSwitchBuffer(editorBufferIndex(E.buf));
+	}
+}
+
+void editorOpenPrompt()
+{
+	char *file_name = editorPrompt("Open: %s (ESC to cancel)", NULL);
+	if (file_name == NULL) return;
+
+	editorOpenBuffer(file_name);
+	free(file_name);
+}
+
+void editorCloseBuffer()
+{
+	if (E.buf->dirty) {
+		char *answer = editorPrompt("Buffer has unsaved changes. Close anyway? (y/n): %s", NULL);
+		int yes = answer && (answer[0] == 'y' || answer[0] == 'Y');
+		free(answer);
+		if (!yes) {
+			editorSetStatusMessage("");
+			return;
+		}
+	}
+
+	int idx = editorBufferIndex(E.buf);
+	editorBufferFree(E.buf);
+	if (E.num_buffers == 0) editorBufferNew();
+	editorSwitchBuffer(idx < E.num_buffers ? idx : E.num_buffers - 1);
+}
+
+/*
+ * @brief		Строит render и hl строки, если они были выброшены или подсветка
+ *				устарела: строка лежит не выше hl_stale
+ */
+void editorRowEnsureRender(editor_row_t *row)
+{
+	int stale = (E.buf->hl_stale >= 0 && row->idx >= E.buf->hl_stale);
+	if (row->render == NULL || stale) editorUpdateSyntaxRow(row);
+}
+
+/*
+ * @brief		Выбрасывает render и hl строки; состояние комментария остаётся
+ */
+void editorRowDropRender(editor_buffer_t *b, editor_row_t *row)
+{
+	if (row->render == NULL) return;
+
+	b->derived_bytes -= 2 * row->render_size + 1;
+	b->render_rows--;
+	free(row->render);
+	row->render = NULL;
+	row->hl = NULL;
+	row->render_size = 0;
+}
+
+void editorBufferEvictDerived(editor_buffer_t *b)
+{
+	for (int j = 0; j < b->num_rows; j++)
+		editorRowDropRender(b, &b->row[j]);
+	b->render_log_len = 0;
+}
+
+/*
+ * @brief		Половина окна кэша render вокруг курсора; окно всегда накрывает
+ *				экран, на котором стоит курсор
+ */
+int editorRenderCacheHalf()
+{
+	int half = E.render_cache_rows / 2;
+	return (half < E.screen_rows) ? E.screen_rows : half;
+}
+
+/*
+ * @brief		Проверяет, попадает ли строка текущего буфера в окно кэша вокруг курсора
+ */
+int editorRowInRenderCache(int at)
+{
+	int half = editorRenderCacheHalf();
+	return E.render_cache_rows == 0 || (at >= E.buf->cy - half && at <= E.buf->cy + half);
+}
+
+/*
+ * @brief		Сдвигает номера в журнале render при вставке (delta > 0) или
+ *				удалении (delta < 0) строк с at; удалённые строки помечаются -1
+ */
+void editorRenderLogShift(int at, int delta)
+{
+	editor_buffer_t *b = E.buf;
+
+	for (int k = 0; k < b->render_log_len; k++) {
+		int j = b->render_log[k];
+		if (j < at) continue;
+		if (delta < 0 && j < at - delta) b->render_log[k] = -1;
+		else b->render_log[k] = j + delta;
+	}
+}
+
+/*
+ * @brief		Заново собирает журнал render после перестройки массива строк
+ */
+void editorRenderLogRebuild()
+{
+	editor_buffer_t *b = E.buf;
+
+	b->render_log_len = 0;
+	if (E.render_cache_rows == 0) return;
+	for (int j = 0; j < b->num_rows; j++) {
+		if (b->row[j].render == NULL) continue;
+		if (b->render_log_len == b->render_log_cap) {
+			b->render_log_cap = b->render_log_cap ? b->render_log_cap * 2 : 256;
+			b->render_log = realloc(b->render_log, sizeof(int) * b->render_log_cap);
+		}
+		b->render_log[b->render_log_len++] = j;
+	}
+}
+
+/*
+ * @brief		В режиме экономии памяти оставляет render и hl только у строк
+ *				вокруг курсора. Просматриваются только строки из журнала render,
+ *				и только когда построенных строк (или записей журнала) стало
+ *				вдвое больше размера кэша, так что цена распределяется по
+ *				построенным с прошлого раза строкам. Повторы в журнале
+ *				отсеиваются по окну.
+ */
+void editorTrimRenderCache()
+{
+	editor_buffer_t *b = E.buf;
+	int limit = 2 * E.render_cache_rows;
+	if (E.render_cache_rows == 0) return;
+	if (b->render_rows <= limit && b->render_log_len <= 2 * limit) return;
+
+	int half = editorRenderCacheHalf();
+	int lo = b->cy - half;
+	unsigned char *seen = calloc(2 * half + 1, 1);
+	int out = 0;
+	for (int k = 0; k < b->render_log_len; k++) {
+		int j = b->render_log[k];
+		if (j < 0 || j >= b->num_rows || b->row[j].render == NULL) continue;
+		if (!editorRowInRenderCache(j)) editorRowDropRender(b, &b->row[j]);
+		else if (!seen[j - lo]++) b->render_log[out++] = j;
+	}
+	b->render_log_len = out;
+	free(seen);
+	malloc_trim(0);
+}
+
+void editorEnforceMemoryBudget()
+{
+	size_t total = 0;
+	for (int j = 0; j < E.num_buffers; j++)
+		total += E.buffers[j]->derived_bytes;
+
+	int evicted = 0;
+	while (total > E.mem_budget) {
+		editor_buffer_t *lru = NULL;
+		for (int j = 0; j < E.num_buffers; j++) {
+			editor_buffer_t *b = E.buffers[j];
+			if (b == E.buf || b->derived_bytes == 0) continue;
+			if (lru == NULL || b->last_view < lru->last_view) lru = b;
+		}
+		if (lru == NULL) break;
+
+		total -= lru->derived_bytes;
+		editorBufferEvictDerived(lru);
+		evicted = 1;
+	}
+
+	/* освобождённые блоки разбросаны по куче -- возвращаем страницы системе */
+	if (evicted) malloc_trim(0);
+}
+
+/* *** Regex *** */
+
+/*
+ * Небольшой движок регулярных выражений без возвратов (Thompson NFA + Pike VM).
+ * Время поиска линейно от длины просмотренного текста, поэтому поиск по
+ * большим логам не может "взорваться" на патологических шаблонах.
+ *
+ * Поддерживается: литералы, '.', классы [...] и [^...], \d \w \s \D \W \S,
+ * \n \t, якоря ^ и $, группы (), альтернатива |, кванторы * + ? {m} {m,} {m,n}.
+ */
+
+#define REGEX_MAX_REPEAT 255
+#define REGEX_MAX_PREFIX 32
+#define REGEX_MAX_PROG 100000
+
+#define REGEX_MULTILINE	(1 << 0)	/* совпадение может переходить через границу строки ('\n') */
+#define REGEX_ONE_ROW	(1 << 1)	/* совпадение обязано начинаться в стартовой строке */
+
+enum regexNodeType {
+	RN_EMPTY = 0,
+	RN_CHAR,
+	RN_ANY,
+	RN_CLASS,
+	RN_BOL,
+	RN_EOL,
+	RN_CAT,
+	RN_ALT,
+	RN_REPEAT
+};
+
+enum regexOp {
+	RE_CHAR = 0,
+	RE_ANY,
+	RE_CLASS,
+	RE_BOL,
+	RE_EOL,
+	RE_SPLIT,
+	RE_JMP,
+	RE_MATCH
+};
+
+typedef struct regex_node_s {
+	int type;
+	int arg;			/* символ для RN_CHAR, номер класса для RN_CLASS */
+	int min, max;		/* для RN_REPEAT, max == -1 -- без ограничения */
+	int left, right;	/* индексы дочерних узлов */
+} regex_node_t;
+
+typedef struct regex_inst_s {
+	int op;
+	int arg;
+	int x, y;
+} regex_inst_t;
+
+typedef struct regex_thread_s {
+	int pc;
+	int row, col;		/* где началось совпадение */
+} regex_thread_t;
+
+typedef struct editor_regex_s {
+	regex_inst_t *prog;
+	int prog_len;
+	int prog_cap;
+	unsigned char (*cls)[32];
+	int num_cls;
+	char prefix[REGEX_MAX_PREFIX];
+	int prefix_len;
+	int anchored;
+
+	/* рабочая память Pike VM: один объект нельзя использовать из разных потоков */
+	regex_thread_t *clist, *nlist;
+	int *mark;
+	int *stack;
+	unsigned int gen;
+} editor_regex_t;
+
+typedef struct editor_match_s {
+	int row, col;
+	int end_row, end_col;
+} editor_match_t;
+
+struct regex_parser_s {
+	const char *p;
+	editor_regex_t *re;
+	regex_node_t *nodes;
+	int num_nodes;
+	int cap;
+	int error;
+};
+
+int regexNewNode(struct regex_parser_s *ps, int type, int left, int right)
+{
+	if (ps->num_nodes == ps->cap) {
+		ps->cap = ps->cap ? ps->cap * 2 : 32;
+		ps->nodes = realloc(ps->nodes, sizeof(regex_node_t) * ps->cap);
+	}
+	regex_node_t *n = &ps->nodes[ps->num_nodes];
+	n->type = type;
+	n->arg = 0;
+	n->min = n->max = 0;
+	n->left = left;
+	n->right = right;
+	return ps->num_nodes++;
+}
+
+int regexNewClass(editor_regex_t *re)
+{
+	re->cls = realloc(re->cls, sizeof(re->cls[0]) * (re->num_cls + 1));
+	memset(re->cls[re->num_cls], 0, sizeof(re->cls[0]));
+	return re->num_cls++;
+}
+
+void regexClassSet(unsigned char *bits, int c)
+{
+	bits[c >> 3] |= 1 << (c & 7);
+}
+
+int regexClassHas(const unsigned char *bits, int c)
+{
+	return bits[c >> 3] & (1 << (c & 7));
+}
+
+/*
+ * @brief		Добавляет в класс символы, соответствующие escape-последовательности \d, \w, \s
+ * @return		1, если последовательность является классом, иначе 0
+ */
+int regexClassEscape(unsigned char *bits, int e)
+{
+	int c;
+	int negate = isupper(e);
+
+	switch (tolower(e)) {
+		case 'd':
+		case 'w':
+		case 's':
+			break;
+		default:
+			return 0;
+	}
+
+	for (c = 0; c < 256; c++) {
+		int in;
+		switch (tolower(e)) {
+			case 'd': in = isdigit(c); break;
+			case 'w': in = isalnum(c) || c == '_'; break;
+			default: in = isspace(c); break;
+		}
+		if (negate) in = !in && c != '\n';
+		if (in) regexClassSet(bits, c);
+	}
+	return 1;
+}
+
+int regexEscapeChar(int e)
+{
+	switch (e) {
+		case 'n': return '\n';
+		case 't': return '\t';
+		case 'r': return '\r';
+		default: return e;
+	}
+}
+
+int regexParseAlt(struct regex_parser_s *ps);
+
+int regexParseClass(struct regex_parser_s *ps)
+{
+	int cls = regexNewClass(ps->re);
+	unsigned char bits[32] = { 0 };
+	int negate = 0;
+	int first = 1;
+
+	if (*ps->p == '^') {
+		negate = 1;
+		ps->p++;
+	}
+
+	while (*ps->p && (*ps->p != ']' || first)) {
+		int lo = (unsigned char) *ps->p++;
+		first = 0;
+
+		if (lo == '\\' && *ps->p) {
+			int e = (unsigned char) *ps->p++;
+			if (regexClassEscape(bits, e)) continue;
+			lo = regexEscapeChar(e);
+		}
+
+		int hi = lo;
+		if (ps->p[0] == '-' && ps->p[1] && ps->p[1] != ']') {
+			ps->p++;
+			hi = (unsigned char) *ps->p++;
+			if (hi == '\\' && *ps->p) hi = regexEscapeChar((unsigned char) *ps->p++);
+			if (hi < lo) {
+				ps->error = 1;
+				return -1;
+			}
+		}
+		for (int c = lo; c <= hi; c++)
+			regexClassSet(bits, c);
+	}
+
+	if (*ps->p != ']') {
+		ps->error = 1;
+		return -1;
+	}
+	ps->p++;
+
+	for (int i = 0; i < 32; i++)
+		ps->re->cls[cls][i] = negate ? ~bits[i] : bits[i];
+	if (negate)
+		ps->re->cls[cls]['\n' >> 3] &= ~(1 << ('\n' & 7));
+
+	int n = regexNewNode(ps, RN_CLASS, -1, -1);
+	ps->nodes[n].arg = cls;
+	return n;
+}
+
+int regexParseAtom(struct regex_parser_s *ps)
+{
+	int c = (unsigned char) *ps->p;
+	int n;
+
+	switch (c) {
+		case '(':
+			ps->p++;
+			n = regexParseAlt(ps);
+			if (*ps->p != ')') {
+				ps->error = 1;
+				return -1;
+			}
+			ps->p++;
+			return n;
+		case '[':
+			ps->p++;
+			return regexParseClass(ps);
+		case '.':
+			ps->p++;
+			return regexNewNode(ps, RN_ANY, -1, -1);
+		case '^':
+			ps->p++;
+			return regexNewNode(ps, RN_BOL, -1, -1);
+		case '$':
+			ps->p++;
+			return regexNewNode(ps, RN_EOL, -1, -1);
+		case '\\':
+			ps->p++;
+			if (*ps->p == '\0') {
+				ps->error = 1;
+				return -1;
+			}
+			c = (unsigned char) *ps->p++;
+			if (strchr("dwsDWS", c)) {
+				int cls = regexNewClass(ps->re);
+				regexClassEscape(ps->re->cls[cls], c);
+				n = regexNewNode(ps, RN_CLASS, -1, -1);
+				ps->nodes[n].arg = cls;
+				return n;
+			}
+			n = regexNewNode(ps, RN_CHAR, -1, -1);
+			ps->nodes[n].arg = regexEscapeChar(c);
+			return n;
+		case '*':
+		case '+':
+		case '?':
+		case '{':
+		case ')':
+		case '|':
+		case '\0':
+			ps->error = 1;
+			return -1;
+		default:
+			ps->p++;
+			n = regexNewNode(ps, RN_CHAR, -1, -1);
+			ps->nodes[n].arg = c;
+			return n;
+	}
+}
+
+int regexParseNumber(struct regex_parser_s *ps)
+{
+	int v = -1;
+	while (isdigit((unsigned char) *ps->p)) {
+		v = (v < 0 ? 0 : v) * 10 + (*ps->p++ - '0');
+		if (v > REGEX_MAX_REPEAT) {
+			ps->error = 1;
+			return -1;
+		}
+	}
+	return v;
+}
+
+int regexParseRepeat(struct regex_parser_s *ps)
+{
+	int n = regexParseAtom(ps);
+	if (ps->error) return -1;
+
+	while (*ps->p == '*' || *ps->p == '+' || *ps->p == '?' || *ps->p == '{') {
+		int min, max;
+		char q = *ps->p++;
+
+		if (q == '*') {
+			min = 0; max = -1;
+		} else if (q == '+') {
+			min = 1; max = -1;
+		} else if (q == '?') {
+			min = 0; max = 1;
+		} else {
+			min = regexParseNumber(ps);
+			if (min < 0) {
+				ps->error = 1;
+				return -1;
+			}
+			max = min;
+			if (*ps->p == ',') {
+				ps->p++;
+				max = regexParseNumber(ps);
+				if (ps->error) return -1;
+			}
+			if (*ps->p != '}' || (max != -1 && max < min)) {
+				ps->error = 1;
+				return -1;
+			}
+			ps->p++;
+		}
+
+		int r = regexNewNode(ps, RN_REPEAT, n, -1);
+		ps->nodes[r].min = min;
+		ps->nodes[r].max = max;
+		n = r;
+	}
+	return n;
+}
+
+int regexParseConcat(struct regex_parser_s *ps)
+{
+	int n = -1;
+
+	while (*ps->p && *ps->p != '|' && *ps->p != ')') {
+		int m = regexParseRepeat(ps);
+		if (ps->error) return -1;
+		n = (n < 0) ? m : regexNewNode(ps, RN_CAT, n, m);
+	}
+
+	return (n < 0) ? regexNewNode(ps, RN_EMPTY, -1, -1) : n;
+}
+
+int regexParseAlt(struct regex_parser_s *ps)
+{
+	int n = regexParseConcat(ps);
+
+	while (!ps->error && *ps->p == '|') {
+		ps->p++;
+		int m = regexParseConcat(ps);
+		if (ps->error) return -1;
+		n = regexNewNode(ps, RN_ALT, n, m);
+	}
+	return n;
+}
+
+int regexEmit(editor_regex_t *re, int op, int arg)
+{
+	if (re->prog_len == re->prog_cap) {
+		re->prog_cap = re->prog_cap ? re->prog_cap * 2 : 64;
+		re->prog = realloc(re->prog, sizeof(regex_inst_t) * re->prog_cap);
+	}
+	regex_inst_t *inst = &re->prog[re->prog_len];
+	inst->op = op;
+	inst->arg = arg;
+	inst->x = inst->y = 0;
+	return re->prog_len++;
+}
+
+void regexCodegen(editor_regex_t *re, regex_node_t *nodes, int n)
+{
+	regex_node_t *node = &nodes[n];
+	int split, jmp, i;
+
+	if (re->prog_len > REGEX_MAX_PROG) return;
+
+	switch (node->type) {
+		case RN_EMPTY:
+			break;
+		case RN_CHAR:
+			regexEmit(re, RE_CHAR, node->arg);
+			break;
+		case RN_ANY:
+			regexEmit(re, RE_ANY, 0);
+			break;
+		case RN_CLASS:
+			regexEmit(re, RE_CLASS, node->arg);
+			break;
+		case RN_BOL:
+			regexEmit(re, RE_BOL, 0);
+			break;
+		case RN_EOL:
+			regexEmit(re, RE_EOL, 0);
+			break;
+		case RN_CAT:
+			regexCodegen(re, nodes, node->left);
+			regexCodegen(re, nodes, node->right);
+			break;
+		case RN_ALT:
+			split = regexEmit(re, RE_SPLIT, 0);
+			re->prog[split].x = re->prog_len;
+			regexCodegen(re, nodes, node->left);
+			jmp = regexEmit(re, RE_JMP, 0);
+			re->prog[split].y = re->prog_len;
+			regexCodegen(re, nodes, node->right);
+			re->prog[jmp].x = re->prog_len;
+			break;
+		case RN_REPEAT:
+			for (i = 0; i < node->min; i++)
+				regexCodegen(re, nodes, node->left);
+
+			if (node->max == -1) {
+				split = regexEmit(re, RE_SPLIT, 0);
+				re->prog[split].x = re->prog_len;
+				regexCodegen(re, nodes, node->left);
+				jmp = regexEmit(re, RE_JMP, 0);
+				re->prog[jmp].x = split;
+				re->prog[split].y = re->prog_len;
+			} else {
+				int num_opt = node->max - node->min;
+				int *splits = malloc(sizeof(int) * (num_opt + 1));
+				for (i = 0; i < num_opt; i++) {
+					splits[i] = regexEmit(re, RE_SPLIT, 0);
+					re->prog[splits[i]].x = re->prog_len;
+					regexCodegen(re, nodes, node->left);
+				}
+				/* все необязательные копии выходят в конец */
+				for (i = 0; i < num_opt; i++)
+					re->prog[splits[i]].y = re->prog_len;
+				free(splits);
+			}
+			break;
+	}
+}
+
+/*
+ * @brief		Извлекает литеральный префикс, с которого начинается любое совпадение
+ * @return		1, если узел целиком литеральный и префикс можно продолжать
+ */
+int regexExtractPrefix(editor_regex_t *re, regex_node_t *nodes, int n)
+{
+	regex_node_t *node = &nodes[n];
+
+	switch (node->type) {
+		case RN_CHAR:
+			if (node->arg == '\n' || re->prefix_len == REGEX_MAX_PREFIX) return 0;
+			re->prefix[re->prefix_len++] = node->arg;
+			return 1;
+		case RN_BOL:
+			if (re->prefix_len == 0) re->anchored = 1;
+			return 1;
+		case RN_CAT:
+			return regexExtractPrefix(re, nodes, node->left) && regexExtractPrefix(re, nodes, node->right);
+		case RN_EMPTY:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+void regexFree(editor_regex_t *re)
+{
+	if (re == NULL) return;
+	free(re->prog);
+	free(re->cls);
+	free(re->clist);
+	free(re->nlist);
+	free(re->mark);
+	free(re->stack);
+	free(re);
+}
+
+/*
+ * @brief			Компилирует шаблон в программу для Pike VM
+ * @param pattern	Регулярное выражение
+ * @return			Скомпилированное выражение или NULL при синтаксической ошибке
+ */
+editor_regex_t *regexCompile(const char *pattern)
+{
+	editor_regex_t *re = calloc(1, sizeof(editor_regex_t));
+	struct regex_parser_s ps = { pattern, re, NULL, 0, 0, 0 };
+
+	int root = regexParseAlt(&ps);
+	if (!ps.error && *ps.p != '\0') ps.error = 1;
+	if (ps.error) {
+		free(ps.nodes);
+		regexFree(re);
+		return NULL;
+	}
+
+	regexCodegen(re, ps.nodes, root);
+	regexEmit(re, RE_MATCH, 0);
+	regexExtractPrefix(re, ps.nodes, root);
+	free(ps.nodes);
+
+	if (re->prog_len > REGEX_MAX_PROG) {
+		regexFree(re);
+		return NULL;
+	}
+
+	re->clist = malloc(sizeof(regex_thread_t) * re->prog_len);
+	re->nlist = malloc(sizeof(regex_thread_t) * re->prog_len);
+	re->mark = calloc(re->prog_len, sizeof(int));
+	re->stack = malloc(sizeof(int) * (re->prog_len * 2 + 1));
+	re->gen = 0;
+
+	return re;
+}
+
+/*
+ * @brief		Добавляет поток и его eps-замыкание в список с сохранением приоритета
+ * @param n		Текущая длина списка, возвращается новая
+ */
+int regexAddThread(editor_regex_t *re, regex_thread_t *list, int n, int pc,
+							int start_row, int start_col, int at_bol, int at_eol)
+{
+	int sp = 0;
+	re->stack[sp++] = pc;
+
+	while (sp > 0) {
+		pc = re->stack[--sp];
+		if (re->mark[pc] == (int) re->gen) continue;
+		re->mark[pc] = re->gen;
+
+		regex_inst_t *inst = &re->prog[pc];
+		switch (inst->op) {
+			case RE_JMP:
+				re->stack[sp++] = inst->x;
+				break;
+			case RE_SPLIT:
+				re->stack[sp++] = inst->y;
+				re->stack[sp++] = inst->x;
+				break;
+			case RE_BOL:
+				if (at_bol) re->stack[sp++] = pc + 1;
+				break;
+			case RE_EOL:
+				if (at_eol) re->stack[sp++] = pc + 1;
+				break;
+			default:
+				list[n].pc = pc;
+				list[n].row = start_row;
+				list[n].col = start_col;
+				n++;
+				break;
+		}
+	}
+	return n;
+}
+
+/*
+ * @brief			Ищет первое совпадение в массиве строк, начиная с позиции (row, col)
+ * @param rows		Строки, в которых идёт поиск
+ * @param flags		REGEX_MULTILINE, REGEX_ONE_ROW
+ * @param m			Найденное совпадение
+ * @return			1, если совпадение найдено, иначе 0
+ */
+int regexSearch(editor_regex_t *re, editor_row_t *rows, int num_rows, int row, int col,
+				int flags, editor_match_t *m)
+{
+	int nc = 0;
+	int matched = 0;
+	int start_row = row;
+
+	if (row < 0 || row >= num_rows) return 0;
+
+	while (1) {
+		editor_row_t *r = &rows[row];
+		int can_start = !matched && (!(flags & REGEX_ONE_ROW) || row == start_row);
+
+		if (can_start && nc == 0) {
+			/* живых потоков нет -- можно перепрыгнуть к следующему кандидату */
+			int skip = 0;
+			if (re->anchored && col != 0) {
+				skip = 1;
+			} else if (re->prefix_len) {
+				char *hit = memmem(&r->chars[col], r->size - col, re->prefix, re->prefix_len);
+				if (hit) col = hit - r->chars;
+				else skip = 1;
+			}
+			if (skip) {
+				if ((flags & REGEX_ONE_ROW) || row + 1 >= num_rows) break;
+				row++;
+				col = 0;
+				continue;
+			}
+		}
+
+		if (nc == 0) re->gen++;
+		if (can_start)
+			nc = regexAddThread(re, re->clist, nc, 0, row, col, col == 0, col == r->size);
+		if (nc == 0) {
+			if (matched || !can_start) break;
+		}
+
+		int c = -1;
+		int next_row = row, next_col = col + 1;
+		if (col < r->size) {
+			c = (unsigned char) r->chars[col];
+		} else if ((flags & REGEX_MULTILINE) && row + 1 < num_rows) {
+			c = '\n';
+			next_row = row + 1;
+			next_col = 0;
+		}
+		int next_bol = (next_col == 0);
+		int next_eol = (c != -1) && (next_col == rows[next_row].size);
+
+		re->gen++;
+		int nn = 0;
+		for (int i = 0; i < nc; i++) {
+			regex_thread_t *t = &re->clist[i];
+			regex_inst_t *inst = &re->prog[t->pc];
+			int ok = 0;
+
+			switch (inst->op) {
+				case RE_MATCH:
+					matched = 1;
+					m->row = t->row;
+					m->col = t->col;
+					m->end_row = row;
+					m->end_col = col;
+					i = nc;		/* потоки с меньшим приоритетом отбрасываются */
+					continue;
+				case RE_CHAR:
+					ok = (c == inst->arg);
+					break;
+				case RE_ANY:
+					ok = (c != -1 && c != '\n');
+					break;
+				case RE_CLASS:
+					ok = (c != -1 && regexClassHas(re->cls[inst->arg], c));
+					break;
+			}
+			if (ok)
+				nn = regexAddThread(re, re->nlist, nn, t->pc + 1, t->row, t->col, next_bol, next_eol);
+		}
+
+		regex_thread_t *tmp = re->clist;
+		re->clist = re->nlist;
+		re->nlist = tmp;
+		nc = nn;
+
+		if (c == -1) {
+			/* конец строки без перехода дальше */
+			if (matched || (flags & REGEX_ONE_ROW) || row + 1 >= num_rows) break;
+			nc = 0;
+			row++;
+			col = 0;
+			continue;
+		}
+		row = next_row;
+		col = next_col;
+	}
+
+	return matched;
+}
+
+/* *** Find *** */
+
+#define FIND_REGEX		(1 << 0)
+#define FIND_MULTILINE	(1 << 1)
+
+int find_mode = 0;
+char find_prompt[80];
+
+void editorFindUpdatePrompt()
+{
+	snprintf(find_prompt, sizeof(find_prompt), "Search%s%s: %%s (Esc/Arrows/Enter, ^E regex, ^N multiline)",
+				(find_mode & FIND_REGEX) ? " [re]" : "",
+				(find_mode & FIND_MULTILINE) ? " [ml]" : "");
+}
+
+void editorFindCallback(char *query, int key)
+{
+	static int last_match = -1;
+	static int direction = 1;
+
+	static int saved_hl_line;
+	static char *saved_hl = NULL;
+
+	if (saved_hl) {
+		/* строка могла уйти из кэша render, тогда подсветка построится заново */
+		if (E.buf->row[saved_hl_line].hl)
+			memcpy(E.buf->row[saved_hl_line].hl, saved_hl, E.buf->row[saved_hl_line].render_size);
+		free(saved_hl);
+		saved_hl = NULL;
+	}
+
+	if (key == '\r' || key == '\x1b') {
+		last_match = -1;
+		direction = -1;
+		return;
+	} else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+		direction = 1;
+	} else if (key == ARROW_LEFT || key == ARROW_UP) {
+		direction = -1;
+	} else {
+		if (key == CTRL_KEY('e')) find_mode ^= FIND_REGEX;
+		if (key == CTRL_KEY('n')) find_mode ^= FIND_MULTILINE;
+		editorFindUpdatePrompt();
+
+		last_match = -1;
+		direction = -1;
+	}
+
+	if (last_match == -1) 
+		direction = 1;
+
+	editor_regex_t *re = NULL;
+	if (find_mode & FIND_REGEX) {
+		re = regexCompile(query);
+		if (re == NULL) return;
+	}
+	int re_flags = REGEX_ONE_ROW | ((find_mode & FIND_MULTILINE) ? REGEX_MULTILINE : 0);
+	
+	int current = last_match;
+	int i;
+	for (i = 0; i < E.buf->num_rows; i++) {
+		current += direction;
+		
+		if (current == -1) {
+			current = E.buf->num_rows - 1;
+		} else if (current == E.buf->num_rows) {
+			current = 0;
+		}
+			
+
+		editor_row_t *row = &E.buf->row[current];
+		int match_idx = -1;
+		int match_len = 0;
+		if (re) {
+			editor_match_t m;
+			if (regexSearch(re, E.buf->row, E.buf->num_rows, current, 0, re_flags, &m)) {
+				int end_cx = (m.end_row == m.row) ? m.end_col : row->size;
+				match_idx = editorRowCxToRenderIdx(row, m.col);
+				match_len = editorRowCxToRenderIdx(row, end_cx) - match_idx;
+			}
+		} else {
+			int query_len = strlen(query);
+			char *match = memmem(row->chars, row->size, query, query_len);
+			if (match) {
+				match_idx = editorRowCxToRenderIdx(row, match - row->chars);
+				match_len = editorRowCxToRenderIdx(row, match - row->chars + query_len) - match_idx;
+			}
+		}
+
+		if (match_idx != -1) {
+			editorRowEnsureRender(row);
+			last_match = current;
+			E.buf->cy = current;
+			E.buf->cx = editorRowRenderIdxToCx(row, match_idx);
+			E.buf->row_offset = E.buf->num_rows;
+			E.buf->wrap_offset = INT_MAX;
+
+			saved_hl_line = current;
+			saved_hl = malloc(row->render_size);
+			memcpy(saved_hl, row->hl, row->render_size);
+			memset(&row->hl[match_idx], HL_MATCH, match_len);
+			break;
+		}
+	}
+
+	regexFree(re);
+}
+
+void editorFind()
+{
+	int saved_cx = E.buf->cx;
+	int saved_cy = E.buf->cy;
+	int saved_colloff = E.buf->col_offset;
+	int saved_rowoff = E.buf->row_offset;
+	int saved_wrapoff = E.buf->wrap_offset;
+
+	editorFindUpdatePrompt();
+	char *query = editorPrompt(find_prompt, editorFindCallback);
+	if (query) {
+		free(query);
+	} else {
+		E.buf->cx = saved_cx;
+		E.buf->cy = saved_cy;
+		E.buf->col_offset = saved_colloff;
+		E.buf->row_offset = saved_rowoff;
+		E.buf->wrap_offset = saved_wrapoff;
+	}
+
+	
+}
+
+char replace_prompt[80];
+
+void editorReplaceUpdatePrompt()
+{
+	snprintf(replace_prompt, sizeof(replace_prompt), "Replace all%s: %%s (ESC to cancel, ^E regex)",
+				(find_mode & FIND_REGEX) ? " [re]" : "");
+}
+
+void editorReplaceCallback(char *query, int key)
+{
+	(void) query;
+	if (key == CTRL_KEY('e')) {
+		find_mode ^= FIND_REGEX;
+		editorReplaceUpdatePrompt();
+	}
+}
+
+/*
+ * @brief		Заменяет все вхождения во всём буфере.
+ *				Сначала находятся все совпадения строки, затем её текст собирается
+ *				заново за один проход; каждая затронутая строка перерисовывается
+ *				и подсвечивается ровно один раз, вся замена -- одна группа отмены.
+ */
+void editorReplaceAll()
+{
+	editorReplaceUpdatePrompt();
+	char *query = editorPrompt(replace_prompt, editorReplaceCallback);
+	if (query == NULL) return;
+
+	char *with = editorPromptEx("Replace with: %s (ESC to cancel)", NULL, 1);
+	if (with == NULL) {
+		free(query);
+		return;
+	}
+
+	editor_regex_t *re = NULL;
+	if (find_mode & FIND_REGEX) {
+		re = regexCompile(query);
+		if (re == NULL) {
+			editorSetStatusMessage("Bad regex: %s", query);
+			free(query);
+			free(with);
+			return;
+		}
+	}
+
+	int query_len = strlen(query);
+	int with_len = strlen(with);
+
+	int *spans = NULL;
+	int spans_cap = 0;
+	unsigned char *touched = calloc(E.buf->num_rows ? E.buf->num_rows : 1, 1);
+	int first = -1, last = -1;
+	long total = 0;
+	int lines = 0;
+
+	for (int r = 0; r < E.buf->num_rows; r++) {
+		editor_row_t *row = &E.buf->row[r];
+		int num_spans = 0;
+		int col = 0;
+
+		while (col <= row->size) {
+			int ms, me;
+			if (re) {
+				editor_match_t m;
+				if (!regexSearch(re, E.buf->row, E.buf->num_rows, r, col, REGEX_ONE_ROW, &m)) break;
+				ms = m.col;
+				me = m.end_col;
+			} else {
+				char *hit = memmem(&row->chars[col], row->size - col, query, query_len);
+				if (hit == NULL) break;
+				ms = hit - row->chars;
+				me = ms + query_len;
+			}
+
+			if (num_spans + 2 > spans_cap) {
+				spans_cap = spans_cap ? spans_cap * 2 : 64;
+				spans = realloc(spans, sizeof(int) * spans_cap);
+			}
+			spans[num_spans++] = ms;
+			spans[num_spans++] = me;
+			col = (me > ms) ? me : me + 1;
+		}
+		if (num_spans == 0) continue;
+
+		int new_len = row->size;
+		for (int j = 0; j < num_spans; j += 2)
+			new_len += with_len - (spans[j + 1] - spans[j]);
+
+		char *buf = malloc(new_len + 1);
+		char *p = buf;
+		int prev = 0;
+		for (int j = 0; j < num_spans; j += 2) {
+			memcpy(p, &row->chars[prev], spans[j] - prev);
+			p += spans[j] - prev;
+			memcpy(p, with, with_len);
+			p += with_len;
+			prev = spans[j + 1];
+		}
+		memcpy(p, &row->chars[prev], row->size - prev);
+		buf[new_len] = '\0';
+
+		int old_size = row->size;
+		char *old = editorRowSetChars(row, buf, new_len);
+		if (!editorUndoPush(UNDO_SET_ROW, r, 0, old, old_size))
+			free(old);
+		editorUpdateRender(row);
+
+		touched[r] = 1;
+		if (first == -1) first = r;
+		last = r;
+		total += num_spans / 2;
+		lines++;
+	}
+
+	if (first != -1)
+		editorUpdateSyntaxRows(first, last, &touched[first]);
+
+	if (E.buf->cy < E.buf->num_rows && E.buf->cx > E.buf->row[E.buf->cy].size)
+		E.buf->cx = E.buf->row[E.buf->cy].size;
+
+	editorSetStatusMessage("Replaced %ld occurrences on %d lines", total, lines);
+
+	free(touched);
+	free(spans);
+	regexFree(re);
+	free(query);
+	free(with);
+}
+
+/* *** Line transforms *** */
+
+/*
+ * Команды над всеми строками буфера (^J): sort [-r] [-n] [-u], uniq,
+ * keep РЕГВЫР и drop РЕГВЫР. Сортируется массив номеров строк слиянием в
+ * нескольких потоках, после чего сами строки переставляются на месте по
+ * циклам перестановки -- текст не копируется. Фильтры проверяют строки
+ * параллельно и сжимают массив одним проходом. Подсветка сразу не
+ * пересчитывается: render строк выбрасывается, и строки подсвечиваются,
+ * когда попадают на экран.
+ */
+
+#define PARALLEL_MAX_THREADS 16
+#define PARALLEL_MIN_ROWS 65536		/* на меньших буферах хватает одного потока */
+#define SORT_INSERTION 32
+
+typedef struct editor_parallel_s {
+	void (*fn)(void *ctx, int task);
+	void *ctx;
+	int tasks;
+	int first;
+	int stride;
+} editor_parallel_t;
+
+void *editorParallelWorker(void *arg)
+{
+	editor_parallel_t *p = arg;
+	for (int t = p->first; t < p->tasks; t += p->stride)
+		p->fn(p->ctx, t);
+	return NULL;
+}
+
+int editorCpuCount()
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 1) return 1;
+	return (cpus > PARALLEL_MAX_THREADS) ? PARALLEL_MAX_THREADS : cpus;
+}
+
+/*
+ * @brief		Сколько потоков стоит занять работой над n строками
+ */
+int editorParallelThreads(long long n)
+{
+	if (n < PARALLEL_MIN_ROWS) return 1;
+	return editorCpuCount();
+}
+
+/*
+ * @brief		Выполняет задачи 0..tasks-1 в threads потоках: задача t достаётся потоку t % threads
+ */
+void editorParallel(int threads, int tasks, void (*fn)(void *ctx, int task), void *ctx)
+{
+	pthread_t tid[PARALLEL_MAX_THREADS];
+	editor_parallel_t p[PARALLEL_MAX_THREADS];
+	int started[PARALLEL_MAX_THREADS];
+
+	if (threads > tasks) threads = tasks;
+	if (threads > PARALLEL_MAX_THREADS) threads = PARALLEL_MAX_THREADS;
+	if (threads < 1) return;
+
+	for (int i = 0; i < threads; i++) {
+		p[i] = (editor_parallel_t) { fn, ctx, tasks, i, threads };
+		started[i] = (i > 0 && pthread_create(&tid[i], NULL, editorParallelWorker, &p[i]) == 0);
+	}
+
+	/* задачи потоков, которые не удалось запустить, выполняются здесь же */
+	editorParallelWorker(&p[0]);
+	for (int i = 1; i < threads; i++) {
+		if (started[i]) pthread_join(tid[i], NULL);
+		else editorParallelWorker(&p[i]);
+	}
+}
+
+/*
+ * Сортируются пары (ключ, номер строки). Ключ -- первые 8 байт строки
+ * в порядке big-endian, а для -n -- число, переведённое в беззнаковое целое
+ * с тем же порядком, так что почти все сравнения обходятся без обращения
+ * к тексту строк.
+ */
+typedef struct editor_sort_item_s {
+	uint64_t key;
+	int row;
+} editor_sort_item_t;
+
+typedef struct editor_sort_s {
+	editor_row_t *rows;
+	int numeric;
+	int reverse;
+	int n;
+	editor_sort_item_t *item;	/* строки в порядке сортировки */
+	editor_sort_item_t *tmp;
+	int run;					/* длина уже отсортированных кусков */
+	int parts;					/* задач на одно слияние */
+} editor_sort_t;
+
+int editorSortCompare(editor_sort_t *s, const editor_sort_item_t *a, const editor_sort_item_t *b)
+{
+	int r = 0;
+
+	if (a->key != b->key) {
+		r = (a->key > b->key) ? 1 : -1;
+	} else if (!s->numeric) {
+		editor_row_t *x = &s->rows[a->row], *y = &s->rows[b->row];
+		r = memcmp(x->chars, y->chars, (x->size < y->size) ? x->size : y->size);
+		if (r == 0) r = (x->size > y->size) - (x->size < y->size);
+	}
+	return s->reverse ? -r : r;
+}
+
+/*
+ * @brief		Сливает a и b в out; при равенстве первым идёт элемент a
+ */
+void editorSortMerge(editor_sort_t *s, const editor_sort_item_t *a, int na,
+					const editor_sort_item_t *b, int nb, editor_sort_item_t *out)
+{
+	int i = 0, j = 0;
+
+	/* уже упорядоченные куски (частый случай для почти отсортированного текста) */
+	if (na && nb && editorSortCompare(s, &b[0], &a[na - 1]) >= 0) {
+		memcpy(out, a, sizeof(editor_sort_item_t) * na);
+		memcpy(out + na, b, sizeof(editor_sort_item_t) * nb);
+		return;
+	}
+	while (i < na && j < nb)
+		*out++ = (editorSortCompare(s, &b[j], &a[i]) < 0) ? b[j++] : a[i++];
+	while (i < na) *out++ = a[i++];
+	while (j < nb) *out++ = b[j++];
+}
+
+/*
+ * @brief		Сколько элементов a попадает в первые k элементов слияния a и b
+ */
+int editorSortSplit(editor_sort_t *s, const editor_sort_item_t *a, int na,
+					const editor_sort_item_t *b, int nb, int k)
+{
+	int lo = (k > nb) ? k - nb : 0;
+	int hi = (k < na) ? k : na;
+
+	while (lo < hi) {
+		int i = (lo + hi) / 2, j = k - i;
+		if (j > 0 && editorSortCompare(s, &b[j - 1], &a[i]) >= 0) lo = i + 1;
+		else hi = i;
+	}
+	return lo;
+}
+
+/*
+ * @brief		Числовой ключ строки для sort -n: равные числа дают равные ключи
+ */
+uint64_t editorSortNumericKey(editor_row_t *row)
+{
+	uint64_t key;
+	char *end;
+	double d = strtod(row->chars, &end);
+	if (end == row->chars || d == 0) d = 0;		/* заодно -0 == 0 */
+	memcpy(&key, &d, sizeof(key));
+	return (key >> 63) ? ~key : key | (1ULL << 63);
+}
+
+/*
+ * @brief		Считает ключи строк куска task
+ */
+void editorSortKeys(void *ctx, int task)
+{
+	editor_sort_t *s = ctx;
+	int lo = task * s->run;
+	int hi = (lo + s->run < s->n) ? lo + s->run : s->n;
+
+	for (int j = lo; j < hi; j++) {
+		editor_row_t *row = &s->rows[j];
+		uint64_t key = 0;
+
+		if (s->numeric) {
+			key = editorSortNumericKey(row);
+		} else {
+			for (int i = 0; i < 8; i++)
+				key = (key << 8) | (i < row->size ? (unsigned char) row->chars[i] : 0);
+		}
+		s->item[j].key = key;
+		s->item[j].row = j;
+	}
+}
+
+/*
+ * @brief		Сортирует кусок task: вставками по SORT_INSERTION, затем слияниями
+ */
+void editorSortChunk(void *ctx, int task)
+{
+	editor_sort_t *s = ctx;
+	int lo = task * s->run;
+	int hi = (lo + s->run < s->n) ? lo + s->run : s->n;
+
+	for (int a = lo; a < hi; a += SORT_INSERTION) {
+		int b = (a + SORT_INSERTION < hi) ? a + SORT_INSERTION : hi;
+		for (int i = a + 1; i < b; i++) {
+			editor_sort_item_t v = s->item[i];
+			int j = i;
+			for (; j > a && editorSortCompare(s, &v, &s->item[j - 1]) < 0; j--)
+				s->item[j] = s->item[j - 1];
+			s->item[j] = v;
+		}
+	}
+
+	editor_sort_item_t *src = s->item, *dst = s->tmp;
+	for (int w = SORT_INSERTION; w < hi - lo; w *= 2) {
+		for (int a = lo; a < hi; a += 2 * w) {
+			int m = (a + w < hi) ? a + w : hi;
+			int b = (a + 2 * w < hi) ? a + 2 * w : hi;
+			editorSortMerge(s, src + a, m - a, src + m, b - m, dst + a);
+		}
+		editor_sort_item_t *t = src; src = dst; dst = t;
+	}
+	if (src != s->item) memcpy(s->item + lo, src + lo, sizeof(editor_sort_item_t) * (hi - lo));
+}
+
+/*
+ * @brief		Часть слияния двух соседних кусков: делит выход на равные доли,
+ *				границы долей находятся двоичным поиском
+ */
+void editorSortMergeTask(void *ctx, int task)
+{
+	editor_sort_t *s = ctx;
+	int pair = task / s->parts, part = task % s->parts;
+
+	int lo = pair * 2 * s->run;
+	int mid = (lo + s->run < s->n) ? lo + s->run : s->n;
+	int hi = (mid + s->run < s->n) ? mid + s->run : s->n;
+	long long len = hi - lo;
+	int k0 = len * part / s->parts, k1 = len * (part + 1) / s->parts;
+
+	const editor_sort_item_t *a = s->item + lo, *b = s->item + mid;
+	int i0 = editorSortSplit(s, a, mid - lo, b, hi - mid, k0);
+	int i1 = editorSortSplit(s, a, mid - lo, b, hi - mid, k1);
+	editorSortMerge(s, a + i0, i1 - i0, b + k0 - i0, (k1 - i1) - (k0 - i0), s->tmp + lo + k0);
+}
+
+/*
+ * @brief		Стабильная сортировка строк в нескольких потоках
+ * @return		Перестановка: perm[i] -- прежний номер строки, встающей на место i
+ */
+int *editorSortRows(int numeric, int reverse)
+{
+	editor_sort_t s = { E.buf->row, numeric, reverse, E.buf->num_rows, NULL, NULL, 0, 1 };
+	int threads = editorParallelThreads(s.n);
+
+	s.item = malloc(sizeof(editor_sort_item_t) * (s.n ? s.n : 1));
+	s.tmp = malloc(sizeof(editor_sort_item_t) * (s.n ? s.n : 1));
+	s.run = (s.n + threads - 1) / threads;
+
+	editorParallel(threads, threads, editorSortKeys, &s);
+	editorParallel(threads, threads, editorSortChunk, &s);
+
+	/* каждое слияние делится на доли, чтобы потоков хватало и на последних кругах */
+	for (; s.run < s.n; s.run *= 2) {
+		int pairs = (s.n + 2 * s.run - 1) / (2 * s.run);
+		s.parts = (threads > pairs) ? (threads + pairs - 1) / pairs : 1;
+		editorParallel(threads, pairs * s.parts, editorSortMergeTask, &s);
+		editor_sort_item_t *t = s.item; s.item = s.tmp; s.tmp = t;
+	}
+
+	int *perm = (int *) s.tmp;		/* int не шире пары, перестановка ложится в тот же блок */
+	for (int j = 0; j < s.n; j++)
+		perm[j] = s.item[j].row;
+	free(s.item);
+
+	/* перестановка живёт в журнале отмены: лишнее место пар отдаётся обратно */
+	return realloc(perm, sizeof(int) * (s.n ? s.n : 1));
+}
+
+/*
+ * @brief		Сбрасывает производные данные после перестановки или удаления многих строк
+ */
+void editorRowsReordered()
+{
+	editor_buffer_t *b = E.buf;
+
+	b->wrap_valid = 0;
+	b->offset_valid = 0;
+	b->bracket_valid = 0;
+	for (int j = 0; j < b->num_rows; j++)
+		b->row[j].idx = j;
+	editorOffsetReset();
+	editorRenderLogRebuild();
+
+	/*
+	 * Подсветка строки зависит от соседей только через многострочные
+	 * комментарии. Если они есть, подсветка выбрасывается целиком и
+	 * досчитывается по мере того, как строки попадают на экран.
+	 */
+	if (b->syntax && b->syntax->multiline_comment_start && b->syntax->multiline_comment_end && b->num_rows) {
+		for (int j = 0; j < b->num_rows; j++) {
+			editorRowDropRender(b, &b->row[j]);
+			b->row[j].brackets.low_after = BRACKET_UNKNOWN;
+		}
+		b->hl_stale = 0;
+	}
+
+	if (b->num_rows) {
+		editorDiffTouch(0, 0);
+		editorDiffTouch(b->num_rows - 1, 0);
+	}
+	b->dirty++;
+	editorClampCursor();
+}
+
+/*
+ * @brief		Переставляет строки на месте: на место i встаёт строка perm[i]
+ * @param perm	Перестановка; владение переходит журналу отмены
+ */
+void editorRowsPermute(int *perm)
+{
+	int n = E.buf->num_rows;
+	editorJournalOp(UNDO_PERMUTE_ROWS, 0, 0, (const char *) perm, n * sizeof(int));
+
+	unsigned char *done = calloc(n ? n : 1, 1);
+	for (int i = 0; i < n; i++) {
+		if (done[i]) continue;
+
+		editor_row_t first = E.buf->row[i];
+		int j = i;
+		while (1) {
+			done[j] = 1;
+			int k = perm[j];
+			if (k == i) {
+				E.buf->row[j] = first;
+				break;
+			}
+			E.buf->row[j] = E.buf->row[k];
+			j = k;
+		}
+	}
+	free(done);
+
+	if (!editorUndoPush(UNDO_PERMUTE_ROWS, 0, 0, (char *) perm, n)) free(perm);
+	editorRowsReordered();
+}
+
+/*
+ * @brief		Возвращает строкам порядок до перестановки perm
+ */
+void editorRowsUnpermute(const int *perm, int n)
+{
+	int *inv = malloc(sizeof(int) * (n ? n : 1));
+	for (int i = 0; i < n; i++) inv[perm[i]] = i;
+	editorRowsPermute(inv);
+}
 
-void editorFindCallback(char *query, int key)
+/*
+ * @brief		Удаляет строки с keep[j] == 0 одним проходом по массиву
+ * @return		Сколько строк удалено
+ */
+int editorRowsFilter(const unsigned char *keep)
 {
-	static int last_match = -1;
-	static int direction = 1;
+	int n = E.buf->num_rows, dropped = 0;
+	for (int j = 0; j < n; j++) dropped += !keep[j];
+	if (dropped == 0) return 0;
+
+	int *where = malloc(sizeof(int) * dropped);
+	editor_span_t *spans = E.buf->undo_suspend ? NULL : malloc(sizeof(editor_span_t) * dropped);
+	int k = 0, out = 0;
+
+	for (int j = 0; j < n; j++) {
+		editor_row_t *row = &E.buf->row[j];
+		if (keep[j]) {
+			E.buf->row[out++] = *row;
+			continue;
+		}
 
-	static int saved_hl_line;
-	static char *saved_hl = NULL;
+		where[k] = j;
+		editorRowDropRender(E.buf, row);
+		if (spans) {
+			spans[k] = (editor_span_t) { row->chars, row->size, row->block };
+		} else if (row->block) {
+			editorBlockRelease(row->block);
+		} else {
+			free(row->chars);
+		}
+		k++;
+	}
+	E.buf->num_rows = out;
 
-	if (saved_hl) {
-		memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].render_size);
-		free(saved_hl);
-		saved_hl = NULL;
+	editorJournalOp(UNDO_FILTER_ROWS, 0, 0, (const char *) where, dropped * sizeof(int));
+	if (spans && editorUndoPush(UNDO_FILTER_ROWS, 0, 0, (char *) where, dropped))
+		editorUndoAttachSpans(spans);
+	else
+		free(where);
+
+	editorRowsReordered();
+	return dropped;
+}
+
+/*
+ * @brief		Возвращает на прежние места строки, удалённые фильтром
+ * @param where	Прежние номера строк по возрастанию
+ * @param spans	Их текст; владение переходит буферу
+ */
+void editorRowsUnfilter(const int *where, editor_span_t *spans, int count)
+{
+	int n = E.buf->num_rows + count;
+	editorRowsReserve(n);
+
+	/* массив заполняется с конца, строки сдвигаются не больше одного раза */
+	int i = E.buf->num_rows - 1, k = count - 1;
+	for (int t = n - 1; t >= 0; t--) {
+		if (k >= 0 && where[k] == t) {
+			editorInitRow(&E.buf->row[t], t, spans[k].s, spans[k].len, spans[k].block);
+			editorRowMeasure(&E.buf->row[t]);
+			k--;
+		} else {
+			E.buf->row[t] = E.buf->row[i--];
+		}
 	}
+	E.buf->num_rows = n;
 
-	if (key == '\r' || key == '\x1b') {
-		last_match = -1;
-		direction = -1;
+	for (k = 0; k < count; k++)
+		editorJournalOp(UNDO_INSERT_ROW, where[k], 0, E.buf->row[where[k]].chars, E.buf->row[where[k]].size);
+	editorRowsReordered();
+}
+
+typedef struct editor_filter_s {
+	editor_row_t *rows;
+	int n;
+	int chunk;
+	unsigned char *keep;
+	const char *pattern;	/* NULL -- убрать повторы соседних строк */
+	int drop;
+	int numeric;			/* повтором считается строка с тем же числом, как в sort -n */
+} editor_filter_t;
+
+void editorFilterChunk(void *ctx, int task)
+{
+	editor_filter_t *f = ctx;
+	int lo = task * f->chunk;
+	int hi = (lo + f->chunk < f->n) ? lo + f->chunk : f->n;
+
+	if (f->pattern == NULL && f->numeric) {
+		uint64_t prev = (lo > 0) ? editorSortNumericKey(&f->rows[lo - 1]) : 0;
+		for (int j = lo; j < hi; j++) {
+			uint64_t key = editorSortNumericKey(&f->rows[j]);
+			f->keep[j] = (j == 0 || key != prev);
+			prev = key;
+		}
 		return;
-	} else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-		direction = 1;
-	} else if (key == ARROW_LEFT || key == ARROW_UP) {
-		direction = -1;
+	}
+	if (f->pattern == NULL) {
+		for (int j = lo; j < hi; j++) {
+			editor_row_t *row = &f->rows[j];
+			f->keep[j] = (j == 0 || row->size != row[-1].size || memcmp(row->chars, row[-1].chars, row->size));
+		}
+		return;
+	}
+
+	/* рабочая память регулярного выражения у каждого потока своя */
+	editor_regex_t *re = regexCompile(f->pattern);
+	for (int j = lo; j < hi; j++) {
+		editor_match_t m;
+		f->keep[j] = regexSearch(re, &f->rows[j], 1, 0, 0, REGEX_ONE_ROW, &m) != f->drop;
+	}
+	regexFree(re);
+}
+
+/*
+ * @brief		Проверяет строки в нескольких потоках и удаляет отсеянные
+ * @return		Количество удалённых строк
+ */
+int editorFilterRun(editor_filter_t *f)
+{
+	int threads = editorParallelThreads(f->n);
+
+	f->keep = malloc(f->n ? f->n : 1);
+	f->chunk = (f->n + threads - 1) / threads;
+	editorParallel(threads, threads, editorFilterChunk, f);
+
+	int dropped = editorRowsFilter(f->keep);
+	free(f->keep);
+	return dropped;
+}
+
+/*
+ * @brief		Оставляет строки, подходящие (или не подходящие) под pattern,
+ *				а при pattern == NULL убирает повторы соседних строк
+ */
+int editorFilterRows(const char *pattern, int drop)
+{
+	editor_filter_t f = { E.buf->row, E.buf->num_rows, 0, NULL, pattern, drop, 0 };
+	return editorFilterRun(&f);
+}
+
+/*
+ * @brief		Убирает повторы соседних строк; при numeric повторы -- строки
+ *				с равным числовым ключом, как у sort -n -u
+ */
+int editorUniqRows(int numeric)
+{
+	editor_filter_t f = { E.buf->row, E.buf->num_rows, 0, NULL, NULL, 0, numeric };
+	return editorFilterRun(&f);
+}
+
+void editorTransformLines()
+{
+	if (!editorCheckWritable()) return;
+
+	char *cmd = editorPrompt("Lines: sort [-r] [-n] [-u] | uniq | keep RE | drop RE: %s (ESC to cancel)", NULL);
+	if (cmd == NULL) return;
+
+	long long start = editorNowMs();
+	int rows = E.buf->num_rows;
+
+	if (!strncmp(cmd, "keep ", 5) || !strncmp(cmd, "drop ", 5)) {
+		editor_regex_t *re = regexCompile(cmd + 5);
+		if (re == NULL) {
+			editorSetStatusMessage("Bad regular expression: %s", cmd + 5);
+		} else {
+			regexFree(re);
+			int dropped = editorFilterRows(cmd + 5, cmd[0] == 'd');
+			editorSetStatusMessage("%d of %d lines removed (%lld ms)", dropped, rows, editorNowMs() - start);
+		}
+	} else if (!strcmp(cmd, "uniq")) {
+		int dropped = editorFilterRows(NULL, 0);
+		editorSetStatusMessage("%d duplicate lines removed (%lld ms)", dropped, editorNowMs() - start);
+	} else if (!strncmp(cmd, "sort", 4) && (cmd[4] == '\0' || cmd[4] == ' ')) {
+		int numeric = 0, reverse = 0, unique = 0, bad = 0;
+		for (char *p = cmd + 4; *p; p++) {
+			if (*p == ' ' || *p == '-') continue;
+			if (*p == 'n') numeric = 1;
+			else if (*p == 'r') reverse = 1;
+			else if (*p == 'u') unique = 1;
+			else bad = 1;
+		}
+
+		if (bad) {
+			editorSetStatusMessage("Unknown sort option: %s", cmd);
+		} else {
+			editorRowsPermute(editorSortRows(numeric, reverse));
+			int dropped = unique ? editorUniqRows(numeric) : 0;
+			editorSetStatusMessage("%d lines sorted%s (%lld ms)", rows - dropped,
+									unique ? ", duplicates removed" : "", editorNowMs() - start);
+		}
 	} else {
-		last_match = -1;
-		direction = -1;
+		editorSetStatusMessage("Unknown command: %s", cmd);
 	}
+	free(cmd);
+}
 
-	if (last_match == -1) 
-		direction = 1;
-	
-	int current = last_match;
-	int i;
-	for (i = 0; i < E.num_rows; i++) {
-		current += direction;
-		
-		if (current == -1) {
-			current = E.num_rows - 1;
-		} else if (current == E.num_rows) {
-			current = 0;
+/* *** Project search *** */
+
+/*
+ * Поиск по всем файлам каталога (^_, на большинстве терминалов это Ctrl-/).
+ * Пул потоков обходит дерево: каталоги раскладываются в общую очередь путей,
+ * файлы читаются кусками по целым строкам и просматриваются тем же memmem,
+ * что и в поиске по буферу, -- для регулярного выражения им ищется его
+ * литеральный префикс, а движок запускается только на строках с кандидатом.
+ * Файлы не отображаются в память: укороченный во время поиска файл дал бы
+ * SIGBUS в потоке поиска.
+ * Найденные строки собираются в пачки того же вида, что и при фоновой
+ * загрузке, и главный поток добавляет их в буфер результатов, пока ждёт
+ * ввода. Enter на строке результата открывает файл на месте совпадения.
+ */
+
+#define GREP_MIN_THREADS 4			/* чтение с диска тоже идёт параллельно */
+#define GREP_MAX_MATCHES 200000
+#define GREP_LINE_MAX 240			/* длиннее текст строки в результатах обрезается */
+#define GREP_BATCH_LINES 4096
+#define GREP_CHUNK (1 << 20)
+
+struct editor_grep_s {
+	char *pattern;
+	int regex;
+	char *root;
+	pthread_t thread[PARALLEL_MAX_THREADS];
+	int num_threads;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	char **queue;					/* под lock: пути, которые ещё предстоит просмотреть */
+	int queue_len;
+	int queue_cap;
+	int busy;						/* под lock: потоков, занятых путём из очереди */
+	int cancel;						/* под lock */
+	int exited;						/* под lock: потоков, закончивших работу */
+	load_batch_t *head, *tail;		/* под lock */
+	long long files;				/* под lock: просмотрено файлов */
+	long long matches;				/* под lock */
+	int running;					/* потоки ещё не собраны */
+	long long start_ms;
+};
+
+/* Результаты одного потока, ещё не отданные в очередь */
+typedef struct grep_out_s {
+	char *text;
+	int len;
+	int cap;
+	int *start;
+	int num;
+	int num_cap;
+} grep_out_t;
+
+void editorGrepPush(editor_grep_t *g, char *path)
+{
+	pthread_mutex_lock(&g->lock);
+	if (g->queue_len == g->queue_cap) {
+		g->queue_cap = g->queue_cap ? g->queue_cap * 2 : 256;
+		g->queue = realloc(g->queue, sizeof(char *) * g->queue_cap);
+	}
+	g->queue[g->queue_len++] = path;
+	pthread_cond_signal(&g->cond);
+	pthread_mutex_unlock(&g->lock);
+}
+
+int editorGrepCancelled(editor_grep_t *g)
+{
+	pthread_mutex_lock(&g->lock);
+	int cancel = g->cancel;
+	pthread_mutex_unlock(&g->lock);
+	return cancel;
+}
+
+/*
+ * @brief		Отдаёт накопленные строки результатов главному потоку одной пачкой
+ * @return		0, если поиск пора прекратить
+ */
+int editorGrepFlush(editor_grep_t *g, grep_out_t *out)
+{
+	if (out->num == 0) return !editorGrepCancelled(g);
+
+	load_batch_t *batch = calloc(1, sizeof(load_batch_t));
+	batch->block = editorBlockNew(out->len);
+	memcpy(batch->block->data, out->text, out->len);
+	batch->s = malloc(sizeof(char *) * out->num);
+	batch->len = malloc(sizeof(int) * out->num);
+	batch->num = batch->cap = out->num;
+	for (int j = 0; j < out->num; j++) {
+		int end = (j + 1 < out->num) ? out->start[j + 1] : out->len;
+		batch->s[j] = batch->block->data + out->start[j];
+		batch->len[j] = end - out->start[j] - 1;		/* без завершающего '\0' */
+	}
+	out->len = 0;
+	out->num = 0;
+
+	pthread_mutex_lock(&g->lock);
+	if (g->tail) g->tail->next = batch;
+	else g->head = batch;
+	g->tail = batch;
+	g->matches += batch->num;
+	if (g->matches >= GREP_MAX_MATCHES) g->cancel = 1;
+	int cancel = g->cancel;
+	pthread_mutex_unlock(&g->lock);
+	return !cancel;
+}
+
+/*
+ * @brief		Добавляет строку результата "путь:строка:колонка: текст"
+ */
+void editorGrepEmit(grep_out_t *out, const char *path, long long line, long long col,
+					const char *s, size_t len)
+{
+	int cut = (len > GREP_LINE_MAX);
+	if (cut) len = GREP_LINE_MAX;
+	if (len && s[len - 1] == '\r') len--;
+
+	int need = strlen(path) + len + 64;
+	if (out->len + need > out->cap) {
+		while (out->len + need > out->cap) out->cap = out->cap ? out->cap * 2 : 65536;
+		out->text = realloc(out->text, out->cap);
+	}
+	if (out->num == out->num_cap) {
+		out->num_cap = out->num_cap ? out->num_cap * 2 : 256;
+		out->start = realloc(out->start, sizeof(int) * out->num_cap);
+	}
+	out->start[out->num++] = out->len;
+
+	char *p = out->text + out->len;
+	p += sprintf(p, "%s:%lld:%lld: ", path, line, col);
+	memcpy(p, s, len);
+	p += len;
+	if (cut) p += sprintf(p, " ...");
+	*p++ = '\0';
+	out->len = p - out->text;
+}
+
+/*
+ * @brief		Ищет совпадения в куске файла из целых строк
+ * @param re	Регулярное выражение потока или NULL для поиска подстроки
+ * @param line	Номер первой строки куска; на выходе -- номер строки за ним
+ * @return		0, если поиск пора прекратить
+ */
+int editorGrepScan(editor_grep_t *g, editor_regex_t *re, const char *path,
+					const char *data, size_t size, long long *line_io, grep_out_t *out)
+{
+	const char *end = data + size;
+	const char *p = data;				/* начало строки, с которой продолжается поиск */
+	const char *counted = data;			/* до этого места строки уже посчитаны */
+	long long line = *line_io;
+	int candidates = 0;
+
+	const char *needle = re ? re->prefix : g->pattern;
+	size_t needle_len = re ? (size_t) re->prefix_len : strlen(g->pattern);
+
+	while (p < end) {
+		/* закрытие буфера или предел совпадений не ждут конца большого файла */
+		if (candidates++ % GREP_BATCH_LINES == 0 && editorGrepCancelled(g)) return 0;
+
+		/* кандидат -- вхождение подстроки или префикса, без него -- каждая строка */
+		const char *hit = p;
+		if (needle_len) {
+			hit = memmem(p, end - p, needle, needle_len);
+			if (hit == NULL) break;
 		}
-			
 
-		editor_row_t *row = &E.row[current];
-		char *match = strstr(row->render, query);
-		if (match) {
-			last_match = current;
-			E.cy = current;
-			E.cx = editorRowRxToCx(row, match - row->render);
-			E.row_offset = E.num_rows;
+		const char *bol = hit;
+		while (bol > p && bol[-1] != '\n') bol--;
+		const char *eol = memchr(hit, '\n', end - hit);
+		if (eol == NULL) eol = end;
+
+		while ((counted = memchr(counted, '\n', bol - counted))) {
+			counted++;
+			line++;
+		}
+		counted = bol;
+
+		long long col = hit - bol;
+		int found = 1;
+		if (re) {
+			editor_row_t row = { 0 };
+			editor_match_t m;
+			row.chars = (char *) bol;
+			row.size = eol - bol;
+			found = regexSearch(re, &row, 1, 0, 0, REGEX_ONE_ROW, &m);
+			col = m.col;
+		}
+		if (found) {
+			editorGrepEmit(out, path, line, col + 1, bol, eol - bol);
+			if (out->num >= GREP_BATCH_LINES && !editorGrepFlush(g, out)) return 0;
+		}
+		p = eol + 1;
+	}
+
+	while (counted < end && (counted = memchr(counted, '\n', end - counted))) {
+		counted++;
+		line++;
+	}
+	*line_io = line;
+	return 1;
+}
+
+/*
+ * @brief		Просматривает файл: двоичные и пустые пропускаются
+ */
+int editorGrepFile(editor_grep_t *g, editor_regex_t *re, const char *path, grep_out_t *out)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) return 1;
+
+	struct stat st;
+	int go_on = 1;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && !editorIsBinary(fd)) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		/* кусок обрезается по последнему '\n', хвост переносится в начало следующего */
+		size_t cap = GREP_CHUNK, have = 0;
+		char *buf = malloc(cap);
+		long long line = 1;
+		while (go_on) {
+			ssize_t n = read(fd, buf + have, cap - have);
+			if (n == -1 && errno == EINTR) continue;
+			if (n <= 0) {
+				if (have) go_on = editorGrepScan(g, re, path, buf, have, &line, out);
+				break;
+			}
+			have += n;
+
+			char *cut = memrchr(buf, '\n', have);
+			if (cut == NULL) {
+				if (have == cap) buf = realloc(buf, cap *= 2);
+				continue;
+			}
+			size_t used = cut + 1 - buf;
+			go_on = editorGrepScan(g, re, path, buf, used, &line, out);
+			memmove(buf, buf + used, have - used);
+			have -= used;
+		}
+		free(buf);
+	}
+	close(fd);
+
+	pthread_mutex_lock(&g->lock);
+	g->files++;
+	pthread_mutex_unlock(&g->lock);
+	return go_on;
+}
+
+/*
+ * @brief		Раскладывает содержимое каталога в очередь. Скрытые файлы и
+ *				каталоги (.git и подобные) и символические ссылки пропускаются.
+ */
+void editorGrepDir(editor_grep_t *g, const char *path)
+{
+	DIR *dir = opendir(path);
+	if (dir == NULL) return;
+
+	struct dirent *de;
+	while ((de = readdir(dir))) {
+		if (de->d_name[0] == '.') continue;
+
+		size_t len = strlen(path) + strlen(de->d_name) + 2;
+		char *child = malloc(len);
+		if (!strcmp(path, ".")) snprintf(child, len, "%s", de->d_name);
+		else if (path[strlen(path) - 1] == '/') snprintf(child, len, "%s%s", path, de->d_name);
+		else snprintf(child, len, "%s/%s", path, de->d_name);
+
+		int type = de->d_type;
+		if (type == DT_UNKNOWN) {
+			/* файл, исчезнувший между readdir и lstat, пропускается */
+			struct stat st;
+			if (lstat(child, &st) == -1) type = DT_LNK;
+			else if (S_ISDIR(st.st_mode)) type = DT_DIR;
+			else if (S_ISREG(st.st_mode)) type = DT_REG;
+			else type = DT_LNK;
+		}
+		if (type == DT_DIR || type == DT_REG) editorGrepPush(g, child);
+		else free(child);
+	}
+	closedir(dir);
+}
+
+void *editorGrepThread(void *arg)
+{
+	editor_grep_t *g = arg;
+	editor_regex_t *re = g->regex ? regexCompile(g->pattern) : NULL;
+	grep_out_t out = { 0 };
+
+	while (1) {
+		pthread_mutex_lock(&g->lock);
+		while (g->queue_len == 0 && g->busy > 0 && !g->cancel)
+			pthread_cond_wait(&g->cond, &g->lock);
+		if (g->cancel || g->queue_len == 0) {
+			pthread_cond_broadcast(&g->cond);
+			pthread_mutex_unlock(&g->lock);
+			break;
+		}
+		char *path = g->queue[--g->queue_len];
+		g->busy++;
+		pthread_mutex_unlock(&g->lock);
+
+		struct stat st;
+		int go_on = 1;
+		if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) editorGrepDir(g, path);
+		else go_on = editorGrepFile(g, re, path, &out) && editorGrepFlush(g, &out);
+		free(path);
+
+		pthread_mutex_lock(&g->lock);
+		g->busy--;
+		if (!go_on) g->cancel = 1;
+		if (g->busy == 0 || g->cancel) pthread_cond_broadcast(&g->cond);
+		pthread_mutex_unlock(&g->lock);
+	}
+
+	editorGrepFlush(g, &out);
+	free(out.text);
+	free(out.start);
+	regexFree(re);
+
+	pthread_mutex_lock(&g->lock);
+	g->exited++;
+	pthread_mutex_unlock(&g->lock);
+	return NULL;
+}
+
+/*
+ * @brief		Собирает потоки поиска и очищает очередь путей
+ */
+void editorGrepFinish(editor_grep_t *g)
+{
+	if (!g->running) return;
+
+	for (int j = 0; j < g->num_threads; j++)
+		pthread_join(g->thread[j], NULL);
+	for (int j = 0; j < g->queue_len; j++)
+		free(g->queue[j]);
+	free(g->queue);
+	g->queue = NULL;
+	g->queue_len = g->queue_cap = 0;
+	pthread_cond_destroy(&g->cond);
+	pthread_mutex_destroy(&g->lock);
+	g->running = 0;
+}
+
+/*
+ * @brief		Останавливает поиск и освобождает его состояние при закрытии буфера
+ */
+void editorGrepFree(editor_buffer_t *b)
+{
+	editor_grep_t *g = b->grep;
+	if (g == NULL) return;
+
+	if (g->running) {
+		pthread_mutex_lock(&g->lock);
+		g->cancel = 1;
+		pthread_cond_broadcast(&g->cond);
+		pthread_mutex_unlock(&g->lock);
+		editorGrepFinish(g);
+	}
+	while (g->head) {
+		load_batch_t *next = g->head->next;
+		editorLoadBatchFree(g->head);
+		g->head = next;
+	}
+	free(g->pattern);
+	free(g->root);
+	free(g);
+	b->grep = NULL;
+}
+
+int editorGrepping()
+{
+	for (int j = 0; j < E.num_buffers; j++) {
+		if (E.buffers[j]->grep && E.buffers[j]->grep->running) return 1;
+	}
+	return 0;
+}
+
+/*
+ * @brief		Добавляет в буферы результатов строки, найденные потоками поиска
+ * @return		1, если что-то было добавлено
+ */
+int editorGrepPoll()
+{
+	long long start = editorNowMs();
+	int progress = 0;
+	int redraw = 0;
+
+	for (int j = 0; j < E.num_buffers; j++) {
+		editor_buffer_t *b = E.buffers[j];
+		editor_grep_t *g = b->grep;
+		if (g == NULL || !g->running) continue;
+
+		pthread_mutex_lock(&g->lock);
+		load_batch_t *batch = g->head;
+		pthread_mutex_unlock(&g->lock);
+
+		editor_buffer_t *saved = E.buf;
+		E.buf = b;
+		b->undo_suspend++;
+		b->journal_suspend++;
+
+		while (batch && editorNowMs() - start < LOAD_SLICE_MS) {
+			for (; batch->pos < batch->num; batch->pos++)
+				editorAppendRowRef(batch->s[batch->pos], batch->len[batch->pos], batch->block);
+			progress = 1;
+			if (b == saved) redraw = 1;
+
+			load_batch_t *done = batch;
+			pthread_mutex_lock(&g->lock);
+			g->head = batch->next;
+			if (g->head == NULL) g->tail = NULL;
+			batch = g->head;
+			pthread_mutex_unlock(&g->lock);
+
+			editorLoadBatchFree(done);
+		}
+
+		b->journal_suspend--;
+		b->undo_suspend--;
+		b->dirty = 0;
+		E.buf = saved;
+
+		pthread_mutex_lock(&g->lock);
+		/* поиск без потоков прошёл сразу: exited == 1 при num_threads == 0 */
+		int finished = (g->exited >= g->num_threads && g->head == NULL);
+		long long files = g->files;
+		int truncated = (g->matches >= GREP_MAX_MATCHES);
+		pthread_mutex_unlock(&g->lock);
+
+		if (finished) {
+			editorGrepFinish(g);
+			editorSetStatusMessage("%d matches in %lld files (%lld ms)%s", b->num_rows, files,
+									editorNowMs() - g->start_ms, truncated ? ", stopped at the limit" : "");
+			redraw = 1;
+		}
+	}
+
+	if (redraw) editorScheduleRedraw();
+	return progress;
+}
+
+/*
+ * @brief		Запускает поиск pattern в файлах под root в новом буфере результатов
+ */
+void editorGrepStart(const char *pattern, int regex, const char *root)
+{
+	editor_grep_t *g = calloc(1, sizeof(editor_grep_t));
+	g->pattern = strdup(pattern);
+	g->regex = regex;
+	g->root = strdup(root);
+	g->start_ms = editorNowMs();
+	g->running = 1;
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->cond, NULL);
+	editorGrepPush(g, strdup(root));
+
+	editorBufferAdd()->grep = g;
+	editorSwitchBuffer(editorBufferIndex(E.buf));
+
+	int threads = editorCpuCount();
+	if (threads < GREP_MIN_THREADS) threads = GREP_MIN_THREADS;
+	for (int j = 0; j < threads; j++) {
+		if (pthread_create(&g->thread[g->num_threads], NULL, editorGrepThread, g) == 0)
+			g->num_threads++;
+	}
+	/* без потоков поиск выполняется сразу */
+	if (g->num_threads == 0) editorGrepThread(g);
+}
+
+char grep_prompt[80];
+
+void editorGrepUpdatePrompt()
+{
+	snprintf(grep_prompt, sizeof(grep_prompt), "Search in files%s: %%s (ESC to cancel, ^E regex)",
+				(find_mode & FIND_REGEX) ? " [re]" : "");
+}
+
+void editorGrepCallback(char *query, int key)
+{
+	(void) query;
+	if (key == CTRL_KEY('e')) {
+		find_mode ^= FIND_REGEX;
+		editorGrepUpdatePrompt();
+	}
+}
+
+void editorProjectSearch()
+{
+	editorGrepUpdatePrompt();
+	char *query = editorPrompt(grep_prompt, editorGrepCallback);
+	if (query == NULL) return;
+
+	if (find_mode & FIND_REGEX) {
+		editor_regex_t *re = regexCompile(query);
+		if (re == NULL) {
+			editorSetStatusMessage("Bad regex: %s", query);
+			free(query);
+			return;
+		}
+		regexFree(re);
+	}
+
+	char *root = editorPromptEx("Directory: %s (empty for current)", NULL, 1);
+	if (root) {
+		editorGrepStart(query, (find_mode & FIND_REGEX) != 0, root[0] ? root : ".");
+		free(root);
+	}
+	free(query);
+}
+
+/*
+ * @brief		Открывает файл из строки результата под курсором на месте совпадения
+ */
+void editorGrepOpen()
+{
+	if (E.buf->cy >= E.buf->num_rows) return;
+
+	/* строка имеет вид "путь:строка:колонка: текст", двоеточие может быть и в пути */
+	editor_row_t *row = &E.buf->row[E.buf->cy];
+	char *path = NULL;
+	int line = 0, col = 0;
+	for (char *p = row->chars; (p = strchr(p, ':')); p++) {
+		if (sscanf(p, ":%d:%d:", &line, &col) == 2) {
+			path = strndup(row->chars, p - row->chars);
+			break;
+		}
+	}
+	if (path == NULL) return;
+
+	editorOpenBuffer(path);
+	if (E.buf->file_name && !strcmp(E.buf->file_name, path) && !E.buf->hex) {
+		/* строка большого файла может быть ещё не загружена, тогда курсор встанет на неё позже */
+		E.buf->goto_row = (line > 0) ? line - 1 : 0;
+		E.buf->goto_col = (col > 0) ? col - 1 : 0;
+		editorLoadGoTo(E.buf);
+		if (E.buf->goto_row >= 0) editorSetStatusMessage("Loading up to line %d...", line);
+	}
+	free(path);
+}
+
+/* *** Macros *** */
+
+/*
+ * Клавиатурный макрос -- записанная последовательность клавиш, которая
+ * проигрывается через тот же editorProccessKeypress, что и обычный ввод:
+ * editorReadKey отдаёт клавиши макроса вместо терминала. Во время проигрывания
+ * экран не перерисовывается, а подсветка изменённых строк откладывается и
+ * выполняется одним проходом в конце, так что все повторы стоят как один.
+ */
+
+void editorMacroRecordKey(int c)
+{
+	if (macro_len == macro_cap) {
+		macro_cap = macro_cap ? macro_cap * 2 : 64;
+		macro_keys = realloc(macro_keys, sizeof(int) * macro_cap);
+	}
+	macro_keys[macro_len++] = c;
+}
+
+/*
+ * @brief		Отдаёт следующую клавишу макроса. Если макрос кончился
+ *				посреди диалога, возвращает ESC, чтобы диалог закрылся.
+ */
+int editorMacroNextKey()
+{
+	if (macro_pos < macro_len) return macro_keys[macro_pos++];
+	return '\x1b';
+}
+
+void editorMacroToggleRecord()
+{
+	if (macro_pos >= 0) return;
+
+	if (!macro_recording) {
+		macro_len = 0;
+		macro_recording = 1;
+		editorSetStatusMessage("Recording macro... ^T to stop");
+	} else {
+		macro_recording = 0;
+		macro_len--;		/* сама клавиша остановки */
+		editorSetStatusMessage("Macro recorded: %d keys", macro_len);
+	}
+}
+
+/*
+ * @brief		Откладывает подсветку строки до конца проигрывания
+ */
+void editorSyntaxDefer(int at)
+{
+	if (E.buf->hl_to < 0) {
+		E.buf->hl_from = E.buf->hl_to = at;
+		return;
+	}
+	if (at < E.buf->hl_from) E.buf->hl_from = at;
+	if (at > E.buf->hl_to) E.buf->hl_to = at;
+}
+
+/*
+ * @brief		Сдвигает отложенный диапазон подсветки при вставке (+1) или удалении (-1) строки at
+ */
+void editorSyntaxDeferShift(int at, int delta)
+{
+	if (E.buf->hl_to < 0) return;
+	if (at < E.buf->hl_from) E.buf->hl_from += delta;
+	if (at <= E.buf->hl_to) E.buf->hl_to += delta;
+	if (E.buf->hl_from < 0) E.buf->hl_from = 0;
+	if (delta < 0) editorSyntaxDefer(at);
+}
+
+void editorSyntaxFlushDeferred()
+{
+	editor_buffer_t *saved = E.buf;
+
+	for (int j = 0; j < E.num_buffers; j++) {
+		E.buf = E.buffers[j];
+		int from = E.buf->hl_from;
+		int to = E.buf->hl_to;
+		E.buf->hl_from = E.buf->hl_to = -1;
+
+		if (to >= E.buf->num_rows) to = E.buf->num_rows - 1;
+		if (to >= from && from >= 0)
+			editorUpdateSyntaxRows(from, to, NULL);
+	}
+	E.buf = saved;
+}
+
+/*
+ * @brief		Проигрывает макрос один раз с текущей позиции курсора
+ */
+void editorMacroRun()
+{
+	macro_pos = 0;
+	while (macro_pos < macro_len)
+		editorProccessKeypress();
+	macro_pos = -1;
+}
+
+int editorMacroReady()
+{
+	if (macro_recording) {
+		editorSetStatusMessage("Stop recording (^T) before playing the macro");
+		return 0;
+	}
+	if (macro_len == 0) {
+		editorSetStatusMessage("No macro recorded (^T to record)");
+		return 0;
+	}
+	return editorCheckWritable();
+}
 
-			saved_hl_line = current;
-			saved_hl = malloc(row->render_size);
-			memcpy(saved_hl, row->hl, row->render_size);
-			memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-			break;
+/*
+ * @brief		Проигрывает макрос times раз или на каждой строке, где находится
+ *				совпадение с re. Всё проигрывание -- одна группа отмены.
+ */
+void editorMacroPlay(int times, editor_regex_t *re)
+{
+	E.render_suspend++;
+	E.hl_defer++;
+
+	int runs = 0;
+	if (re == NULL) {
+		for (; runs < times; runs++)
+			editorMacroRun();
+	} else {
+		/* строки, добавленные или удалённые макросом, считаются относящимися к текущей */
+		editor_match_t m;
+		for (int j = 0; j < E.buf->num_rows; j++) {
+			if (!regexSearch(re, E.buf->row, E.buf->num_rows, j, 0, REGEX_ONE_ROW, &m)) continue;
+
+			editor_buffer_t *b = E.buf;
+			int before = b->num_rows;
+			b->cy = j;
+			b->cx = 0;
+			editorMacroRun();
+			runs++;
+			if (E.buf != b) break;
+			j += b->num_rows - before;
 		}
 	}
+
+	E.hl_defer--;
+	editorSyntaxFlushDeferred();
+	E.render_suspend--;
+
+	editorClampCursor();
+	if (E.buf->wrap) E.buf->wrap_offset = INT_MAX;
+	editorSetStatusMessage("Macro applied %d time%s", runs, runs == 1 ? "" : "s");
 }
 
-void editorFind()
+/*
+ * @brief		Спрашивает, сколько раз проиграть макрос или к каким строкам его применить
+ */
+void editorMacroApply()
 {
-	int saved_cx = E.cx;
-	int saved_cy = E.cy;
-	int saved_colloff = E.col_offset;
-	int saved_rowoff = E.row_offset;
+	if (!editorMacroReady()) return;
 
-	char *query = editorPrompt("Search: %s (Use Esc/Arrows/Enter)", editorFindCallback);
-	if (query) {
-		free(query);
+	char *answer = editorPrompt("Apply macro: N times or /regex for matching lines: %s", NULL);
+	if (answer == NULL) return;
+
+	if (answer[0] == '/') {
+		editor_regex_t *re = regexCompile(answer + 1);
+		if (re == NULL) editorSetStatusMessage("Bad pattern: %s", answer + 1);
+		else editorMacroPlay(0, re);
+		regexFree(re);
 	} else {
-		E.cx = saved_cx;
-		E.cy = saved_cy;
-		E.col_offset = saved_colloff;
-		E.row_offset = saved_rowoff;
+		int times = atoi(answer);
+		if (times > 0) editorMacroPlay(times, NULL);
 	}
-
-	
+	free(answer);
 }
 
 /* *** Appending buffer *** */
@@ -803,48 +8205,200 @@ void abFree(struct abuf_s *ab)
  */
 void editorScroll()
 {
-	E.render_cx = 0;
+	index_len = editorGutterWidth();
+	E.buf->render_cx = 0;
+
+	if (E.buf->cy < E.buf->num_rows) {
+		E.buf->render_cx += editorRowCxToRx(&E.buf->row[E.buf->cy], E.buf->cx);
+	}
 
-	if (E.cy < E.num_rows) {
-		E.render_cx += editorRowCxToRx(&E.row[E.cy], E.cx);
+	if (E.buf->wrap) {
+		editorWrapScroll();
+		E.buf->render_cx += index_len;
+		return;
 	}
 
-	if (E.cy < E.row_offset) {
-		E.row_offset = E.cy;
+	if (E.buf->cy < E.buf->row_offset) {
+		E.buf->row_offset = E.buf->cy;
 	}
 
-	if (E.cy >= E.row_offset + E.screen_rows) {
-		E.row_offset = E.cy - E.screen_rows + 1;
+	if (E.buf->cy >= E.buf->row_offset + E.screen_rows) {
+		E.buf->row_offset = E.buf->cy - E.screen_rows + 1;
 	}
 
-	if (E.render_cx < E.col_offset) {
-		E.col_offset = E.render_cx;
+	if (E.buf->render_cx < E.buf->col_offset) {
+		E.buf->col_offset = E.buf->render_cx;
 	}
-	if (E.render_cx >= E.col_offset + E.screen_cols - index_len) {
-		E.col_offset = E.render_cx - E.col_offset + 1 ;
+	if (E.buf->render_cx >= E.buf->col_offset + E.screen_cols - index_len) {
+		E.buf->col_offset = E.buf->render_cx - (E.screen_cols - index_len) + 1;
 	}
-	E.render_cx += index_len;								//сдвигаем курсор на количество позиций, выделенных под номер строки
+	E.buf->render_cy = E.buf->cy - E.buf->row_offset;
+	E.buf->render_cx += index_len;								//сдвигаем курсор на количество позиций, выделенных под номер строки
 }
 
+struct render_pos_s {
+	int j;
+	int col;
+};
+
 void editorDrawRowNumber(struct abuf_s *bf, editor_row_t *row)
 {
-	char index_row[10];
+	char index_row[16];
+
+	int len = snprintf(index_row, sizeof(index_row), "%*d", index_len - 2, row->idx);
+	abAppend(bf, index_row, len);
+
+	char marker = E.buf->diff ? editorDiffMarker(row->idx) : '|';
+	if (marker == '|') {
+		abAppend(bf, "| ", 2);
+	} else {
+		int color = (marker == '+') ? 32 : (marker == '-') ? 31 : 33;
+		len = snprintf(index_row, sizeof(index_row), "\x1b[%dm%c\x1b[39m ", color, marker);
+		abAppend(bf, index_row, len);
+	}
+
+}
+
+/*
+ * @brief			Рисует avail колонок строки, начиная с колонки start_col
+ * @param pos		Позиция в render (байт и колонка), с которой начинается поиск
+ *					start_col; после вызова указывает на первый не нарисованный символ
+ */
+void editorDrawRowSegment(struct abuf_s *bf, editor_row_t *row, int start_col, int avail,
+							struct render_pos_s *pos)
+{
+	int j = pos->j, col = pos->col, out = 0;
+
+	if (row->ascii) {
+		j = col = (start_col < row->render_size) ? start_col : row->render_size;
+	} else {
+		if (col > start_col) {
+			j = col = 0;
+		}
+		while (j < row->render_size && col < start_col) {
+			int cp;
+			int n = utf8Decode(&row->render[j], row->render_size - j, &cp);
+			col += (cp == -1) ? 1 : utf8CharWidth(cp);
+			j += n;
+		}
+		/* широкий символ, разрезанный левой границей окна */
+		for (; col > start_col && out < avail; col--, out++)
+			abAppend(bf, " ", 1);
+	}
+
+	char *c = row->render;
+	unsigned char *hl = row->hl;
+	int current_color = -1;
+	int sel_from, sel_to, in_sel = 0;
+	editorSelectionRange(row, &sel_from, &sel_to);
+	while (j < row->render_size) {
+		int cp = (unsigned char) c[j];
+		int n = 1, w = 1;
+		if (cp >= 0x80) {
+			n = utf8Decode(&c[j], row->render_size - j, &cp);
+			w = (cp == -1) ? 1 : utf8CharWidth(cp);
+		}
+		if (out + w > avail) break;
+
+		int sel = (j >= sel_from && j < sel_to);
+		if (sel != in_sel) {
+			abAppend(bf, sel ? "\x1b[7m" : "\x1b[27m", sel ? 4 : 5);
+			in_sel = sel;
+		}
+
+		if (cp < 0x20 || cp == 0x7f || (cp >= 0x80 && cp < 0xa0) || cp == -1) {
+			char sym = (cp >= 0 && cp <= 26) ? '@' + cp : '?';
+			abAppend(bf, "\x1b[7m", 4);
+			abAppend(bf, &sym, 1);
+			abAppend(bf, "\x1b[m", 3);
+			if (in_sel) abAppend(bf, "\x1b[7m", 4);
+			if (current_color != -1) {
+				char buf[16];
+				int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+				abAppend(bf, buf, clen);
+			}
+		} else if (j == E.buf->bracket_at && row->idx == E.buf->bracket_row && !in_sel) {
+			abAppend(bf, "\x1b[7m", 4);
+			abAppend(bf, &c[j], n);
+			abAppend(bf, "\x1b[27m", 5);
+		} else if (hl[j] == HL_NORMAL) {
+			if (current_color != -1) {
+				abAppend(bf, "\x1b[39m", 5);
+				current_color = -1;
+			}
+			abAppend(bf, &c[j], n);
+		} else {
+			int color = editorSyntaxToColor(hl[j]);
+			if (color != current_color) {
+				current_color = color;
+				char buf[16];
+				int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+				abAppend(bf, buf, clen);
+			}
+			abAppend(bf, &c[j], n);
+		}
+		out += w;
+		col += w;
+		j += n;
+	}
+	if (in_sel) abAppend(bf, "\x1b[27m", 5);
+	abAppend(bf, "\x1b[39m", 5);
+
+	pos->j = j;
+	pos->col = col;
+}
+
+/*
+ * Кадр выводится построчно с явной установкой курсора, поэтому строки,
+ * которые уже стоят на экране, можно не выводить: это сильно сокращает
+ * вывод при прокрутке по одной строке, наборе текста и работе через сокет.
+ */
+
+void editorFrameInvalidate()
+{
+	if (E.frame_hash) memset(E.frame_hash, 0, sizeof(uint64_t) * E.frame_lines);
+}
 
-	index_len = snprintf(index_row, sizeof(index_row), "%4d| ", row->idx);
-	abAppend(bf, index_row, index_len);
+/*
+ * @brief		Начинает строку кадра y
+ * @return		Смещение начала строки в буфере вывода
+ */
+int editorFrameLineBegin(struct abuf_s *ab, int y)
+{
+	char buf[16];
+	int start = ab->len;
+	int len = snprintf(buf, sizeof(buf), "\x1b[%d;1H", y + 1);
+	abAppend(ab, buf, len);
+	return start;
+}
 
+/*
+ * @brief		Убирает строку кадра из вывода, если на экране уже она же
+ */
+void editorFrameLineEnd(struct abuf_s *ab, int y, int start)
+{
+	uint64_t hash = editorHashBytes(ab->b + start, ab->len - start);
+	if (E.frame_hash[y] == hash) ab->len = start;
+	else E.frame_hash[y] = hash;
 }
 
 void editorDrawRows(struct abuf_s *bf)
 {
 	int y;
+	int file_row = E.buf->row_offset;
+	int sub = 0;
+	int wrap_j = 0, wrap_col = 0;		/* начало текущей экранной строки при переносе */
+	struct render_pos_s pos = { 0, 0 };
+
+	if (E.buf->wrap) editorWrapLocate(E.buf->wrap_offset, &file_row, &sub);
 
 	for (y = 0; y < E.screen_rows; y++) {
+		int start = editorFrameLineBegin(bf, y);
 
-		int file_row = y + E.row_offset;
+		if (!E.buf->wrap) file_row = y + E.buf->row_offset;
 
-		if (file_row >= E.num_rows) {
-			if (E.num_rows == 0 && y == E.screen_rows / 3) {
+		if (file_row >= E.buf->num_rows) {
+			if (E.buf->num_rows == 0 && y == E.screen_rows / 3) {
 
 				char welcome[80];
 				int welcome_len = snprintf(welcome, sizeof(welcome), "Kupriyan-editor -- version %s", EDITOR_VERSION);
@@ -860,68 +8414,81 @@ void editorDrawRows(struct abuf_s *bf)
 			} else {
 				abAppend(bf, "~", 1);
 			}
-		} else {
-			editorDrawRowNumber(bf, &E.row[file_row]);
-			int len = E.row[file_row].render_size - E.col_offset;
+		} else if (!E.buf->wrap) {
+			editor_row_t *row = &E.buf->row[file_row];
+			editorRowEnsureRender(row);
+			editorDrawRowNumber(bf, row);
 
-			if (len < 0) {
-				len = 0;
-			}
-			if (len > E.screen_cols - index_len) {
-				len = E.screen_cols - index_len;
+			pos.j = pos.col = 0;
+			editorDrawRowSegment(bf, row, E.buf->col_offset, E.screen_cols - index_len, &pos);
+		} else {
+			editor_row_t *row = &E.buf->row[file_row];
+			int width = E.buf->wrap_width;
+
+			editorRowEnsureRender(row);
+			if (sub == 0) {
+				editorDrawRowNumber(bf, row);
+				pos.j = pos.col = 0;
+				wrap_j = wrap_col = 0;
+			} else {
+				for (int k = 0; k < index_len; k++) abAppend(bf, " ", 1);
+				/* окно начинается с середины строки файла */
+				if (y == 0)
+					for (int k = 0; k < sub; k++) editorWrapNext(row, width, &wrap_j, &wrap_col);
 			}
-			char *c = &E.row[file_row].render[E.col_offset];
-			unsigned char *hl = &E.row[file_row].hl[E.col_offset];
-			int current_color = -1;
-			int j;
-			for (j = 0; j < len; j++) {
-				if (iscntrl(c[j])) {
-					char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-					abAppend(bf, "\x1b[7m", 4);
-					abAppend(bf, &sym, 1);
-					abAppend(bf, "\x1b[m", 3);
-					if (current_color != -1) {
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
-						abAppend(bf, buf, clen);
-					}
-				} else if (hl[j] == HL_NORMAL) {
-					if (current_color != -1) {
-						abAppend(bf, "\x1b[39m", 5);
-						current_color = -1;
-					}
-					abAppend(bf, &c[j], 1);
-				} else {
-					int color = editorSyntaxToColor(hl[j]);
-					if (color != current_color) {
-						current_color = color;
-						char buf[16];
-						int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
-						abAppend(bf, buf, clen);
-					}
-					abAppend(bf, &c[j], 1);
-				}
+			editorDrawRowSegment(bf, row, wrap_col, width, &pos);
+
+			sub++;
+			if (!editorWrapNext(row, width, &wrap_j, &wrap_col)) {
+				sub = 0;
+				file_row++;
 			}
-			abAppend(bf, "\x1b[39m", 5);
 		}
 
 		abAppend(bf, "\x1b[K", 3);
-		abAppend(bf, "\r\n" , 2);
+		editorFrameLineEnd(bf, y, start);
 	}
 }
 
 void editorDrawStatusBar(struct abuf_s *ab) 
 {
+	int start = editorFrameLineBegin(ab, E.screen_rows);
 	abAppend(ab, "\x1b[7m", 4);
 
 	char status[80];
 	char rstatus[80];
 
-	int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-						E.file_name ? E.file_name : "[No name]", E.num_rows, 
-						E.dirty ? "(modified)" : "");
-	int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
-						E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.num_rows);
+	char bufnum[32] = "";
+	if (E.num_buffers > 1)
+		snprintf(bufnum, sizeof(bufnum), "[%d/%d] ", editorBufferIndex(E.buf) + 1, E.num_buffers);
+
+	char state[32] = "";
+	if (E.buf->loader)
+		snprintf(state, sizeof(state), "(loading %d%%)", editorLoadPercent(E.buf));
+	else if (E.buf->follow)
+		snprintf(state, sizeof(state), "(following)");
+	else if (E.buf->dirty)
+		snprintf(state, sizeof(state), "(modified)");
+
+	int len, rlen;
+	if (E.buf->hex) {
+		len = snprintf(status, sizeof(status), "%s%.20s - %llu bytes (hex)", bufnum,
+						E.buf->file_name, (unsigned long long) E.buf->hex_size);
+		rlen = snprintf(rstatus, sizeof(rstatus), "hex | 0x%llx/0x%llx %d%%",
+						(unsigned long long) E.buf->hex_cursor, (unsigned long long) E.buf->hex_size,
+						E.buf->hex_size ? (int) (E.buf->hex_cursor * 100 / E.buf->hex_size) : 100);
+	} else if (E.buf->grep) {
+		len = snprintf(status, sizeof(status), "%s[search] %.20s - %d matches %s", bufnum,
+						E.buf->grep->pattern, E.buf->num_rows, E.buf->grep->running ? "(searching)" : "");
+		rlen = snprintf(rstatus, sizeof(rstatus), "%.20s | %d/%d %d%%",
+						E.buf->grep->root, E.buf->cy + 1, E.buf->num_rows, editorCursorPercent());
+	} else {
+		len = snprintf(status, sizeof(status), "%s%.20s - %d lines %s", bufnum,
+						E.buf->file_name ? E.buf->file_name : "[No name]", E.buf->num_rows, state);
+		rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d %d%%",
+						E.buf->syntax ? E.buf->syntax->filetype : "no ft", E.buf->cy + 1, E.buf->num_rows,
+						editorCursorPercent());
+	}
 	if (len > E.screen_cols) len = E.screen_cols;
 	abAppend(ab, status, len);
 
@@ -930,65 +8497,458 @@ void editorDrawStatusBar(struct abuf_s *ab)
 		if (E.screen_cols - len == rlen) {
 			abAppend(ab, rstatus, rlen);
 			break;
-		} else {
-			abAppend(ab, " ", 1);
-			len++;
-		}
+		} else {
+			abAppend(ab, " ", 1);
+			len++;
+		}
+	}
+
+	abAppend(ab, "\x1b[m", 3);
+	editorFrameLineEnd(ab, E.screen_rows, start);
+}
+
+void editorDrawMessageBar(struct abuf_s *ab)
+{
+	int start = editorFrameLineBegin(ab, E.screen_rows + 1);
+	abAppend(ab, "\x1b[K", 3);
+	int msg_len = strlen(E.status_msg);
+
+	if (msg_len > E.screen_cols) msg_len = E.screen_cols;
+
+	if (msg_len && editorNowMs() - E.status_msg_ms < EDITOR_STATUS_MSG_MS) {
+		abAppend(ab, E.status_msg, msg_len);
+	}
+	editorFrameLineEnd(ab, E.screen_rows + 1, start);
+}
+
+void editorRefreshScreen()
+{
+	if (E.render_suspend) return;
+	if (E.server && E.client_fd < 0) {
+		E.redraw = 0;
+		return;
+	}
+
+	E.buf->last_view = ++E.view_clock;
+	editorEnforceMemoryBudget();
+
+	if (E.buf->hex) {
+		editorHexScroll();
+	} else {
+		editorScroll();
+		editorTrimRenderCache();
+		editorDiffUpdate();
+		editorBracketUpdateMatch();
+	}
+
+	if (E.frame_lines != E.screen_rows + 2) {
+		E.frame_lines = E.screen_rows + 2;
+		E.frame_hash = realloc(E.frame_hash, sizeof(uint64_t) * E.frame_lines);
+		editorFrameInvalidate();
+	}
+
+	struct abuf_s ab = ABUF_INIT;
+
+	abAppend(&ab, "\x1b[?25l", 6);
+
+	if (E.buf->hex) editorHexDrawRows(&ab);
+	else editorDrawRows(&ab);
+	editorDrawStatusBar(&ab);
+	editorDrawMessageBar(&ab);
+
+	int cursor_y = E.buf->render_cy;
+	int cursor_x = E.buf->render_cx - E.buf->col_offset;
+	if (E.buf->hex) editorHexCursor(&cursor_y, &cursor_x);
+
+	char buf[32];
+	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cursor_y + 1, cursor_x + 1);
+	abAppend(&ab, buf, strlen(buf));
+
+	abAppend(&ab, "\x1b[?25h", 6);
+
+	editorWriteOut(ab.b, ab.len);
+	abFree(&ab);
+
+	E.redraw = 0;
+	E.last_frame_ms = editorNowMs();
+}
+
+void editorSetStatusMessage(const char *fmt, ...)
+{
+	va_list arg_print;
+	va_start(arg_print, fmt);
+	vsnprintf(E.status_msg, sizeof(E.status_msg), fmt, arg_print);
+	va_end(arg_print);
+
+	E.status_msg_ms = editorNowMs();
+	E.status_msg_expiring = 1;
+	editorScheduleRedraw();
+}
+
+/* *** Hex view *** */
+
+/*
+ * Просмотр в шестнадцатеричном виде (^Y). Файл держится открытым только
+ * для чтения, и на каждый кадр из него читается лишь видимое окно: строка
+ * экрана -- смещение, 16 байт в hex и они же как ASCII. Строки буфера при
+ * этом не создаются, поэтому память не растёт с размером файла, а переход
+ * к любому смещению -- просто смена позиции курсора. Размер сверяется с
+ * диском перед каждым кадром, так что файл, укороченный другим процессом,
+ * просто показывается короче (отображение в память в этом случае
+ * обернулось бы SIGBUS). Файлы с нулевыми байтами в начале сразу
+ * открываются в этом режиме.
+ */
+
+#define HEX_ROW_BYTES 16
+#define HEX_SNIFF_SIZE 8192
+#define HEX_FIND_CHUNK (1 << 20)
+
+void editorHexClose(editor_buffer_t *b)
+{
+	if (b->hex_fd != -1) close(b->hex_fd);
+	b->hex_fd = -1;
+	b->hex_size = 0;
+}
+
+/*
+ * @brief		Сверяет размер с файлом на диске и не даёт курсору уйти за его конец
+ */
+void editorHexRefresh(editor_buffer_t *b)
+{
+	struct stat st;
+	if (b->hex_fd == -1 || fstat(b->hex_fd, &st) == -1) return;
+
+	b->hex_size = st.st_size;
+	if (b->hex_cursor >= b->hex_size) b->hex_cursor = b->hex_size ? b->hex_size - 1 : 0;
+}
+
+/*
+ * @brief		Открывает файл буфера заново, например после его замены на диске
+ */
+int editorHexOpen(editor_buffer_t *b)
+{
+	editorHexClose(b);
+
+	b->hex_fd = open(b->file_name, O_RDONLY | O_CLOEXEC);
+	if (b->hex_fd == -1) return -1;
+
+	if (b->hex_binary) editorDiskStamp(b, b->hex_fd);
+	editorHexRefresh(b);
+	return 0;
+}
+
+/*
+ * @brief		Считает файл двоичным, если в его начале есть нулевой байт
+ */
+int editorIsBinary(int fd)
+{
+	char buf[HEX_SNIFF_SIZE];
+	ssize_t n = pread(fd, buf, sizeof(buf), 0);
+	return n > 0 && memchr(buf, '\0', n) != NULL;
+}
+
+void editorToggleHex()
+{
+	editor_buffer_t *b = E.buf;
+
+	if (b->hex) {
+		if (b->hex_binary) {
+			editorSetStatusMessage("Binary file, text view is not available");
+			return;
+		}
+		editorHexClose(b);
+		b->hex = 0;
+		editorSetStatusMessage("Hex view off");
+		return;
+	}
+	if (b->file_name == NULL) {
+		editorSetStatusMessage("Hex view needs a file on disk");
+		return;
+	}
+
+	b->hex_cursor = editorRowOffset(b->cy) + (b->cy < b->num_rows ? b->cx : 0);
+	if (editorHexOpen(b) == -1) {
+		editorSetStatusMessage("Can't open %s: %s", b->file_name, strerror(errno));
+		return;
+	}
+	b->hex = 1;
+	editorSetStatusMessage("Hex view of %.30s on disk (read-only, ^Y to leave)", b->file_name);
+}
+
+int editorHexOffsetDigits()
+{
+	int digits = 8;
+	while (digits < 16 && (E.buf->hex_size >> (4 * digits)) != 0) digits++;
+	return digits;
+}
+
+void editorHexScroll()
+{
+	editor_buffer_t *b = E.buf;
+	editorHexRefresh(b);
+	size_t row = b->hex_cursor / HEX_ROW_BYTES;
+
+	if (row < b->hex_top) b->hex_top = row;
+	if (row >= b->hex_top + E.screen_rows) b->hex_top = row - E.screen_rows + 1;
+}
+
+void editorHexDrawRows(struct abuf_s *ab)
+{
+	editor_buffer_t *b = E.buf;
+	int digits = editorHexOffsetDigits();
+
+	/* файл мог укоротиться и после сверки размера: показывается то, что прочиталось */
+	size_t first = b->hex_top * HEX_ROW_BYTES;
+	size_t want = (size_t) E.screen_rows * HEX_ROW_BYTES;
+	unsigned char *window = malloc(want);
+	ssize_t got = (first < b->hex_size) ? pread(b->hex_fd, window, want, first) : 0;
+	size_t end = first + (got > 0 ? got : 0);
+
+	for (int y = 0; y < E.screen_rows; y++) {
+		int start = editorFrameLineBegin(ab, y);
+		size_t off = (b->hex_top + y) * HEX_ROW_BYTES;
+
+		if (off < end) {
+			char line[128];
+			int n = (end - off < HEX_ROW_BYTES) ? (int) (end - off) : HEX_ROW_BYTES;
+			const unsigned char *p = window + (off - first);
+
+			int len = snprintf(line, sizeof(line), "%0*llx  ", digits, (unsigned long long) off);
+			for (int i = 0; i < HEX_ROW_BYTES; i++) {
+				if (i < n) len += snprintf(line + len, sizeof(line) - len, "%02x ", p[i]);
+				else len += snprintf(line + len, sizeof(line) - len, "   ");
+				if (i == HEX_ROW_BYTES / 2 - 1) line[len++] = ' ';
+			}
+			line[len++] = '|';
+			for (int i = 0; i < n; i++)
+				line[len++] = (p[i] >= 0x20 && p[i] < 0x7f) ? p[i] : '.';
+			line[len++] = '|';
+
+			abAppend(ab, line, (len > E.screen_cols) ? E.screen_cols : len);
+		} else {
+			abAppend(ab, "~", 1);
+		}
+
+		abAppend(ab, "\x1b[K", 3);
+		editorFrameLineEnd(ab, y, start);
+	}
+	free(window);
+}
+
+void editorHexCursor(int *y, int *x)
+{
+	int i = E.buf->hex_cursor % HEX_ROW_BYTES;
+	*y = E.buf->hex_cursor / HEX_ROW_BYTES - E.buf->hex_top;
+	*x = editorHexOffsetDigits() + 2 + i * 3 + (i >= HEX_ROW_BYTES / 2);
+}
+
+/*
+ * @brief		Разбирает образец поиска: "текст" или байты в hex ("de ad be ef")
+ * @return		Длина образца в out, 0 если он пуст
+ */
+int editorHexParsePattern(const char *s, unsigned char *out, int cap)
+{
+	int len = 0;
+
+	if (s[0] != '"') {
+		int nibbles = 0;
+		const char *p;
+		for (p = s; *p && len < cap; p++) {
+			if (*p == ' ') continue;
+			if (!isxdigit((unsigned char) *p)) break;
+			int v = isdigit((unsigned char) *p) ? *p - '0' : (tolower((unsigned char) *p) - 'a' + 10);
+			if (nibbles++ % 2 == 0) out[len] = v << 4;
+			else out[len++] |= v;
+		}
+		if (*p == '\0' && nibbles % 2 == 0) return len;
+		len = 0;
+	} else {
+		s++;
+	}
+
+	/* не похоже на hex -- ищется сам текст */
+	while (*s && len < cap) out[len++] = *s++;
+	if (len > 0 && out[len - 1] == '"') len--;
+	return len;
+}
+
+/*
+ * @brief		Ищет образец в файле кусками по HEX_FIND_CHUNK байт
+ * @return		Смещение первого вхождения, целиком лежащего в [from, limit), или -1
+ */
+long long editorHexSearch(editor_buffer_t *b, const unsigned char *pattern, int len,
+							size_t from, size_t limit)
+{
+	unsigned char *buf = malloc(HEX_FIND_CHUNK + len);
+	long long found = -1;
+
+	while (from < limit && found == -1) {
+		/* куски перекрываются на len - 1 байт, чтобы не потерять вхождение на стыке */
+		size_t want = HEX_FIND_CHUNK + len - 1;
+		if (want > limit - from) want = limit - from;
+		ssize_t n = pread(b->hex_fd, buf, want, from);
+		if (n < len) break;
+
+		unsigned char *hit = memmem(buf, n, pattern, len);
+		if (hit) found = from + (hit - buf);
+		from += n - len + 1;
+	}
+	free(buf);
+	return found;
+}
+
+void editorHexFind()
+{
+	editor_buffer_t *b = E.buf;
+	char *query = editorPrompt("Find bytes (de ad be ef) or \"text\": %s (ESC to cancel)", NULL);
+	if (query == NULL) return;
+
+	unsigned char pattern[256];
+	int len = editorHexParsePattern(query, pattern, sizeof(pattern));
+	free(query);
+	editorHexRefresh(b);
+	if (len == 0 || b->hex_size == 0) return;
+
+	/* поиск идёт от байта за курсором до конца и затем с начала файла */
+	size_t from = b->hex_cursor + 1;
+	long long found = editorHexSearch(b, pattern, len, from, b->hex_size);
+	if (found == -1) {
+		size_t end = from + len - 1 < b->hex_size ? from + len - 1 : b->hex_size;
+		found = editorHexSearch(b, pattern, len, 0, end);
+	}
+
+	if (found == -1) {
+		editorSetStatusMessage("Not found");
+		return;
+	}
+	b->hex_cursor = found;
+	editorSetStatusMessage("Found at 0x%llx", (unsigned long long) b->hex_cursor);
+}
+
+void editorHexGoTo()
+{
+	char *target = editorPrompt("Go to offset (0x.., decimal or N%%): %s (ESC to cancel)", NULL);
+	if (target == NULL) return;
+
+	char *end;
+	unsigned long long n = strtoull(target, &end, 0);
+	if (end == target) {
+		editorSetStatusMessage("Bad offset: %s", target);
+	} else {
+		if (*end == '%') n = E.buf->hex_size * (n > 100 ? 100 : n) / 100;
+		if (n >= E.buf->hex_size) n = E.buf->hex_size ? E.buf->hex_size - 1 : 0;
+		E.buf->hex_cursor = n;
+		E.buf->hex_top = (n / HEX_ROW_BYTES > (size_t) E.screen_rows / 2) ?
+							n / HEX_ROW_BYTES - E.screen_rows / 2 : 0;
+	}
+	free(target);
+}
+
+/*
+ * @brief		Обрабатывает клавиши перемещения и поиска в hex-режиме
+ * @return		1, если клавиша обработана
+ */
+int editorHexKey(int c)
+{
+	editor_buffer_t *b = E.buf;
+	size_t page = (size_t) E.screen_rows * HEX_ROW_BYTES;
+	size_t last = b->hex_size ? b->hex_size - 1 : 0;
+
+	switch (c) {
+		case ARROW_LEFT:
+			if (b->hex_cursor > 0) b->hex_cursor--;
+			break;
+		case ARROW_RIGHT:
+			if (b->hex_cursor < last) b->hex_cursor++;
+			break;
+		case ARROW_UP:
+			if (b->hex_cursor >= HEX_ROW_BYTES) b->hex_cursor -= HEX_ROW_BYTES;
+			break;
+		case ARROW_DOWN:
+			if (b->hex_cursor + HEX_ROW_BYTES <= last) b->hex_cursor += HEX_ROW_BYTES;
+			break;
+		case PAGE_UP:
+			b->hex_cursor = (b->hex_cursor > page) ? b->hex_cursor - page : 0;
+			break;
+		case PAGE_DOWN:
+			b->hex_cursor = (b->hex_cursor + page < last) ? b->hex_cursor + page : last;
+			break;
+		case HOME_KEY:
+			b->hex_cursor -= b->hex_cursor % HEX_ROW_BYTES;
+			break;
+		case END_KEY:
+			b->hex_cursor += HEX_ROW_BYTES - 1 - b->hex_cursor % HEX_ROW_BYTES;
+			if (b->hex_cursor > last) b->hex_cursor = last;
+			break;
+		case CTRL_KEY('f'):
+			editorHexFind();
+			break;
+		case CTRL_KEY('g'):
+			editorHexGoTo();
+			break;
+		case CTRL_KEY('w'):
+		case CTRL_KEY('d'):
+		case CTRL_KEY('u'):
+			editorSetStatusMessage("Not available in hex view");
+			break;
+		default:
+			return 0;
 	}
-
-	abAppend(ab, "\x1b[m", 3);
-	abAppend(ab, "\r\n", 2);
+	return 1;
 }
 
-void editorDrawMessageBar(struct abuf_s *ab)
-{
-	abAppend(ab, "\x1b[K", 3);
-	int msg_len = strlen(E.status_msg);
-
-	if (msg_len > E.screen_cols) msg_len = E.screen_cols;
+/* *** Render scheduling *** */
 
-	if (msg_len && time(NULL) - E.status_msg_time < 5) {
-		abAppend(ab, E.status_msg, msg_len);
-	}
-}
+/*
+ * Изменения состояния только помечают экран как устаревший, а кадр рисуется,
+ * когда редактор ждёт ввода: сначала разбирается весь накопившийся ввод, и
+ * кадры идут не чаще одного за EDITOR_FRAME_MS. Так при автоповторе клавиш
+ * задержка ввода не растёт вместе со временем отрисовки. Планировщик также
+ * будит цикл ожидания, чтобы убрать истёкшее сообщение и показать прогресс
+ * фоновой загрузки.
+ */
 
-void editorRefreshScreen()
+void editorScheduleRedraw()
 {
-	editorScroll();
-
-	struct abuf_s ab = ABUF_INIT;
-
-	abAppend(&ab, "\x1b[?25l", 6);
-	abAppend(&ab, "\x1b[H", 3);
-
-	editorDrawRows(&ab);
-	editorDrawStatusBar(&ab);
-	editorDrawMessageBar(&ab);
-
-	char buf[32];
-	snprintf(buf, sizeof(buf), "\x1b[%d;%dH",   (E.cy - E.row_offset) + 1, 
-												(E.render_cx - E.col_offset) + 1);
-	abAppend(&ab, buf, strlen(buf));
-
-	abAppend(&ab, "\x1b[?25h", 6);
-
-	write(STDOUT_FILENO, ab.b, ab.len);
-	abFree(&ab);
+	E.redraw = 1;
 }
 
-void editorSetStatusMessage(const char *fmt, ...)
+/*
+ * @brief		Рисует кадр, если он нужен и выдержан интервал между кадрами
+ * @return		Через сколько миллисекунд нужна следующая проверка, -1 если не нужна
+ */
+int editorRenderTick()
 {
-	va_list arg_print;
-	va_start(arg_print, fmt);
-	vsnprintf(E.status_msg, sizeof(E.status_msg), fmt, arg_print);
-	va_end(arg_print);
+	long long now = editorNowMs();
+	long long wait = -1;
+
+	if (E.status_msg_expiring) {
+		long long expire = E.status_msg_ms + EDITOR_STATUS_MSG_MS;
+		if (now >= expire) {
+			E.status_msg_expiring = 0;
+			E.redraw = 1;
+		} else {
+			wait = expire - now;
+		}
+	}
+
+	if (E.redraw) {
+		long long next = E.last_frame_ms + EDITOR_FRAME_MS;
+		if (now >= next) editorRefreshScreen();
+		else if (wait < 0 || next - now < wait) wait = next - now;
+	}
 
-	E.status_msg_time = time(NULL);
+	return (int) wait;
 }
 
 /* *** Input *** */
 
 char *editorPrompt(char *prompt, void (* callback)(char *, int))
+{
+	return editorPromptEx(prompt, callback, 0);
+}
+
+char *editorPromptEx(char *prompt, void (* callback)(char *, int), int allow_empty)
 {
 	size_t buf_size = 128;
 	char *buf = malloc(buf_size);
@@ -999,7 +8959,6 @@ char *editorPrompt(char *prompt, void (* callback)(char *, int))
 
 	while (1) {
 		editorSetStatusMessage(prompt, buf);
-		editorRefreshScreen();
 
 
 		int c = editorReadKey();
@@ -1012,13 +8971,13 @@ char *editorPrompt(char *prompt, void (* callback)(char *, int))
 			free(buf);
 			return NULL;
 		} else if (c == '\r') {
-			if (buf_len != 0) {
+			if (buf_len != 0 || allow_empty) {
 				editorSetStatusMessage("");
 				if (callback)
 					callback(buf, c);
 				return buf;
 			}
-		} else if (!iscntrl(c) && c < 128) {
+		} else if (c < 256 && (c >= 128 || !iscntrl(c))) {
 			if (buf_len == buf_size - 1) {
 				buf_size *= 2;
 				buf = realloc(buf, buf_size);
@@ -1034,41 +8993,53 @@ char *editorPrompt(char *prompt, void (* callback)(char *, int))
 
 void editorMoveCursor(int key) 
 {
-	editor_row_t *row = (E.cy >= E.num_rows) ? NULL : & E.row[E.cy];
+	editor_row_t *row = (E.buf->cy >= E.buf->num_rows) ? NULL : & E.buf->row[E.buf->cy];
 
 	switch (key) {
 		case ARROW_UP:
-			if (E.cy != 0) {
-				E.cy--;
+			if (E.buf->cy != 0) {
+				E.buf->cy--;
 			}
 			break;
 		case ARROW_LEFT:
-			if (E.cx != 0) {
-				E.cx--;
-			} else if (E.cx == 0) {
-				E.cy--;
-				E.cx = E.row[E.cy].size;
+			if (E.buf->cx != 0) {
+				E.buf->cx = utf8Prev(row->chars, E.buf->cx);
+			} else if (E.buf->cy > 0) {
+				E.buf->cy--;
+				E.buf->cx = E.buf->row[E.buf->cy].size;
 			}
 			break;
 		case ARROW_DOWN:
-			if (E.cy < E.num_rows) {
-				E.cy++;
+			if (E.buf->cy < E.buf->num_rows) {
+				E.buf->cy++;
 			}
 			break;
 		case ARROW_RIGHT:
-			if (row && E.cx < row->size) {
-				E.cx++;
-			} else if (row && E.cx == row->size) {
-				E.cy++;
-				E.cx = 0;
+			if (row && E.buf->cx < row->size) {
+				E.buf->cx = utf8Next(row->chars, row->size, E.buf->cx);
+			} else if (row && E.buf->cx == row->size) {
+				E.buf->cy++;
+				E.buf->cx = 0;
 			}
 			break;
 	}
 
-	row = (E.cy >= E.num_rows) ? NULL : &E.row[E.cy];
+	editorClampCursor();
+}
+
+/*
+ * @brief		Не даёт курсору выйти за конец строки или встать внутрь символа UTF-8
+ */
+void editorClampCursor()
+{
+	editor_row_t *row = (E.buf->cy >= E.buf->num_rows) ? NULL : &E.buf->row[E.buf->cy];
 	int row_len = row ? row->size : 0;
-	if (E.cx > row_len) {
-		E.cx = row_len;
+	if (E.buf->cx > row_len) {
+		E.buf->cx = row_len;
+	}
+	if (row && !row->ascii) {
+		while (E.buf->cx > 0 && E.buf->cx < row->size && utf8IsCont((unsigned char) row->chars[E.buf->cx]))
+			E.buf->cx--;
 	}
 }
 
@@ -1077,20 +9048,37 @@ void editorProccessKeypress()
 	static int  quit_times = EDIOTR_QUIT_TIMES;
 	int c = editorReadKey();
 
+	editorUndoBeginGroup();
+
+	/* в hex-режиме перемещение и поиск идут по байтам файла */
+	if (E.buf->hex && editorHexKey(c)) return;
+	if (E.buf->grep && c == '\r') {
+		editorGrepOpen();
+		return;
+	}
+
 	switch(c) {
 		case '\r':
+			if (!editorCheckWritable()) break;
 			editorInsertNewLine();
 			break;
 
 		case CTRL_KEY('q'):
-			if (E.dirty && quit_times > 0) {
+			/* клиент сервера отключается, буферы остаются открытыми */
+			if (E.server) {
+				editorServerDetach();
+				return;
+			}
+			if (editorAnyDirty() && quit_times > 0) {
 				editorSetStatusMessage("WARNING!!! File has unsaved changes. ", 
 									"Press CTRL + Q %d more times for quit.", quit_times);
 				quit_times--;
 				return;
 			}
-			write(STDOUT_FILENO, "\x1b[2J", 4);
-			write(STDOUT_FILENO, "\x1b[H", 3);
+			for (int j = 0; j < E.num_buffers; j++)
+				editorJournalDiscard(E.buffers[j]);
+			editorWriteOut("\x1b[2J", 4);
+			editorWriteOut("\x1b[H", 3);
 			exit(0);
 			break;
 
@@ -1099,11 +9087,11 @@ void editorProccessKeypress()
 			break;
 
 		case HOME_KEY:
-			E.cx = 0;
+			E.buf->cx = 0;
 			break;
 		case END_KEY:
-			if (E.cy < E.num_rows) {
-				E.cx = E.row[E.cy].size;
+			if (E.buf->cy < E.buf->num_rows) {
+				E.buf->cx = E.buf->row[E.buf->cy].size;
 			}
 			break;
 		
@@ -1111,28 +9099,99 @@ void editorProccessKeypress()
 			editorFind();
 			break;
 
+		case CTRL_KEY('r'):
+			if (!editorCheckWritable()) break;
+			editorReplaceAll();
+			break;
+
+		case CTRL_KEY('z'):
+			if (!editorCheckWritable()) break;
+			editorUndo();
+			break;
+
+		case CTRL_KEY('w'):
+			editorToggleWrap();
+			break;
+
+		case CTRL_KEY('g'):
+			editorGoTo();
+			break;
+
+		case CTRL_KEY('u'):
+			editorToggleFollow();
+			break;
+
+		case CTRL_KEY('d'):
+			editorToggleDiff();
+			break;
+
+		case CTRL_KEY('y'):
+			editorToggleHex();
+			break;
+
+		case CTRL_KEY('b'):
+			editorBracketJump();
+			break;
+
+		case CTRL_KEY('j'):
+			editorTransformLines();
+			break;
+
+		case CTRL_KEY('_'):
+			editorProjectSearch();
+			break;
+
+		case CTRL_KEY(' '):
+			editorToggleMark();
+			break;
+		case CTRL_KEY('c'):
+			editorClipCopy();
+			break;
+		case CTRL_KEY('x'):
+			editorClipCut();
+			break;
+		case CTRL_KEY('v'):
+			editorClipPaste();
+			break;
+
+		case CTRL_KEY('t'):
+			editorMacroToggleRecord();
+			break;
+		case CTRL_KEY('e'):
+			if (macro_pos < 0 && editorMacroReady()) editorMacroPlay(1, NULL);
+			break;
+		case CTRL_KEY('a'):
+			if (macro_pos < 0) editorMacroApply();
+			break;
+
+		case CTRL_KEY('o'):
+			editorOpenPrompt();
+			break;
+		case CTRL_KEY('n'):
+			editorSwitchBuffer(editorBufferIndex(E.buf) + 1);
+			break;
+		case CTRL_KEY('p'):
+			editorSwitchBuffer(editorBufferIndex(E.buf) - 1);
+			break;
+		case CTRL_KEY('k'):
+			editorCloseBuffer();
+			break;
+
 		case BACKSPACE:
 		case DEL_KEY:
 		case CTRL_KEY('h'):
+				if (!editorCheckWritable()) break;
 				if (c == DEL_KEY) editorMoveCursor(ARROW_RIGHT);
 				editorDeleteChar();
 			break;
 
 		case PAGE_DOWN:
 		case PAGE_UP:
-			{
-				if (c == PAGE_UP) {
-					E.cy = E.row_offset;
-				} else if (c == PAGE_DOWN) {
-					E.cy = E.row_offset + E.screen_rows - 1;
-					if (E.cy > E.num_rows) E.cy = E.num_rows;
-				}
-
-				int times = E.screen_rows;
-				while (times--) {
-					editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-				}
-			}
+			/* курсор переходит на экран выше или ниже сразу, без пошагового движения */
+			if (c == PAGE_UP)
+				editorCursorToRow(E.buf->row_offset - E.screen_rows);
+			else
+				editorCursorToRow(E.buf->row_offset + 2 * E.screen_rows - 1);
 			break;
 
 		case ARROW_LEFT:
@@ -1143,51 +9202,511 @@ void editorProccessKeypress()
 			break;
 
 		case CTRL_KEY('l'):
+			editorFrameInvalidate();
+			break;
+
 		case '\x1b':
+			E.buf->mark = 0;
 			break;
 
 		default:
-			editorInsertChar(c);
+			if (!editorCheckWritable()) break;
+			if (c >= 0xC0 && c < 256) editorInsertUtf8(c);
+			else editorInsertChar(c);
 			break;
 	}
 
 	quit_times = EDIOTR_QUIT_TIMES;;
 }
 
+/* *** Server *** */
+
+/*
+ * Режим сервера: editor --server уходит в фон и держит буферы открытыми,
+ * а editor -c файл... подключается к нему через unix-сокет. Клиент только
+ * пересылает ввод и размер терминала, сервер присылает готовые байты
+ * вывода -- благодаря сравнению кадров по строкам это только изменённые
+ * строки экрана. Уже загруженный файл при повторном открытии не читается
+ * заново: клиент просто переключается на его буфер. ^Q отключает клиента,
+ * буферы остаются на сервере до следующего подключения.
+ *
+ * Сообщение клиента: байт типа, uint32 длины и данные.
+ */
+
+#define SERVER_MSG_HEADER 5
+#define SERVER_MSG_MAX (1 << 20)
+#define SERVER_IO_STALL_MS 2000
+
+enum server_msg {
+	SERVER_MSG_HELLO = 1,	/* int32 rows, int32 cols, каталог и имена файлов через '\0' */
+	SERVER_MSG_INPUT,		/* байты с клавиатуры */
+	SERVER_MSG_RESIZE		/* int32 rows, int32 cols */
+};
+
+/*
+ * @brief		Выбирает путь сокета; запасной каталог в /tmp должен быть
+ *				личным каталогом пользователя с правами 0700
+ * @return		-1, если запасной каталог чужой или доступен другим
+ */
+int editorSocketPath(char *buf, size_t size)
+{
+	char *env = getenv("EDITOR_SOCKET");
+	char *runtime = getenv("XDG_RUNTIME_DIR");
+
+	if (env && *env) {
+		snprintf(buf, size, "%s", env);
+		return 0;
+	}
+	if (runtime && *runtime) {
+		snprintf(buf, size, "%s/editor.sock", runtime);
+		return 0;
+	}
+
+	char dir[64];
+	snprintf(dir, sizeof(dir), "/tmp/editor-%d", (int) getuid());
+	if (mkdir(dir, 0700) == -1 && errno != EEXIST) return -1;
+
+	struct stat st;
+	if (lstat(dir, &st) == -1) return -1;
+	if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+		errno = EPERM;
+		return -1;
+	}
+	snprintf(buf, size, "%s/editor.sock", dir);
+	return 0;
+}
+
+/*
+ * @brief		Проверяет, что на другом конце сокета процесс того же пользователя
+ */
+int editorPeerIsOwner(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) return 0;
+	return cred.uid == getuid();
+}
+
+int editorSocketAddr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int editorServerConnect(const char *path)
+{
+	struct sockaddr_un addr;
+	if (editorSocketAddr(&addr, path) == -1) return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) return -1;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int editorServerListen(const char *path)
+{
+	struct sockaddr_un addr;
+	if (editorSocketAddr(&addr, path) == -1) return -1;
+
+	/* к сокету упавшего сервера никто не подключится, его можно заменить */
+	int probe = editorServerConnect(path);
+	if (probe != -1) {
+		close(probe);
+		errno = EADDRINUSE;
+		return -1;
+	}
+	unlink(path);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) return -1;
+
+	/* подключаться к серверу может только его владелец */
+	mode_t mask = umask(0077);
+	int ok = bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0 && listen(fd, 4) == 0;
+	umask(mask);
+	if (!ok) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * @brief		Ждёт готовности неблокирующего дескриптора
+ * @return		-1, если за SERVER_IO_STALL_MS он так и не стал готов
+ */
+int editorWaitReady(int fd, short events)
+{
+	struct pollfd pfd = { fd, events, 0 };
+	int n;
+	do n = poll(&pfd, 1, SERVER_IO_STALL_MS);
+	while (n == -1 && errno == EINTR);
+	return (n > 0) ? 0 : -1;
+}
+
+int editorReadAll(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	while (len > 0) {
+		ssize_t n = read(fd, p, len);
+		if (n == -1 && errno == EINTR) continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (editorWaitReady(fd, POLLIN) == -1) return -1;
+			continue;
+		}
+		if (n <= 0) return -1;
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int editorWriteAll(int fd, const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			/* клиент, переставший читать, не должен останавливать сервер */
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && editorWaitReady(fd, POLLOUT) == 0)
+				continue;
+			return -1;
+		}
+		data += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int editorSendMessage(int fd, int type, const char *data, uint32_t len)
+{
+	char header[SERVER_MSG_HEADER];
+	header[0] = type;
+	memcpy(header + 1, &len, sizeof(len));
+	if (editorWriteAll(fd, header, sizeof(header)) == -1) return -1;
+	return editorWriteAll(fd, data, len);
+}
+
+void editorServerDetach()
+{
+	if (E.client_fd < 0) return;
+	close(E.client_fd);
+	E.client_fd = -1;
+	E.input_len = E.input_pos = 0;
+}
+
+void editorServerResize(const char *data)
+{
+	int32_t size[2];
+	memcpy(size, data, sizeof(size));
+	if (size[0] < 3 || size[1] < 1) return;
+
+	E.screen_rows = size[0] - 2;
+	E.screen_cols = size[1];
+	editorFrameInvalidate();
+	editorScheduleRedraw();
+}
+
+/*
+ * @brief		Открывает файл клиента по пути относительно его каталога
+ */
+void editorServerOpen(const char *cwd, const char *name)
+{
+	size_t size = strlen(cwd) + strlen(name) + 2;
+	char *path = malloc(size);
+	if (name[0] == '/') snprintf(path, size, "%s", name);
+	else snprintf(path, size, "%s/%s", cwd, name);
+
+	char *real = realpath(path, NULL);
+	if (real) {
+		free(path);
+		path = real;
+	}
+	editorOpenBuffer(path);
+	free(path);
+}
+
+void editorServerHello(const char *data, uint32_t len)
+{
+	if (len < 2 * sizeof(int32_t)) return;
+	editorServerResize(data);
+
+	const char *end = data + len;
+	const char *cwd = data + 2 * sizeof(int32_t);
+	const char *name = cwd + strlen(cwd) + 1;
+	for (; name < end; name += strlen(name) + 1)
+		editorServerOpen(cwd, name);
+}
+
+/*
+ * @brief		Принимает клиента или одно его сообщение
+ */
+void editorServerReceive()
+{
+	if (E.client_fd < 0) {
+		E.client_fd = accept4(E.listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if (E.client_fd >= 0 && !editorPeerIsOwner(E.client_fd)) {
+			close(E.client_fd);
+			E.client_fd = -1;
+			return;
+		}
+		E.input_len = E.input_pos = 0;
+		editorFrameInvalidate();
+		editorScheduleRedraw();
+		return;
+	}
+
+	char header[SERVER_MSG_HEADER];
+	uint32_t len;
+	if (editorReadAll(E.client_fd, header, sizeof(header)) == -1) {
+		editorServerDetach();
+		return;
+	}
+	memcpy(&len, header + 1, sizeof(len));
+	if (len > SERVER_MSG_MAX) {
+		editorServerDetach();
+		return;
+	}
+
+	char *data = malloc(len + 1);
+	if (editorReadAll(E.client_fd, data, len) == -1) {
+		free(data);
+		editorServerDetach();
+		return;
+	}
+	data[len] = '\0';
+
+	switch (header[0]) {
+		case SERVER_MSG_HELLO:
+			editorServerHello(data, len);
+			break;
+		case SERVER_MSG_INPUT:
+			if (E.input_pos == E.input_len) E.input_len = E.input_pos = 0;
+			E.input = realloc(E.input, E.input_len + len);
+			memcpy(E.input + E.input_len, data, len);
+			E.input_len += len;
+			break;
+		case SERVER_MSG_RESIZE:
+			if (len >= 2 * sizeof(int32_t)) editorServerResize(data);
+			break;
+	}
+	free(data);
+}
+
+/*
+ * @brief		Открывает сокет и уводит процесс в фон
+ */
+void editorServerStart()
+{
+	char path[108];
+	if (editorSocketPath(path, sizeof(path)) == -1) {
+		fprintf(stderr, "editor: no private socket directory: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	E.listen_fd = editorServerListen(path);
+	if (E.listen_fd == -1) {
+		fprintf(stderr, "editor: can't listen on %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+
+	pid_t pid = fork();
+	if (pid == -1) die("fork");
+	if (pid > 0) {
+		printf("editor: server listening on %s\n", path);
+		exit(0);
+	}
+
+	setsid();
+	int null = open("/dev/null", O_RDWR);
+	dup2(null, STDIN_FILENO);
+	dup2(null, STDOUT_FILENO);
+	dup2(null, STDERR_FILENO);
+	if (null > STDERR_FILENO) close(null);
+
+	signal(SIGPIPE, SIG_IGN);
+	E.server = 1;
+	E.client_fd = -1;
+}
+
+/*
+ * @brief		Подключается к серверу и пересылает ввод и вывод, пока сервер
+ *				не отключит клиента
+ * @return		-1, если сервер не запущен
+ */
+int editorClientRun(int argc, char *argv[])
+{
+	char path[108];
+	if (editorSocketPath(path, sizeof(path)) == -1) return -1;
+
+	int fd = editorServerConnect(path);
+	if (fd == -1) return -1;
+	if (!editorPeerIsOwner(fd)) {
+		fprintf(stderr, "editor: %s belongs to another user\n", path);
+		exit(1);
+	}
+
+	enableRawMode();
+
+	int32_t size[2];
+	int rows, cols;
+	if (getWindowSize(&rows, &cols) == -1) die("getWindowSize");
+	size[0] = rows;
+	size[1] = cols;
+
+	char cwd[PATH_MAX];
+	if (getcwd(cwd, sizeof(cwd)) == NULL) die("getcwd");
+
+	struct abuf_s hello = ABUF_INIT;
+	abAppend(&hello, (char *) size, sizeof(size));
+	abAppend(&hello, cwd, strlen(cwd) + 1);
+	for (int i = 0; i < argc; i++)
+		abAppend(&hello, argv[i], strlen(argv[i]) + 1);
+	editorSendMessage(fd, SERVER_MSG_HELLO, hello.b, hello.len);
+	abFree(&hello);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = editorSigwinch;
+	sigaction(SIGWINCH, &sa, NULL);
+
+	char buf[1 << 16];
+	while (1) {
+		if (E.resized) {
+			E.resized = 0;
+			if (getWindowSize(&rows, &cols) == 0) {
+				size[0] = rows;
+				size[1] = cols;
+				editorSendMessage(fd, SERVER_MSG_RESIZE, (char *) size, sizeof(size));
+			}
+		}
+
+		struct pollfd pfd[2] = { { STDIN_FILENO, POLLIN, 0 }, { fd, POLLIN, 0 } };
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR) continue;
+			break;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+			if (n > 0 && editorSendMessage(fd, SERVER_MSG_INPUT, buf, n) == -1) break;
+		}
+		if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+			ssize_t n = read(fd, buf, sizeof(buf));
+			if (n <= 0) break;
+			editorWriteAll(STDOUT_FILENO, buf, n);
+		}
+	}
+
+	write(STDOUT_FILENO, "\x1b[2J", 4);
+	write(STDOUT_FILENO, "\x1b[H", 3);
+	exit(0);
+}
+
 /* *** Init *** */
 
-void initEditor() {
-	E.cx = 0;
-	E.cy = 0;
-	E.render_cx = 0;
-	E.row_offset = 0;
-	E.col_offset = 0;
-	E.num_rows = 0;
-	E.dirty = 0;
-	E.file_name = NULL;
-	E.row = NULL;
-	E.status_msg[0] = '\0';
-	E.status_msg_time = 0;
-	E.syntax = NULL;
+void editorSigwinch(int sig)
+{
+	(void) sig;
+	E.resized = 1;
+}
 
+void editorSigHangup(int sig)
+{
+	E.hangup = sig;
+}
 
+void editorHandleResize()
+{
+	E.resized = 0;
 	if (getWindowSize(&E.screen_rows, &E.screen_cols) == -1) die("getWindowSize");
 	E.screen_rows -= 2;
+	editorFrameInvalidate();
+	/* индекс переноса перестроится по новой ширине при следующей отрисовке */
+}
+
+void initEditor() {
+	E.buffers = NULL;
+	E.num_buffers = 0;
+	E.buf = editorBufferNew();
+	E.status_msg[0] = '\0';
+	E.status_msg_ms = 0;
+	E.status_msg_expiring = 0;
+	E.redraw = 1;
+	E.last_frame_ms = 0;
+	E.resized = 0;
+	E.hangup = 0;
+	E.view_clock = 0;
+	E.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+	E.mem_budget = (size_t) EDITOR_MEM_BUDGET_MB << 20;
+	char *budget = getenv("EDITOR_MEM_BUDGET_MB");
+	if (budget && atol(budget) > 0) E.mem_budget = (size_t) atol(budget) << 20;
+
+	/* режим экономии памяти: render и hl только у строк вокруг курсора */
+	char *cache_rows = getenv("EDITOR_RENDER_CACHE_ROWS");
+	E.render_cache_rows = (cache_rows && atoi(cache_rows) > 0) ? atoi(cache_rows) : 0;
+
+	/* у сервера размер экрана приходит от клиента */
+	if (E.server) {
+		E.screen_rows = 24;
+		E.screen_cols = 80;
+	} else if (getWindowSize(&E.screen_rows, &E.screen_cols) == -1) die("getWindowSize");
+	E.screen_rows -= 2;
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = editorSigwinch;
+	sigaction(SIGWINCH, &sa, NULL);
+
+	sa.sa_handler = editorSigHangup;
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
 }
 
 int main(int argc, char *argv[]) 
 {
-	enableRawMode();
+	int first = 1;
+	if (argc > 1 && !strcmp(argv[1], "--server")) {
+		editorServerStart();
+		first = 2;
+	} else if (argc > 1 && !strcmp(argv[1], "-c")) {
+		/* без запущенного сервера файлы открываются как обычно */
+		editorClientRun(argc - 2, argv + 2);
+		first = 2;
+	}
+
+	if (!E.server) enableRawMode();
 	initEditor();
 
-	if (argc >= 2) {
-		editorOpen(argv[1]);
+	if (E.server) {
+		char cwd[PATH_MAX];
+		if (getcwd(cwd, sizeof(cwd)) == NULL) die("getcwd");
+		for (int i = first; i < argc; i++)
+			editorServerOpen(cwd, argv[i]);
+	} else {
+		for (int i = first; i < argc; i++) {
+			if (i > first) editorBufferAdd();
+			if (editorOpen(argv[i]) == -1) die("fopen");
+		}
 	}
+	if (E.num_buffers > 1) editorSwitchBuffer(0);
 
-	editorSetStatusMessage("HELP: Ctrl + S = Save | Ctrl + Q = quit | Ctr + F = find");
+	editorSetStatusMessage("HELP: ^S save | ^Q quit | ^F find | ^R repl | ^Z undo | ^W wrap | ^O/^N/^P/^K buf");
 
 	while (1) {
-		editorRefreshScreen();
+		editorJournalOffer();
+		editorScheduleRedraw();
 		editorProccessKeypress();
 	}
 